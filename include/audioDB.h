@@ -48,6 +48,12 @@ extern "C" {
 #define COM_INDEX "--INDEX"
 #define COM_SAMPLE "--SAMPLE"
 #define COM_LISZT "--LISZT"
+#define COM_BULKPACK "--BULKPACK"
+#define COM_BULKLOAD "--BULKLOAD"
+#define COM_COMPACT "--COMPACT"
+#define COM_RESIZE "--RESIZE"
+#define COM_RESTORE "--RESTORE"
+#define COM_PACK "--PACK"
 
 // parameters
 #define COM_DATABASE "--database"
@@ -91,6 +97,13 @@ extern "C" {
 #define O2_MAXDIM (20000U)
 #define O2_MAXNN (1000000U)
 #define O2_MAXSEQLEN (8000U)            // maximum feature vectors in a sequence
+#define O2_MASS_MIN_SEQLEN (128U)       // sequence length at which FFT distance profiles are used
+#define O2_MASS_QUERY_MEMORY (268435456U) // bytes of query spectra held per pass of the FFT search (256MB)
+#define O2_MASS_TASK_RESULTS (1048576U) // most results held by a thread for one task of the FFT search
+#define O2_TASKS_PER_THREAD (8U)        // tasks per thread into which the scheduler splits the tracks
+#define O2_MASS_TASKS_AHEAD (2U)        // tasks per thread the FFT search may run ahead of the oldest unfinished one
+#define O2_INDEX_SHINGLE_MEMORY (268435456U) // bytes of shingles built ahead of their insertion into an index (256MB)
+#define O2_DEADLINE_ROUNDS (16U)        // rounds in which a query with a deadline visits the tracks
 #define O2_MAXTRACKS (1000000U)           // maximum number of tracks
 
 #define O2_MAXDOTPRODUCTMEMORY (sizeof(O2_REALTYPE)*O2_MAXSEQLEN*O2_MAXSEQLEN) // 512MB
@@ -113,10 +126,34 @@ extern "C" {
 #define O2_TRACK_QUERY (0x10U)
 #define O2_N_SEQUENCE_QUERY (0x20U)
 #define O2_ONE_TO_ONE_N_SEQUENCE_QUERY (0x40U)
+#define O2_WARP_SEQUENCE_QUERY (0x80U)
+
+// Database tables, for initDBHeader() and map_tables(); on LARGE_ADB
+// databases the times, power and features tables hold file names
+#define O2_TABLE_FILE (0x1U)
+#define O2_TABLE_TRACK (0x2U)
+#define O2_TABLE_TIMES (0x4U)
+#define O2_TABLE_POWER (0x8U)
+#define O2_TABLE_L2NORM (0x10U)
+#define O2_TABLE_FEATURES (0x20U)
+#define O2_TABLE_ALL (0x3fU)
 
 // Error Codes
 #define O2_ERR_KEYNOTFOUND (0xFFFFFF00)
 
+// Key hash (dbName.keys), binary keyList, container,
+// binary times, compact times (dbName.times), snapshot and pack
+// (dbName.pack) magic numbers
+#define O2_KEYHASH_MAGIC (('A' << 24) | ('D' << 16) | ('B' << 8) | 'H')
+#define O2_KEYLIST_MAGIC (('A' << 24) | ('D' << 16) | ('B' << 8) | 'K')
+#define O2_BULK_MAGIC (('A' << 24) | ('D' << 16) | ('B' << 8) | 'C')
+#define O2_TIMES_MAGIC (('A' << 24) | ('D' << 16) | ('B' << 8) | 'T')
+#define O2_COMPACT_TIMES_MAGIC (('A' << 24) | ('D' << 16) | ('B' << 8) | 'R')
+#define O2_SNAPSHOT_MAGIC (('A' << 24) | ('D' << 16) | ('B' << 8) | 'S')
+#define O2_PACK_MAGIC_V1 (('A' << 24) | ('D' << 16) | ('B' << 8) | 'P')
+#define O2_PACK_MAGIC (('A' << 24) | ('D' << 16) | ('B' << 8) | 'Q') // entries record their files' size and mtime
+#define O2_ZINDEX_MAGIC (('A' << 24) | ('D' << 16) | ('B' << 8) | 'Z')
+
 // Macros
 #define O2_ACTION(a) (strcmp(command,a)==0)
 
@@ -128,14 +165,6 @@ extern "C" {
 
 #define ENSURE_STRING(x) ((x) ? (x) : "")
 
-#define CHECKED_MMAP(type, var, start, length) \
-  { void *tmp = mmap(0, length, (PROT_READ | (forWrite ? PROT_WRITE : 0)), MAP_SHARED, dbfid, (start)); \
-    if(tmp == (void *) -1) { \
-      error("mmap error for db table", #var, "mmap"); \
-    } \
-    var = (type) tmp; \
-  }
-
 #define CHECKED_READ(fd, buf, count) \
   { size_t tmpcount = count; \
     ssize_t tmp = read(fd, buf, tmpcount); \
@@ -167,6 +196,127 @@ extern "C" {
 #define INSERT_FILETABLE_STRING(TABLE, STR) \
     strncpy(TABLE + dbH->numFiles*O2_FILETABLE_ENTRY_SIZE, STR, strlen(STR));
 
+// Query result cache entries
+typedef struct {
+  std::string ikey;
+  uint32_t qpos;
+  uint32_t ipos;
+  double dist;
+} CachedResult;
+
+// Time spent in one phase of a command (--stats)
+typedef struct {
+  const char *name;
+  double wall;
+  double cpu;
+} StatsPhase;
+
+// A database queried as part of a federated query: its tracks are
+// numbered from base
+typedef struct {
+  char *name;
+  adb_t *adb;
+  Uns32T base;
+  Uns32T numFiles;
+} Shard;
+
+// Positions qstart, qstart+qhop, ... (nq of them) of a query in the
+// FFT sequence search, with their norms, powers and spectra
+typedef struct {
+  const adb_datum_t *datum;
+  ReporterBase *reporter;
+  const double *qn;
+  const double *qp;
+  Uns32T qstart;
+  Uns32T nq;
+  Uns32T qhop;
+  double *qspectra;
+} MassBatch;
+
+// A result of the FFT sequence search, held by a thread until the
+// results of the tasks before its own have been reported
+typedef struct {
+  ReporterBase *reporter;
+  Uns32T trackID;
+  Uns32T qpos;
+  Uns32T spos;
+  double dist;
+} MassResult;
+
+// One thread's buffers in the FFT sequence search, and the results of
+// its current task, if they are not reported at once
+typedef struct {
+  double *fvp;
+  size_t nfv;
+  std::vector<double> tspectra;
+  std::vector<double> acc;
+  std::vector<double> norms;
+  std::vector<double> sn;
+  std::vector<double> sp;
+  bool buffered;
+  std::vector<MassResult> results;
+} MassThread;
+
+// A unit of work for the scheduler: windows [first, first + count) of
+// track trackID, whose first vector is vectorOffset into the data table
+typedef struct {
+  Uns32T trackID;
+  off_t vectorOffset;
+  Uns32T first;
+  Uns32T count;
+} Task;
+
+typedef void (*TaskFunction)(void *arg, unsigned index, const Task *task, unsigned thread);
+
+// A track's shingles, built and normed by one of the threads of an
+// index build, waiting to be inserted into the index in track order
+typedef struct {
+  std::vector<std::vector<float> > *vv;
+  int vcount;
+  double *sp;
+  std::vector<double> power;
+} IndexTrack;
+
+// One thread's buffer in an index build
+typedef struct {
+  double *fvp;
+  size_t nfv;
+} IndexThread;
+
+// A point of a compressed LSH index's table, under its bucket key
+typedef struct {
+  uint32_t key;
+  Uns32T pointID;
+} ZIndexEntry;
+
+// A compressed LSH index (zindex.cpp): its hash functions, and either
+// the points being inserted into each table or the mapped file
+struct zindex_table;
+struct times_encoding;
+typedef struct {
+  Uns32T dim;
+  Uns32T k;
+  Uns32T ntables;
+  Uns32T numFiles;
+  uint64_t npoints;
+  double w;
+  double radius;
+  std::vector<double> a;
+  std::vector<double> b;
+  std::vector<std::vector<ZIndexEntry> > entries;
+  const char *base;
+  size_t length;
+  const struct zindex_table *tables;
+} ZIndex;
+
+// An open feature or power file of a LARGE_ADB database's track
+typedef struct {
+  const char *table;
+  Uns32T trackID;
+  int fd;
+  unsigned long used;
+} TrackFile;
+
 #define SAFE_DELETE(PTR) delete PTR; PTR=0;
 #define SAFE_DELETE_ARRAY(PTR) delete[] PTR; PTR=0;
 
@@ -188,6 +338,8 @@ class audioDB{
   std::ifstream *powerFile;
   const char* adb_root;
   const char* adb_feature_root;
+  const char *queryListName;
+  const char *queryPowerListName;
 
   int powerfd;
   int dbfid;
@@ -213,6 +365,10 @@ class audioDB{
   size_t timesTableLength;
   size_t powerTableLength;
   size_t l2normTableLength;
+  int tableAdvice;
+  bool preloadTables;
+  bool hugeTables;
+  bool hugeWarned;
 
   // Flags and parameters
   unsigned verbosity;   // how much do we want to know?
@@ -246,6 +402,36 @@ class audioDB{
   double relative_threshold;
   bool use_rotate;
   int rotate;
+  bool use_mass;
+  double expandFactor;
+  bool use_warp_bounds;
+  bool use_cache;
+  unsigned cacheHits;
+  unsigned cacheMisses;
+  Uns32T* keyHash;
+  Uns32T keyHashSlots;
+  Uns32T keyHashCount;
+  Uns32T* keylistBitmap;
+  std::vector<const char *> databaseNames;
+  std::vector<char *> shardNames; // malloc()ed, freed by cleanup()
+  std::vector<Shard> shards;
+  std::vector<TrackFile> trackFiles;
+  unsigned long trackFileClock;
+  int packfd;
+  char* packBase;
+  size_t packLength;
+  bool packChecked;
+  unsigned threads;
+  double deadline;
+  uint64_t searchedVectors;
+  uint64_t searchableVectors;
+  unsigned reporterMemory;
+  bool use_stats;
+  std::vector<StatsPhase> statsPhases;
+  std::vector<std::pair<const char *, unsigned long long> > statsCounters;
+  int statsCurrent;
+  double statsWall;
+  double statsCpu;
   
   ReporterBase* reporter;  // track/point reporter
 
@@ -259,12 +445,18 @@ class audioDB{
   // private methods
   void error(const char* a, const char* b = "", const char *sysFunc = 0) __attribute__ ((noreturn));
 
-  void insertTimeStamps(unsigned n, std::ifstream* timesFile, double* timesdata);
-  void initDBHeader(const char *dbName);
+  void insertTimeStamps(unsigned n, const char* fileName, double* timesdata);
+  void initDBHeader(const char *dbName, unsigned tables = O2_TABLE_ALL);
+  void *map_table(const char *name, off_t start, size_t length);
+  void advise_library(adb_t *a);
+  void map_tables(unsigned tables);
   void initInputFile(const char *inFile);
   void initTables(const char* dbName, const char* inFile = 0);
   void initTablesFromKey(const char* dbName, const Uns32T queryIndex);
   void prefix_name(char** const name, const char* prefix);
+  void read_track_data(Uns32T trackID, off_t vectorOffset, double** fvpp, size_t* nfvp, Uns32T first = 0, Uns32T count = ~0U);
+  void read_track_power(Uns32T trackID, double *power);
+  void init_track_mask(const adb_query_spec_t *qspec, bool *include);
 
  public:
   audioDB(const unsigned argc, const char *argv[]);
@@ -274,10 +466,18 @@ class audioDB{
   int processArgs(const unsigned argc, const char* argv[]);
   void create(const char* dbName);
   void insert(const char* dbName, const char* inFile);
+  int insertFromFiles(adb_insert_t *insert);
   void batchinsert(const char* dbName, const char* inFile);
+  void bulkpack(const char* containerName, const char* inFile);
+  void bulkload(const char* dbName, const char* containerName);
+  double *readFeatureFile(const char *fileName, uint32_t *dim, uint32_t *nvectors);
   void datumFromFiles(adb_datum_t *datum);
+  void datumFree(adb_datum_t *datum);
   void rotateDatum(adb_datum_t *datum, int amount);
   void query(const char* dbName, const char* inFile);
+  ReporterBase *query_reporter(adb_query_spec_t *qspec, uint32_t nfiles);
+  void query_report(ReporterBase *r);
+  void query_list(adb_query_spec_t *qspec, uint32_t nfiles);
   void status(const char* dbName);
 
   unsigned random_track(unsigned *propTable, unsigned total);
@@ -298,15 +498,120 @@ class audioDB{
   Uns32T lsh_param_N; // Number of rows per hash table
   Uns32T lsh_param_b; // Batch size, in number of tracks, per indexing iteration
   Uns32T lsh_param_ncols; // Maximum number of collision in a hash-table row
+  Uns32T lsh_tables; // Tables of a compressed index probed by --lsh_tables (0: all of them)
+  bool lsh_rotation_invariant; // Build, or query, the rotation-invariant index
+  bool lsh_compress; // Build the compressed index (zindex.cpp)
+  ZIndex *zindex; // The compressed index being built, if any
 
   // LSH indexing and retrieval methods  
+  char *index_get_name();
   void index_index_db(const char* dbName);
+  void index_report_size(const char *indexName);
   void index_initialize(double**,double**,double**,double**,unsigned int*);
-  void index_insert_tracks(Uns32T start_track, Uns32T end_track, double** fvpp, double** sNormpp,double** snPtrp, double** sPowerp, double** spPtrp);
-  int index_insert_track(Uns32T trackID, double** fvpp, double** snpp, double** sppp);
+  void index_insert_tracks(Uns32T start_track, Uns32T end_track, double *sNorm, double *sPower);
+  void index_shingle_track(const Task *task, double *sNorm, double *sPower, IndexTrack *t, IndexThread *thread);
+  void index_insert_track(Uns32T trackID, IndexTrack *t);
   Uns32T index_insert_shingles(vector<vector<float> >*, Uns32T trackID, double* spp);
   void insertPowerData(unsigned n, int powerfd, double *powerdata);
-  void init_track_aux_data(Uns32T trackID, double* fvp, double** sNormpp,double** snPtrp, double** sPowerp, double** spPtrp);
+
+  // FFT (MASS-style) distance profiles for long sequences
+  bool mass_index_exists();
+  void mass_query(const adb_query_spec_t *qspec);
+  void mass_queries(adb_query_spec_t *qspecs, ReporterBase **reporters, unsigned nqueries);
+  void mass_query_spectra(const adb_datum_t *datum, Uns32T qstart, Uns32T nq, Uns32T qhop, size_t fftlen, double *qspec);
+  void mass_track(const Task *task, const adb_query_spec_t *qspec, MassBatch *batches, unsigned nbatches, size_t fftlen, MassThread *t);
+
+  // Batched LSH candidate evaluation
+  bool lsh_batch_applies(const adb_query_spec_t *qspec);
+  void lsh_batch_query(const adb_query_spec_t *qspec);
+
+  // Rotation-invariant LSH
+  void rotation_project_shingles(std::vector<std::vector<float> > *vv, Uns32T d);
+
+  // Compressed LSH index
+  char *zindex_get_name();
+  bool zindex_exists();
+  bool zindex_open(ZIndex *z, const char *name);
+  void zindex_close(ZIndex *z);
+  uint64_t zindex_table_bytes(const ZIndex *z, Uns32T ntables);
+  void zindex_bucket(const ZIndex *z, Uns32T t, uint32_t b, Uns32T qpos, ReporterCallbackPtr f, void *caller);
+  void zindex_retrieve_point(const ZIndex *z, const std::vector<float> &v, Uns32T qpos, Uns32T ntables, ReporterCallbackPtr f, void *caller);
+  void zindex_insert_point(ZIndex *z, const std::vector<float> &v, Uns32T pointID);
+  void zindex_write(ZIndex *z, const char *name);
+  void zindex_build(const char *name);
+
+  // Time-warped sequence search
+  void warp_query(const adb_query_spec_t *qspec);
+
+  // Query result cache
+  char *cache_path(const char *name);
+  void cache_key(const adb_query_spec_t *qspec, std::string &key);
+  void cache_open();
+  bool cache_lookup(const std::string &key, std::vector<CachedResult> &results);
+  void cache_store(const std::string &key, const adb_query_results_t *rs);
+  void cache_evict();
+  void cache_report();
+
+  // Key hash and keylists
+  uint32_t keyhash_fingerprint();
+  void keyhash_insert(Uns32T index);
+  void keyhash_write();
+  void keyhash_init(bool save = false);
+  Uns32T key_index(const char *key);
+  void keylist_restrict(adb_keylist_t *include);
+  void keylist_keys(adb_keylist_t *include);
+
+  // Federated queries
+  void shards_init();
+  void shards_open();
+  Uns32T shards_numFiles();
+  void shards_query(adb_query_spec_t *qspec);
+
+  // Feature file cache
+  void track_file_path(Uns32T trackID, const char *table, char *path);
+  int track_file_open(Uns32T trackID, const char *table, unsigned dim, bool quiet);
+  int track_file(Uns32T trackID, const char *table);
+  int track_file_cached(Uns32T trackID, const char *table, bool quiet);
+  void track_files_close();
+
+  // Packed LARGE_ADB features
+  char *pack_path(const char *name);
+  void pack(const char *dbName);
+  void pack_open();
+  const double *pack_track(Uns32T trackID, int which);
+
+  // Work-stealing scheduler
+  void tasks_split(const bool *include, Uns32T l, Uns32T unit, Uns32T maxGrain, std::vector<Task> &tasks);
+  void tasks_run(const std::vector<Task> &tasks, TaskFunction f, void *arg, size_t window = 0);
+
+  // Deadlines
+  void deadline_set(unsigned ms);
+  bool deadline_passed();
+  void deadline_order(size_t n, std::vector<size_t> &order);
+  void deadline_query(adb_query_spec_t *qspec);
+  void deadline_report();
+
+  // Database growth
+  void table_extents(const adb_header_t *h, off_t *offsets, off_t *used);
+  void resize_copy(int fd, off_t from, int tofd, off_t to, off_t count);
+  void resize(const char *dbName);
+
+  // Binary snapshots
+  void snapshot_dump(const char *dbName, const char *dir, unsigned nchunks);
+  void snapshot_restore(const char *dbName, const char *dir);
+
+  // Compact times
+  char *times_path(const char *name);
+  void times_compact(const char *dbName);
+  int times_load(const char *name, adb_t *a, times_encoding *enc);
+  bool times_expand(const char *name, adb_t *a);
+  void times_durations(const char *name, adb_t *a, std::vector<double> &durations);
+  bool times_restrict(adb_query_spec_t *qspec);
+
+  // Profiling
+  void stats_phase(const char *name);
+  void stats_count(const char *name, unsigned long long n = 1);
+  void stats_report();
   
 };
 
@@ -325,6 +630,8 @@ class audioDB{
     powerFile(0),				\
     adb_root(0),                                \
     adb_feature_root(0),                        \
+    queryListName(0),                           \
+    queryPowerListName(0),                      \
     powerfd(0),                                 \
     dbfid(0),					\
     lshfid(0),					\
@@ -345,6 +652,10 @@ class audioDB{
     timesTableLength(0),			\
     powerTableLength(0),			\
     l2normTableLength(0),			\
+    tableAdvice(MADV_NORMAL),                   \
+    preloadTables(false),                       \
+    hugeTables(false),                          \
+    hugeWarned(false),                          \
     verbosity(1),				\
     nsamples(2000),                             \
     datasize(O2_DEFAULT_DATASIZE),              \
@@ -372,6 +683,31 @@ class audioDB{
     relative_threshold(0.0),			\
     use_rotate(false),                          \
     rotate(0),                                  \
+    use_mass(false),                            \
+    expandFactor(1.1),                          \
+    use_warp_bounds(true),                      \
+    use_cache(false),                           \
+    cacheHits(0),                               \
+    cacheMisses(0),                             \
+    keyHash(0),                                 \
+    keyHashSlots(0),                            \
+    keyHashCount(0),                            \
+    keylistBitmap(0),                           \
+    trackFiles(),                               \
+    trackFileClock(0),                          \
+    packfd(-1),                                 \
+    packBase(0),                                \
+    packLength(0),                              \
+    packChecked(false),                         \
+    threads(1),                                 \
+    deadline(0),                                \
+    searchedVectors(0),                         \
+    searchableVectors(0),                       \
+    reporterMemory(0),                          \
+    use_stats(false),                           \
+    statsCurrent(-1),                           \
+    statsWall(0),                               \
+    statsCpu(0),                                \
     reporter(0),                                \
     lisztOffset(0),                             \
     lisztLength(0),                             \
@@ -383,5 +719,9 @@ class audioDB{
     lsh_param_m(0),				\
     lsh_param_N(0),				\
     lsh_param_b(0),				\
-    lsh_param_ncols(0)
+    lsh_param_ncols(0),                         \
+    lsh_tables(0),                              \
+    lsh_rotation_invariant(false),              \
+    lsh_compress(false),                        \
+    zindex(0)
 #endif
@@ -5,6 +5,7 @@
 #include <queue>
 #include <set>
 #include <functional>
+#include <algorithm>
 #include <iostream>
 #include "ReporterBase.h"
 #include "audioDB.h"
@@ -40,11 +41,45 @@ bool operator> (const Radresult &a, const Radresult &b) {
 
 class Reporter : public ReporterBase {
 public:
+  Reporter() : duplicates(0), spilled(0), shards(0) {};
   virtual ~Reporter() {};
   virtual void add_point(unsigned int trackID, unsigned int qpos, unsigned int spos, double dist, int rot = 0) = 0;
   virtual void report(adb_t *adb, bool report_rot = false) = 0;
+  void set_shards(const std::vector<Shard> *s) { shards = s; };
+  // points passed to add_point() more than once (radius reporters)
+  unsigned long long duplicates;
+  // points written to temporary files (spilling reporters)
+  unsigned long long spilled;
+protected:
+  const char *key(adb_t *adb, unsigned int trackID);
+  const std::vector<Shard> *shards;
+  std::map<unsigned int, std::string> qualified;
 };
 
+// The key of a track; for a federated query, trackID numbers the
+// tracks of all the shards, and keys present in more than one shard
+// are qualified as shard:key.
+const char *Reporter::key(adb_t *adb, unsigned int trackID) {
+  if(!shards)
+    return audiodb_index_key(adb, trackID);
+  unsigned int k = shards->size() - 1;
+  while(k > 0 && trackID < (*shards)[k].base)
+    k--;
+  const Shard &s = (*shards)[k];
+  const char *name = audiodb_index_key(s.adb, trackID - s.base);
+  std::map<unsigned int, std::string>::iterator it = qualified.find(trackID);
+  if(it != qualified.end())
+    return it->second.c_str();
+  for(unsigned int j = 0; j < shards->size(); j++) {
+    if(j != k && audiodb_key_index((*shards)[j].adb, name) != (uint32_t) -1) {
+      std::string &q = qualified[trackID];
+      q = std::string(s.name) + ":" + name;
+      return q.c_str();
+    }
+  }
+  return name;
+}
+
 template <class T> class pointQueryReporter : public Reporter {
 public:
   pointQueryReporter(unsigned int pointNN);
@@ -94,7 +129,7 @@ template <class T> void pointQueryReporter<T>::report(adb_t *adb, bool report_ro
   for(rit = v.rbegin(); rit < v.rend(); rit++) {
     r = *rit;
     if(adb)
-      std::cout << audiodb_index_key(adb, r.trackID) << " ";
+      std::cout << key(adb, r.trackID) << " ";
     else
       std::cout << r.trackID << " ";
     std::cout << r.dist << " " << r.qpos << " " << r.spos;
@@ -182,7 +217,7 @@ template <class T> void trackAveragingReporter<T>::report(adb_t *adb, bool repor
   for(rit = v.rbegin(); rit < v.rend(); rit++) {
     r = *rit;
     if(adb)
-      std::cout << audiodb_index_key(adb, r.trackID) << " ";
+      std::cout << key(adb, r.trackID) << " ";
     else
       std::cout << r.trackID << " ";
     std::cout << r.dist << " " << r.qpos << " " << r.spos;
@@ -199,6 +234,7 @@ template <class T> class trackSequenceQueryNNReporter : public trackAveragingRep
   using trackAveragingReporter<T>::queues;
   using trackAveragingReporter<T>::trackNN;
   using trackAveragingReporter<T>::pointNN;
+  using trackAveragingReporter<T>::key;
  public:
   trackSequenceQueryNNReporter(unsigned int pointNN, unsigned int trackNN, unsigned int numFiles);
   void report(adb_t *adb, bool report_rot);
@@ -255,7 +291,7 @@ template <class T> void trackSequenceQueryNNReporter<T>::report(adb_t *adb, bool
   for(rit = v.rbegin(); rit < v.rend(); rit++) {
     r = *rit;
     if(adb)
-      std::cout << audiodb_index_key(adb, r.trackID) << " ";
+      std::cout << key(adb, r.trackID) << " ";
     else
       std::cout << r.trackID << " ";
     std::cout << r.dist << std::endl;
@@ -369,6 +405,8 @@ void trackSequenceQueryRadReporter::add_point(unsigned int trackID, unsigned int
       set->insert(pair);
       count[trackID]++; // only count if <trackID,qpos> pair is unique
     }
+  } else {
+    duplicates++;
   }
 }
 
@@ -401,7 +439,7 @@ void trackSequenceQueryRadReporter::report(adb_t *adb, bool report_rot) {
   for(rit = v.rbegin(); rit < v.rend(); rit++) {
     r = *rit;
     if(adb)
-      std::cout << audiodb_index_key(adb, r.trackID) << " ";
+      std::cout << key(adb, r.trackID) << " ";
     else
       std::cout << r.trackID << " ";
     std::cout << r.count << std::endl;
@@ -477,6 +515,8 @@ void trackSequenceQueryRadNNReporter::add_point(unsigned int trackID, unsigned i
       if(point_queues[trackID].size() > pointNN)
 	point_queues[trackID].pop();
     }
+  } else {
+    duplicates++;
   }
 }
 
@@ -512,6 +552,7 @@ void trackSequenceQueryRadNNReporter::report(adb_t *adb, bool report_rot) {
   else{
     // Instantiate a 1-NN trackAveragingNN reporter
     trackSequenceQueryNNReporter<std::less <NNresult> >* rep = new trackSequenceQueryNNReporter<std::less <NNresult> >(1, trackNN, numFiles);
+    rep->set_shards(shards);
     // Add all the points we've got to the reporter
     for(unsigned int i=0; i<numFiles; i++){
       int qsize = point_queues[i].size();
@@ -536,7 +577,7 @@ void trackSequenceQueryRadNNReporter::report(adb_t *adb, bool report_rot) {
   for(rit = v.rbegin(); rit < v.rend(); rit++) {
     r = *rit;
     if(adb)
-      std::cout << audiodb_index_key(adb, r.trackID) << " ";
+      std::cout << key(adb, r.trackID) << " ";
     else
       std::cout << r.trackID << " ";
     std::cout << r.count << std::endl;
@@ -559,6 +600,284 @@ void trackSequenceQueryRadNNReporter::report(adb_t *adb, bool report_rot) {
   delete[] point_queues;
 }
 
+// track Sequence Query Radius NN Reporter, spilling to disk
+//
+// reports as trackSequenceQueryRadNNReporter does, but holds no more
+// than budget bytes of points: beyond that they are sorted and written
+// to temporary files in runs, which report() merges.  The first merge
+// (by trackID, qpos, spos and order of arrival) drops repeated points
+// and counts each track's distinct query points; the second (by
+// trackID and order of arrival) passes the points of the tracks to be
+// listed through the same bounded queues, in the order they arrived,
+// so that ties are broken as the in-memory reporter breaks them.
+
+typedef struct spillresult {
+  unsigned int trackID;
+  unsigned int qpos;
+  unsigned int spos;
+  int rot;
+  unsigned long long seq;
+  double dist;
+} Spillresult;
+
+// runs merged at once; more are first merged into fewer, longer runs
+#define O2_SPILL_FANIN (64)
+
+bool spill_by_point(const Spillresult &a, const Spillresult &b) {
+  if(a.trackID != b.trackID) return a.trackID < b.trackID;
+  if(a.qpos != b.qpos) return a.qpos < b.qpos;
+  if(a.spos != b.spos) return a.spos < b.spos;
+  return a.seq < b.seq;
+}
+
+bool spill_by_arrival(const Spillresult &a, const Spillresult &b) {
+  if(a.trackID != b.trackID) return a.trackID < b.trackID;
+  return a.seq < b.seq;
+}
+
+typedef bool (*SpillOrder)(const Spillresult &, const Spillresult &);
+
+// A run being read during a merge
+typedef struct {
+  FILE *file;
+  Spillresult head;
+} SpillRun;
+
+class trackSequenceQueryRadNNSpillReporter : public Reporter {
+public:
+  trackSequenceQueryRadNNSpillReporter(unsigned int pointNN, unsigned int trackNN, unsigned int numFiles, size_t budget);
+  ~trackSequenceQueryRadNNSpillReporter();
+  void add_point(unsigned int trackID, unsigned int qpos, unsigned int spos, double dist, int rot = 0);
+  void report(adb_t *adb, bool report_rot);
+ protected:
+  void spill(std::vector<Spillresult> &points, SpillOrder order, bool dedupe, std::vector<FILE *> &to);
+  bool next(std::vector<SpillRun> &merging, SpillOrder order, Spillresult *r);
+  void open_runs(std::vector<FILE *> &from, SpillOrder order, std::vector<SpillRun> &merging);
+  unsigned int pointNN;
+  unsigned int trackNN;
+  unsigned int numFiles;
+  size_t capacity;
+  unsigned long long arrivals;
+  std::vector<Spillresult> buffer;
+  std::vector<FILE *> runs;
+};
+
+trackSequenceQueryRadNNSpillReporter::trackSequenceQueryRadNNSpillReporter(unsigned int pointNN, unsigned int trackNN, unsigned int numFiles, size_t budget):
+  pointNN(pointNN), trackNN(trackNN), numFiles(numFiles), arrivals(0) {
+  capacity = budget / sizeof(Spillresult);
+  if(capacity < 1024)
+    capacity = 1024;
+}
+
+trackSequenceQueryRadNNSpillReporter::~trackSequenceQueryRadNNSpillReporter() {
+  for(unsigned k = 0; k < runs.size(); k++)
+    fclose(runs[k]);
+}
+
+void trackSequenceQueryRadNNSpillReporter::add_point(unsigned int trackID, unsigned int qpos, unsigned int spos, double dist, int rot) {
+  Spillresult r = {trackID, qpos, spos, rot, arrivals++, dist};
+  buffer.push_back(r);
+  if(buffer.size() >= capacity)
+    spill(buffer, spill_by_point, true, runs);
+}
+
+// Sort points into a new run of to, dropping repeated points if dedupe
+void trackSequenceQueryRadNNSpillReporter::spill(std::vector<Spillresult> &points, SpillOrder order, bool dedupe, std::vector<FILE *> &to) {
+  std::sort(points.begin(), points.end(), order);
+  FILE *f = tmpfile();
+  if(!f) {
+    std::cerr << "error: failed to create temporary file for spilled results" << std::endl;
+    exit(1);
+  }
+  size_t n = 0;
+  for(size_t k = 0; k < points.size(); k++) {
+    const Spillresult &r = points[k];
+    if(dedupe && n && r.trackID == points[n-1].trackID && r.qpos == points[n-1].qpos && r.spos == points[n-1].spos) {
+      duplicates++;
+      continue;
+    }
+    points[n++] = r;
+  }
+  if(n && fwrite(&points[0], sizeof(Spillresult), n, f) != n) {
+    std::cerr << "error: failed to write spilled results" << std::endl;
+    exit(1);
+  }
+  spilled += n;
+  points.clear();
+  to.push_back(f);
+}
+
+// The next point of the merge of runs, in order
+bool trackSequenceQueryRadNNSpillReporter::next(std::vector<SpillRun> &merging, SpillOrder order, Spillresult *r) {
+  unsigned best = merging.size();
+  for(unsigned k = 0; k < merging.size(); k++)
+    if(merging[k].file && (best == merging.size() || order(merging[k].head, merging[best].head)))
+      best = k;
+  if(best == merging.size())
+    return false;
+  *r = merging[best].head;
+  if(fread(&merging[best].head, sizeof(Spillresult), 1, merging[best].file) != 1) {
+    fclose(merging[best].file);
+    merging[best].file = 0;
+  }
+  return true;
+}
+
+// Start a merge of the runs from, first merging them into no more than
+// O2_SPILL_FANIN runs
+void trackSequenceQueryRadNNSpillReporter::open_runs(std::vector<FILE *> &from, SpillOrder order, std::vector<SpillRun> &merging) {
+  while(from.size() > O2_SPILL_FANIN) {
+    std::vector<FILE *> merged;
+    for(size_t k0 = 0; k0 < from.size(); k0 += O2_SPILL_FANIN) {
+      std::vector<FILE *> group(from.begin() + k0, from.begin() + std::min(from.size(), k0 + O2_SPILL_FANIN));
+      std::vector<SpillRun> m;
+      open_runs(group, order, m);
+      FILE *f = tmpfile();
+      if(!f) {
+        std::cerr << "error: failed to create temporary file for spilled results" << std::endl;
+        exit(1);
+      }
+      Spillresult r;
+      while(next(m, order, &r)) {
+        if(fwrite(&r, sizeof(Spillresult), 1, f) != 1) {
+          std::cerr << "error: failed to write spilled results" << std::endl;
+          exit(1);
+        }
+      }
+      merged.push_back(f);
+    }
+    from.swap(merged);
+  }
+  merging.clear();
+  for(unsigned k = 0; k < from.size(); k++) {
+    SpillRun m = {from[k], Spillresult()};
+    rewind(m.file);
+    if(fread(&m.head, sizeof(Spillresult), 1, m.file) != 1) {
+      fclose(m.file);
+      m.file = 0;
+    }
+    merging.push_back(m);
+  }
+  // the files now belong to the merge, which closes them
+  from.clear();
+}
+
+void trackSequenceQueryRadNNSpillReporter::report(adb_t *adb, bool report_rot) {
+  if(!buffer.empty() || runs.empty())
+    spill(buffer, spill_by_point, true, runs);
+  std::vector<Spillresult>().swap(buffer);
+
+  // distinct points, and the distinct query points of each track
+  std::vector<unsigned int> count(numFiles, 0);
+  std::vector<Spillresult> points;
+  std::vector<FILE *> arrived;
+  std::vector<SpillRun> merging;
+  open_runs(runs, spill_by_point, merging);
+  Spillresult r, last;
+  bool first = true;
+  while(next(merging, spill_by_point, &r)) {
+    if(!first && r.trackID == last.trackID && r.qpos == last.qpos && r.spos == last.spos) {
+      duplicates++;
+      continue;
+    }
+    if(first || r.trackID != last.trackID || r.qpos != last.qpos)
+      count[r.trackID]++;
+    first = false;
+    last = r;
+    if(!isnan(r.dist)) {
+      points.push_back(r);
+      if(points.size() >= capacity)
+        spill(points, spill_by_arrival, false, arrived);
+    }
+  }
+  if(!points.empty() || arrived.empty())
+    spill(points, spill_by_arrival, false, arrived);
+  std::vector<Spillresult>().swap(points);
+
+  // the tracks to list, as trackSequenceQueryRadNNReporter chooses them
+  std::priority_queue < Radresult, std::vector<Radresult>, std::greater<Radresult> > result;
+  std::vector<Radresult> v;
+  std::vector<char> wanted(numFiles, pointNN <= 1);
+  if(pointNN > 1) {
+    for (int i = numFiles-1; i >= 0; i--) {
+      Radresult rr;
+      rr.trackID = i;
+      rr.count = count[i];
+      if(rr.count > 0) {
+        result.push(rr);
+        if (result.size() > trackNN) {
+          result.pop();
+        }
+      }
+    }
+    unsigned int size = result.size();
+    for(unsigned int k = 0; k < size; k++) {
+      v.push_back(result.top());
+      wanted[result.top().trackID] = 1;
+      result.pop();
+    }
+  }
+
+  // each listed track's nearest points, queued in order of arrival
+  std::map<unsigned int, std::priority_queue< NNresult, std::vector< NNresult>, std::less<NNresult> > > point_queues;
+  open_runs(arrived, spill_by_arrival, merging);
+  while(next(merging, spill_by_arrival, &r)) {
+    if(!wanted[r.trackID])
+      continue;
+    NNresult rk;
+    rk.trackID = r.trackID;
+    rk.qpos = r.qpos;
+    rk.spos = r.spos;
+    rk.dist = r.dist;
+    rk.rot = r.rot;
+    std::priority_queue< NNresult, std::vector< NNresult>, std::less<NNresult> > &q = point_queues[r.trackID];
+    q.push(rk);
+    if(q.size() > pointNN)
+      q.pop();
+  }
+
+  if(pointNN <= 1) {
+    trackSequenceQueryNNReporter<std::less <NNresult> >* rep = new trackSequenceQueryNNReporter<std::less <NNresult> >(1, trackNN, numFiles);
+    rep->set_shards(shards);
+    std::map<unsigned int, std::priority_queue< NNresult, std::vector< NNresult>, std::less<NNresult> > >::iterator it;
+    for(it = point_queues.begin(); it != point_queues.end(); it++) {
+      while(!it->second.empty()) {
+        NNresult rk = it->second.top();
+        rep->add_point(it->first, rk.qpos, rk.spos, rk.dist, rk.rot);
+        it->second.pop();
+      }
+    }
+    rep->report(adb, report_rot);
+    delete rep;
+    return;
+  }
+
+  std::vector<Radresult>::reverse_iterator rit;
+  std::priority_queue< NNresult, std::vector< NNresult>, std::greater<NNresult> > point_queue;
+  for(rit = v.rbegin(); rit < v.rend(); rit++) {
+    Radresult rr = *rit;
+    if(adb)
+      std::cout << key(adb, rr.trackID) << " ";
+    else
+      std::cout << rr.trackID << " ";
+    std::cout << rr.count << std::endl;
+
+    std::priority_queue< NNresult, std::vector< NNresult>, std::less<NNresult> > &q = point_queues[rr.trackID];
+    while(!q.empty()) {
+      point_queue.push(q.top());
+      q.pop();
+    }
+    while(!point_queue.empty()) {
+      NNresult rk = point_queue.top();
+      std::cout << rk.dist << " " << rk.qpos << " " << rk.spos;
+      if(report_rot)
+        std::cout << " " << rk.rot;
+      std::cout << std::endl;
+      point_queue.pop();
+    }
+  }
+}
+
 /********** ONE-TO-ONE REPORTERS *****************/
 
 // track Sequence Query Radius NN Reporter One-to-One
@@ -628,7 +947,7 @@ void trackSequenceQueryRadNNReporterOneToOne::report(adb_t *adb, bool report_rot
     if (report_rot)
       std::cout << rk.rot << " ";
     if(adb)
-      std::cout << audiodb_index_key(adb, rk.trackID) << " ";
+      std::cout << key(adb, rk.trackID) << " ";
     else
       std::cout << rk.trackID << " "; 
     std::cout << std::endl;
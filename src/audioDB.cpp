@@ -17,8 +17,11 @@ audioDB::audioDB(const unsigned argc, const char *argv[]): O2_AUDIODB_INITIALIZE
     error("No command found");
   }
 
-  // Perform database prefix substitution
-  if(dbName && adb_root)
+  // Several databases (a federated query), or database prefix
+  // substitution
+  if(dbName && (databaseNames.size() > 1 || (O2_ACTION(COM_QUERY) && dbName[0] == '@')))
+    shards_init();
+  else if(dbName && adb_root)
     prefix_name((char** const)&dbName, adb_root);
 
   if(O2_ACTION(COM_CREATE))
@@ -30,6 +33,12 @@ audioDB::audioDB(const unsigned argc, const char *argv[]): O2_AUDIODB_INITIALIZE
   else if(O2_ACTION(COM_BATCHINSERT))
     batchinsert(dbName, inFile);
 
+  else if(O2_ACTION(COM_BULKPACK))
+    bulkpack(output, inFile);
+
+  else if(O2_ACTION(COM_BULKLOAD))
+    bulkload(dbName, inFile);
+
   else if(O2_ACTION(COM_QUERY))
     query(dbName, inFile);
 
@@ -48,6 +57,18 @@ audioDB::audioDB(const unsigned argc, const char *argv[]): O2_AUDIODB_INITIALIZE
   else if(O2_ACTION(COM_DUMP))
     dump(dbName);
 
+  else if(O2_ACTION(COM_RESTORE))
+    snapshot_restore(dbName, inFile);
+
+  else if(O2_ACTION(COM_RESIZE))
+    resize(dbName);
+
+  else if(O2_ACTION(COM_COMPACT))
+    times_compact(dbName);
+
+  else if(O2_ACTION(COM_PACK))
+    pack(dbName);
+
   else if(O2_ACTION(COM_LISZT))
     liszt(dbName, lisztOffset, lisztLength);
 
@@ -56,6 +77,8 @@ audioDB::audioDB(const unsigned argc, const char *argv[]): O2_AUDIODB_INITIALIZE
   
   else
     error("Unrecognized command",command);
+
+  stats_report();
 }
 
 void audioDB::cleanup() {
@@ -76,6 +99,11 @@ void audioDB::cleanup() {
     munmap(timesFileNameTable, fileTableLength);
   if(powerFileNameTable)
     munmap(powerFileNameTable, fileTableLength);
+  track_files_close();
+  if(packBase)
+    munmap(packBase, packLength);
+  if(packfd >= 0)
+    close(packfd);
   if(reporter)
     delete reporter;
   if(infid>0) {
@@ -90,12 +118,26 @@ void audioDB::cleanup() {
     delete timesFile;
     timesFile = 0;
   }
+  for(unsigned k = 1; k < shards.size(); k++) {
+    if(shards[k].adb) {
+      audiodb_close(shards[k].adb);
+      shards[k].adb = NULL;
+    }
+  }
   if(adb) {
     audiodb_close(adb);
     adb = NULL;
   }
+  for(unsigned k = 0; k < shardNames.size(); k++)
+    free(shardNames[k]);
+  shardNames.clear();
+  shards.clear();
   if(lsh)
     delete lsh;
+  if(keyHash)
+    delete[] keyHash;
+  if(keylistBitmap)
+    delete[] keylistBitmap;
 }
 
 audioDB::~audioDB(){
@@ -131,6 +173,9 @@ int audioDB::processArgs(const unsigned argc, const char *argv[]){
     exit(0);
   }
 
+  for(unsigned i = 0; i < args_info.database_given; i++)
+    databaseNames.push_back(args_info.database_arg[i]);
+
   if(args_info.verbosity_given){
     verbosity = args_info.verbosity_arg;
     if(verbosity < 0 || verbosity > 10){
@@ -139,6 +184,28 @@ int audioDB::processArgs(const unsigned argc, const char *argv[]){
     }
   }
 
+  use_stats = args_info.stats_flag;
+
+  if(!strcmp(args_info.access_arg, "random")) {
+    tableAdvice = MADV_RANDOM;
+  } else if(!strcmp(args_info.access_arg, "sequential")) {
+    tableAdvice = MADV_SEQUENTIAL;
+  }
+  preloadTables = args_info.preload_flag;
+  hugeTables = args_info.hugepages_flag;
+
+  if(args_info.threads_arg < 0)
+    error("--threads must not be negative");
+  threads = args_info.threads_arg;
+  if(!threads) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = ncpu > 0 ? (unsigned) ncpu : 1;
+  }
+
+  if((args_info.datasize_given || args_info.ntracks_given) && !args_info.NEW_given && !args_info.RESIZE_given) {
+    error("--datasize and --ntracks apply only to --NEW and --RESIZE");
+  }
+
   if(args_info.size_given) {
     if(args_info.datasize_given) {
       error("both --size and --datasize given", "");
@@ -177,8 +244,13 @@ int audioDB::processArgs(const unsigned argc, const char *argv[]){
     }
   }
   
+  // Sequences longer than 1000 are only supported by the FFT sequence
+  // search, so are accepted only by queries (and checked once it is
+  // known whether the FFT search is used)
   sequenceLength = args_info.sequencelength_arg;
-  if(sequenceLength < 1 || sequenceLength > 1000) {
+  if(sequenceLength < 1 || sequenceLength > (args_info.QUERY_given ? O2_MAXSEQLEN : 1000)) {
+    if(args_info.QUERY_given)
+      error("seqlen out of range: 1 <= seqlen <= 8000");
     error("seqlen out of range: 1 <= seqlen <= 1000");
   }
   sequenceHop = args_info.sequencehop_arg;
@@ -216,19 +288,19 @@ int audioDB::processArgs(const unsigned argc, const char *argv[]){
 
   if(args_info.NEW_given){
     command=COM_CREATE;
-    dbName=args_info.database_arg;
+    dbName = databaseNames[0];
     return 0;
   }
 
   if(args_info.STATUS_given){
     command=COM_STATUS;
-    dbName=args_info.database_arg;
+    dbName = databaseNames[0];
     return 0;
   }
 
   if(args_info.SAMPLE_given) {
     command = COM_SAMPLE;
-    dbName = args_info.database_arg;
+    dbName = databaseNames[0];
     sequenceLength = args_info.sequencelength_arg;
     if(sequenceLength < 1 || sequenceLength > 1000) {
       error("seqlen out of range: 1 <= seqlen <= 1000");
@@ -259,26 +331,51 @@ int audioDB::processArgs(const unsigned argc, const char *argv[]){
 
   if(args_info.DUMP_given){
     command=COM_DUMP;
-    dbName=args_info.database_arg;
+    dbName = databaseNames[0];
     output = args_info.output_arg;
     return 0;
   }
 
   if(args_info.L2NORM_given){
     command=COM_L2NORM;
-    dbName=args_info.database_arg;
+    dbName = databaseNames[0];
     return 0;
   }
        
+  if(args_info.RESTORE_given){
+    command=COM_RESTORE;
+    dbName = databaseNames[0];
+    inFile=args_info.RESTORE_arg;
+    return 0;
+  }
+
+  if(args_info.RESIZE_given){
+    command=COM_RESIZE;
+    dbName = databaseNames[0];
+    return 0;
+  }
+
+  if(args_info.COMPACT_given){
+    command=COM_COMPACT;
+    dbName = databaseNames[0];
+    return 0;
+  }
+
+  if(args_info.PACK_given){
+    command=COM_PACK;
+    dbName = databaseNames[0];
+    return 0;
+  }
+
   if(args_info.POWER_given){
     command=COM_POWER;
-    dbName=args_info.database_arg;
+    dbName = databaseNames[0];
     return 0;
   }
        
   if(args_info.INSERT_given) {
     command=COM_INSERT;
-    dbName=args_info.database_arg;
+    dbName = databaseNames[0];
     inFile=args_info.features_arg;
     if(args_info.key_given) {
       if(!args_info.features_given) {
@@ -308,9 +405,16 @@ int audioDB::processArgs(const unsigned argc, const char *argv[]){
     return 0;
   }
   
-  if(args_info.BATCHINSERT_given) {
-    command=COM_BATCHINSERT;
-    dbName=args_info.database_arg;
+  if(args_info.BATCHINSERT_given || args_info.BULKPACK_given) {
+    if(args_info.BULKPACK_given) {
+      command=COM_BULKPACK;
+      output=args_info.BULKPACK_arg;
+    } else {
+      command=COM_BATCHINSERT;
+      if(!args_info.database_given)
+        error("BATCHINSERT requires a database");
+      dbName = databaseNames[0];
+    }
     inFile=args_info.featureList_arg;
     if(args_info.keyList_given) {
       if(!args_info.featureList_given) {
@@ -347,6 +451,13 @@ int audioDB::processArgs(const unsigned argc, const char *argv[]){
     return 0;
   }
 
+  if(args_info.BULKLOAD_given) {
+    command=COM_BULKLOAD;
+    dbName = databaseNames[0];
+    inFile=args_info.BULKLOAD_arg;
+    return 0;
+  }
+
   // Set no_unit_norm flag  
   distance_kullback = args_info.distance_kullback_flag;
   no_unit_norming = args_info.no_unit_norming_flag;
@@ -361,7 +472,7 @@ int audioDB::processArgs(const unsigned argc, const char *argv[]){
     command=COM_INDEX;
     if(!args_info.database_given)
       error("INDEXing requires a database");
-    dbName=args_info.database_arg;
+    dbName = databaseNames[0];
 
     // Whether to store LSH hash tables for query in core (FORMAT2)
     lsh_in_core = !args_info.lsh_on_disk_flag; // This flag is set to 0 if on_disk requested
@@ -378,6 +489,12 @@ int audioDB::processArgs(const unsigned argc, const char *argv[]){
     if(!(lsh_param_m>0 && lsh_param_m<= (1 + (sqrt(1 + O2_SERIAL_MAX_TABLES*8.0)))/2.0))
       error("Indexing parameter m out of range (1 <= m <= 20)");
 
+    // Whether to hash rotation-invariant projections of the sequences
+    lsh_rotation_invariant = args_info.rotation_invariant_flag;
+
+    // Whether to write the compressed index rather than lshlib's
+    lsh_compress = args_info.lsh_compress_flag;
+
     lsh_param_N = args_info.lsh_N_arg;    
     if(!(lsh_param_N>0 && lsh_param_N<=O2_SERIAL_MAX_ROWS))
       error("Indexing parameter N out of range (1 <= N <= 1000000)");
@@ -398,16 +515,23 @@ int audioDB::processArgs(const unsigned argc, const char *argv[]){
   // Query command and arguments
   if(args_info.QUERY_given){
     command=COM_QUERY;
-    dbName=args_info.database_arg;
-    // XOR features and key search
-    if((!args_info.features_given && !args_info.key_given) || (args_info.features_given && args_info.key_given))
-      error("QUERY requires exactly one of either -f features or -k key");
+    dbName = databaseNames[0];
+    // XOR features, key and featureList search
+    if(args_info.features_given + args_info.key_given + args_info.featureList_given != 1)
+      error("QUERY requires exactly one of -f features, -k key or -F featureList");
     if(args_info.features_given)
       inFile=args_info.features_arg; // query from file
-    else{
+    else if(args_info.key_given){
       query_from_key = true;
       key=args_info.key_arg;      // query from key
     }
+    else{
+      queryListName=args_info.featureList_arg; // queries from files, in one scan
+      if(args_info.powerList_given)
+        queryPowerListName=args_info.powerList_arg;
+      if(args_info.power_given || args_info.times_given)
+        error("queries from a --featureList take their power from a --powerList, and do not take times");
+    }
 
     if(args_info.keyList_given){
       trackFileName=args_info.keyList_arg;
@@ -445,8 +569,25 @@ int audioDB::processArgs(const unsigned argc, const char *argv[]){
       queryType=O2_N_SEQUENCE_QUERY;
     else if(strncmp(args_info.QUERY_arg, "onetoonensequence", MAXSTR)==0)
       queryType=O2_ONE_TO_ONE_N_SEQUENCE_QUERY;
+    else if(strncmp(args_info.QUERY_arg, "warpsequence", MAXSTR)==0)
+      queryType=O2_WARP_SEQUENCE_QUERY;
     else
       error("unsupported query type",args_info.QUERY_arg);
+
+    // Long sequence queries use FFT distance profiles
+    use_mass = (queryType == O2_SEQUENCE_QUERY || queryType == O2_N_SEQUENCE_QUERY)
+      && sequenceLength >= O2_MASS_MIN_SEQLEN && !distance_kullback && !use_rotate;
+    if(sequenceLength > 1000 && !use_mass)
+      error("seqlen out of range: 1 <= seqlen <= 1000 (longer sequences require -Q sequence or nsequence)");
+    if(queryListName && (!(queryType == O2_SEQUENCE_QUERY || queryType == O2_N_SEQUENCE_QUERY) || distance_kullback || use_rotate))
+      error("queries from a --featureList must be -Q sequence or nsequence, without --distance_kullback or --rotate");
+
+    if(queryType == O2_WARP_SEQUENCE_QUERY && use_rotate)
+      error("warpsequence search does not support --rotate");
+    expandFactor = args_info.expandfactor_arg;
+    if(expandFactor < 1.0 || expandFactor > 100.0)
+      error("expandfactor out of range: 1.0 <= expandfactor <= 100.0");
+    use_warp_bounds = !args_info.warp_no_bounds_flag;
     
     if(!args_info.exhaustive_flag){
       queryPoint = args_info.qpoint_arg;
@@ -461,6 +602,37 @@ int audioDB::processArgs(const unsigned argc, const char *argv[]){
     // Whether to perform exact evaluation of points returned by LSH
     lsh_exact = args_info.lsh_exact_flag;
 
+    // Rotated queries look up candidates in the rotation-invariant index
+    lsh_rotation_invariant = use_rotate;
+
+    // Whether to probe only the first tables of a compressed index
+    if(args_info.lsh_tables_given) {
+      if(!(args_info.lsh_tables_arg > 0 && args_info.lsh_tables_arg <= O2_SERIAL_MAX_TABLES))
+        error("lsh_tables out of range (1 <= lsh_tables <= 190)");
+      lsh_tables = args_info.lsh_tables_arg;
+      if(queryType != O2_SEQUENCE_QUERY && queryType != O2_N_SEQUENCE_QUERY)
+        error("--lsh_tables applies only to sequence and nsequence searches");
+      if(queryListName)
+        error("--lsh_tables is not supported with a --featureList");
+    }
+
+    // Whether to cache query results
+    use_cache = args_info.cache_flag;
+
+    // Memory for radius results before they are spilled to disk
+    if(args_info.reporter_memory_arg < 0)
+      error("--reporter_memory must not be negative");
+    reporterMemory = args_info.reporter_memory_arg;
+
+    // How long the search may take
+    if(args_info.timeout_ms_given) {
+      if(args_info.timeout_ms_arg < 1)
+        error("--timeout-ms must be at least 1");
+      if(use_cache)
+        error("--timeout-ms cannot be combined with --cache, whose results must be complete");
+      deadline_set(args_info.timeout_ms_arg);
+    }
+
     pointNN = args_info.pointnn_arg;
     if(pointNN < 1 || pointNN > O2_MAXNN) {
       error("pointNN out of range: 1 <= pointNN <= 1000000");
@@ -474,7 +646,7 @@ int audioDB::processArgs(const unsigned argc, const char *argv[]){
   
   if(args_info.LISZT_given){
     command = COM_LISZT;
-    dbName=args_info.database_arg;
+    dbName = databaseNames[0];
     lisztOffset = args_info.lisztOffset_arg;
     lisztLength = args_info.lisztLength_arg;
     if(args_info.lisztOffset_arg<0) // check upper bound later when database is opened
@@ -569,7 +741,13 @@ void audioDB::dump(const char *dbName) {
       error("Failed to open database file", dbName);
     }
   }
-  if(audiodb_dump(adb, output)) {
+  times_expand(dbName, adb);
+  if(args_info.snapshot_flag) {
+    if(args_info.chunks_arg < 1) {
+      error("--chunks must be at least 1");
+    }
+    snapshot_dump(dbName, output, args_info.chunks_arg);
+  } else if(audiodb_dump(adb, output)) {
     error("Failed to dump database to ", output);
   }
   status(dbName);
@@ -591,13 +769,66 @@ void audioDB::insert(const char* dbName, const char* inFile) {
   insert.power = powerFileName;
   insert.key = key;
 
-  if(audiodb_insert(adb, &insert)) {
+  keyhash_init();
+  if(insertFromFiles(&insert)) {
     error("insertion failure", inFile);
   }
+  if(adb->header->numFiles > keyHashCount)
+    keyhash_insert(adb->header->numFiles - 1);
+  keyhash_write();
   status(dbName);
 }
 
+// Insert a track from its feature file and optional times and power
+// files.  Tracks with times are read here and given to the library as
+// a datum, so that their times files go through insertTimeStamps()
+// (and may be binary); other tracks, and every track of a LARGE_ADB
+// database, which records the file names, go to audiodb_insert().
+int audioDB::insertFromFiles(adb_insert_t *insert) {
+  if(!insert->times) {
+    return audiodb_insert(adb, insert);
+  }
+  if(adb->header->flags & O2_FLAG_LARGE_ADB) {
+    int fd = open(insert->times, O_RDONLY);
+    uint32_t magic = 0;
+    if(fd >= 0) {
+      if(read(fd, &magic, sizeof(magic)) != (ssize_t) sizeof(magic)) {
+        magic = 0;
+      }
+      close(fd);
+    }
+    if(magic == O2_TIMES_MAGIC) {
+      error("binary times files cannot be referenced by a LARGE_ADB database", insert->times);
+    }
+    return audiodb_insert(adb, insert);
+  }
+
+  adb_datum_t datum = {0};
+  datum.key = insert->key ? insert->key : insert->features;
+  datum.data = readFeatureFile(insert->features, &datum.dim, &datum.nvectors);
+  if(insert->power) {
+    uint32_t one, n;
+    datum.power = readFeatureFile(insert->power, &one, &n);
+    if(one != 1) {
+      error("malformed power file dimensionality", insert->power);
+    }
+    if(n != datum.nvectors) {
+      error("power file length does not match feature file", insert->power);
+    }
+  }
+  datum.times = new double[2 * datum.nvectors + 1];
+  insertTimeStamps(datum.nvectors, insert->times, datum.times);
+
+  int result = audiodb_insert_datum(adb, &datum);
+
+  delete[] datum.times;
+  free(datum.power);
+  free(datum.data);
+  return result;
+}
+
 void audioDB::batchinsert(const char* dbName, const char* inFile) {
+  stats_phase("open");
   if(!adb) {
     if(!(adb = audiodb_open(dbName, O_RDWR))) {
       error("failed to open database", dbName);
@@ -624,6 +855,12 @@ void audioDB::batchinsert(const char* dbName, const char* inFile) {
   char *thisTimesFileName = new char[MAXSTR];
   char *thisPowerFileName = new char[MAXSTR];
 
+  // keys already in the database are skipped without opening their
+  // feature files
+  stats_phase("keys");
+  keyhash_init();
+  stats_phase("insert");
+
   do {
     filesIn->getline(thisFile,MAXSTR);
     if(key && key!=inFile) {
@@ -656,11 +893,23 @@ void audioDB::batchinsert(const char* dbName, const char* inFile) {
     insert.times = usingTimes ? thisTimesFileName : NULL;
     insert.power = usingPower ? thisPowerFileName : NULL;
     insert.key = thisKey;
-    if(audiodb_insert(adb, &insert)) {
+    if(key_index(thisKey) != O2_ERR_KEYNOTFOUND) {
+      VERB_LOG(1, "%s: key already in database, skipping\n", thisKey);
+      stats_count("duplicates");
+      continue;
+    }
+    if(insertFromFiles(&insert)) {
       error("insertion failure", thisFile);
     }
+    stats_count("tracks");
+    if(adb->header->numFiles > keyHashCount)
+      keyhash_insert(adb->header->numFiles - 1);
   } while(!filesIn->eof());
 
+  stats_phase("keys");
+  keyhash_write();
+  stats_phase(NULL);
+
   VERB_LOG(0, "%s %s %u vectors %ju bytes.\n", COM_BATCHINSERT, dbName, totalVectors, (intmax_t) (totalVectors * adb->header->dim * sizeof(double)));
 
   delete [] thisPowerFileName;
@@ -677,41 +926,78 @@ void audioDB::batchinsert(const char* dbName, const char* inFile) {
   status(dbName);
 }
 
-void audioDB::datumFromFiles(adb_datum_t *datum) {
-  int fd;
+// Read a feature or power file into malloc()ed memory, returning its
+// dimension, its number of vectors and its data.  The files are read
+// rather than mapped: the 4-byte dimension header leaves the data
+// misaligned for doubles in any mapping of the file, which has to
+// start at a page boundary, so a mapping could not be used in place.
+double *audioDB::readFeatureFile(const char *fileName, uint32_t *dim, uint32_t *nvectors) {
+  int fd = open(fileName, O_RDONLY);
+  if(fd < 0) {
+    error("failed to open feature file", fileName);
+  }
   struct stat st;
+  if(fstat(fd, &st)) {
+    error("fstat error finding size of input", fileName, "fstat");
+  }
+  if(st.st_size < (off_t) sizeof(uint32_t)) {
+    error("feature file too short", fileName);
+  }
+  if(read(fd, dim, sizeof(uint32_t)) != (ssize_t) sizeof(uint32_t)) {
+    error("short read of input file", fileName);
+  }
+  size_t nbytes = st.st_size - sizeof(uint32_t);
+  if(*dim == 0 || nbytes % (*dim * sizeof(double))) {
+    error("malformed feature file", fileName);
+  }
+  *nvectors = nbytes / (*dim * sizeof(double));
 
-  /* FIXME: around here error conditions will cause all sorts of
-     hideous leaks. */
-  fd = open(inFile, O_RDONLY);
-  if(fd < 0) {
-    error("failed to open feature file", inFile);
+  double *data = (double *) malloc(nbytes ? nbytes : sizeof(double));
+  if(!data) {
+    error("failed to allocate feature data", fileName, "malloc");
+  }
+  for(size_t got = 0; got < nbytes; ) {
+    ssize_t n = read(fd, (char *) data + got, nbytes - got);
+    if(n <= 0) {
+      error("short read of input file", fileName);
+    }
+    got += n;
   }
-  fstat(fd, &st);
-  read(fd, &(datum->dim), sizeof(uint32_t));
-  datum->nvectors = (st.st_size - sizeof(uint32_t)) / (datum->dim * sizeof(double));
-  datum->data = (double *) malloc(st.st_size - sizeof(uint32_t));
-  read(fd, datum->data, st.st_size - sizeof(uint32_t));
   close(fd);
+  return data;
+}
+
+void audioDB::datumFromFiles(adb_datum_t *datum) {
+  uint32_t n;
+  datum->data = readFeatureFile(inFile, &(datum->dim), &(datum->nvectors));
   if(usingPower) {
     uint32_t one;
-    fd = open(powerFileName, O_RDONLY);
-    if(fd < 0) {
-      error("failed to open power file", powerFileName);
-    }
-    read(fd, &one, sizeof(uint32_t));
+    datum->power = readFeatureFile(powerFileName, &one, &n);
     if(one != 1) {
       error("malformed power file dimensionality", powerFileName);
     }
-    datum->power = (double *) malloc(datum->nvectors * sizeof(double));
-    if(read(fd, datum->power, datum->nvectors * sizeof(double)) != (ssize_t) (datum->nvectors * sizeof(double))) {
-      error("malformed power file", powerFileName);
+    if(n != datum->nvectors) {
+      error("power file length does not match feature file", powerFileName);
     }
-    close(fd);
   }
   if(usingTimes) {
     datum->times = (double *) malloc(2 * datum->nvectors * sizeof(double));
-    insertTimeStamps(datum->nvectors, timesFile, datum->times);
+    insertTimeStamps(datum->nvectors, timesFileName, datum->times);
+  }
+}
+
+void audioDB::datumFree(adb_datum_t *datum) {
+  if(datum->data) {
+    free(datum->data);
+    datum->data = NULL;
+  }
+  if(datum->power) {
+    free(datum->power);
+    datum->power = NULL;
+  }
+  if(datum->times) {
+    free(datum->times);
+    datum->times = NULL;
   }
 }
 
@@ -739,40 +1025,38 @@ void audioDB::rotateDatum(adb_datum_t *datum, int amount) {
 
 void audioDB::query(const char* dbName, const char* inFile) {
 
+  stats_phase("open");
+  if(!shards.empty()) {
+    if(queryType == O2_WARP_SEQUENCE_QUERY || use_rotate || use_cache || deadline || lsh_tables)
+      error("warped, rotated, cached, --timeout-ms and --lsh_tables queries are not supported across several databases");
+    if(sequenceLength > 1000)
+      error("seqlen out of range for several databases: 1 <= seqlen <= 1000");
+    use_mass = false;
+    if(!adb)
+      shards_open();
+  }
+
   if(!adb) {
     if(!(adb = audiodb_open(dbName, O_RDONLY))) {
       error("failed to open database", dbName);
     }
   }
-
   /* FIXME: we only need this for getting nfiles, which we only need
    * because the reporters aren't desperately well implemented,
    * relying on statically-sized vectors rather than adjustable data
    * structures.  Rework reporter.h to be less lame. */
   adb_status_t status;
   audiodb_status(adb, &status);
-  uint32_t nfiles = status.numFiles;
+  uint32_t nfiles = shards.empty() ? status.numFiles : shards_numFiles();
 
   adb_query_spec_t qspec;
   adb_datum_t datum = {0};
 
   qspec.refine.flags = 0;
   if(trackFile) {
+    stats_phase("keylist");
     qspec.refine.flags |= ADB_REFINE_INCLUDE_KEYLIST;
-    std::vector<const char *> v;
-    char *k = new char[MAXSTR];
-    trackFile->getline(k, MAXSTR);    
-    while(!trackFile->eof()) {
-      v.push_back(k);
-      k = new char[MAXSTR];
-      trackFile->getline(k, MAXSTR);    
-    }
-    delete [] k;
-    qspec.refine.include.nkeys = v.size();
-    qspec.refine.include.keys = new const char *[qspec.refine.include.nkeys];
-    for(unsigned int k = 0; k < qspec.refine.include.nkeys; k++) {
-      qspec.refine.include.keys[k] = v[k];
-    }
+    keylist_restrict(&qspec.refine.include);
   }
   if(query_from_key) {
     qspec.refine.flags |= ADB_REFINE_EXCLUDE_KEYLIST;
@@ -802,6 +1086,15 @@ void audioDB::query(const char* dbName, const char* inFile) {
     qspec.refine.flags |= ADB_REFINE_HOP_SIZE;
   }
 
+  if(queryListName) {
+    query_list(&qspec, nfiles);
+    if(trackFile) {
+      delete[] qspec.refine.include.keys;
+    }
+    return;
+  }
+
+  stats_phase("datum");
   if(query_from_key) {
     datum.key = key;
     if(use_absolute_threshold || use_relative_threshold) {
@@ -822,75 +1115,43 @@ void audioDB::query(const char* dbName, const char* inFile) {
   }
 
   qspec.qid.datum = &datum;
+  // duration ratios are refined here if the times table is compacted
+  times_restrict(&qspec);
   qspec.qid.sequence_length = sequenceLength;
   qspec.qid.flags = 0;
   qspec.qid.flags |= usingQueryPoint ? 0 : ADB_QID_FLAG_EXHAUSTIVE;
   qspec.qid.flags |= lsh_exact ? 0 : ADB_QID_FLAG_ALLOW_FALSE_POSITIVES;
   qspec.qid.sequence_start = queryPoint;
 
-  switch(queryType) {
-  case O2_POINT_QUERY:
-    qspec.qid.sequence_length = 1;
-    qspec.params.accumulation = ADB_ACCUMULATION_DB;
-    qspec.params.distance = ADB_DISTANCE_DOT_PRODUCT;
-    qspec.params.npoints = pointNN;
-    qspec.params.ntracks = 0;
-    reporter = new pointQueryReporter< std::greater < NNresult > >(pointNN);
-    break;
-  case O2_TRACK_QUERY:
-    qspec.qid.sequence_length = 1;
-    qspec.params.accumulation = ADB_ACCUMULATION_PER_TRACK;
-    qspec.params.distance = ADB_DISTANCE_DOT_PRODUCT;
-    qspec.params.npoints = pointNN;
-    qspec.params.ntracks = trackNN;
-    reporter = new trackAveragingReporter< std::greater< NNresult > >(pointNN, trackNN, nfiles);
-    break;
-  case O2_SEQUENCE_QUERY:
-  case O2_N_SEQUENCE_QUERY:
-    qspec.params.accumulation = ADB_ACCUMULATION_PER_TRACK;
-    if (distance_kullback)
-      qspec.params.distance = ADB_DISTANCE_KULLBACK_LEIBLER_DIVERGENCE;
-    else
-      qspec.params.distance = no_unit_norming ? ADB_DISTANCE_EUCLIDEAN : ADB_DISTANCE_EUCLIDEAN_NORMED;
-    qspec.params.npoints = pointNN;
-    qspec.params.ntracks = trackNN;
-    switch(queryType) {
-    case O2_SEQUENCE_QUERY:
-      if(!(qspec.refine.flags & ADB_REFINE_RADIUS)) {
-        reporter = new trackAveragingReporter< std::less< NNresult > >(pointNN, trackNN, nfiles);
-      } else {
-	reporter = new trackSequenceQueryRadReporter(trackNN, nfiles);
-      }
-      break;
-    case O2_N_SEQUENCE_QUERY:
-      if(!(qspec.refine.flags & ADB_REFINE_RADIUS)) {
-        reporter = new trackSequenceQueryNNReporter< std::less < NNresult > >(pointNN, trackNN, nfiles);
-      } else {
-	reporter = new trackSequenceQueryRadNNReporter(pointNN, trackNN, nfiles);
-      }
-      break;
-    }
-    break;
-  case O2_ONE_TO_ONE_N_SEQUENCE_QUERY:
-    qspec.params.accumulation = ADB_ACCUMULATION_ONE_TO_ONE;
-    if (distance_kullback)
-      qspec.params.distance = ADB_DISTANCE_KULLBACK_LEIBLER_DIVERGENCE;
-    else
-      qspec.params.distance = no_unit_norming ? ADB_DISTANCE_EUCLIDEAN : ADB_DISTANCE_EUCLIDEAN_NORMED;
-    qspec.params.npoints = 0;
-    qspec.params.ntracks = 0;
-    if(!(qspec.refine.flags & ADB_REFINE_RADIUS)) {
-      error("query-type not yet supported");
-    } else {
-      reporter = new trackSequenceQueryRadNNReporterOneToOne(pointNN,trackNN, adb->header->numFiles);
-    }
-    break;
-  default:
-    error("unrecognized queryType");
-  }
+  reporter = query_reporter(&qspec, nfiles);
+
+  stats_phase("search");
+  if(use_mass && mass_index_exists())
+    use_mass = false;
+  if(sequenceLength > 1000 && !use_mass)
+    error("seqlen out of range: 1 <= seqlen <= 1000 (longer sequences are searched by FFT, which is not used when an LSH index exists)");
+  if(use_cache && (use_mass || queryType == O2_WARP_SEQUENCE_QUERY || use_rotate))
+    error("--cache applies only to searches made by the library: not to FFT (long sequence), warpsequence or --rotate searches");
+
+  if(!shards.empty())
+    ((Reporter *) reporter)->set_shards(&shards);
 
   adb_query_results_t *rs = NULL;
-  if(use_rotate) {
+  if(!shards.empty()) {
+    shards_query(&qspec);
+  } else if(use_mass || queryType == O2_WARP_SEQUENCE_QUERY || lsh_batch_applies(&qspec)) {
+    if(query_from_key) {
+      if(audiodb_retrieve_datum(adb, key, qspec.qid.datum))
+        error("failed to retrieve query datum", key);
+    }
+    if(use_mass)
+      mass_query(&qspec);
+    else if(queryType == O2_WARP_SEQUENCE_QUERY)
+      warp_query(&qspec);
+    else
+      lsh_batch_query(&qspec);
+  } else if(use_rotate) {
+    advise_library(adb);
     int rotate_min = 0;
     int rotate_max = 0;
     adb_status_t s = {0};
@@ -911,7 +1172,11 @@ void audioDB::query(const char* dbName, const char* inFile) {
     }
     rotateDatum(qspec.qid.datum, rotate_min);
     const char *const sentinel = "";
+    // with a deadline, coverage is counted in rotations searched
+    searchableVectors = rotate_max - rotate_min + 1;
     for (int i = rotate_min; i <= rotate_max; i++) {
+      if(deadline_passed())
+        break;
       ors = rs;
       rs = audiodb_query_spec_given_sofar(adb, &qspec, ors);
       if(ors) {
@@ -920,44 +1185,156 @@ void audioDB::query(const char* dbName, const char* inFile) {
       for(unsigned int k = 0; k < rs->nresults; k++) {
         adb_result_t r = rs->results[k];
         if (r.ikey != sentinel)
-          reporter->add_point(audiodb_key_index(adb, r.ikey), r.qpos, r.ipos, r.dist, i);
+          reporter->add_point(key_index(r.ikey), r.qpos, r.ipos, r.dist, i);
       }
       for(uint32_t j = 0; j < rs->nresults; j++) {
         rs->results[j].ikey = sentinel;
       }
       rotateDatum(qspec.qid.datum, 1);
+      searchedVectors++;
     }
+  } else if(deadline && !mass_index_exists()) {
+    deadline_query(&qspec);
   } else {
-    rs = audiodb_query_spec(adb, &qspec);
-
-    if(rs == NULL) {
-      error("audiodb_query_spec failed");
+    std::string cacheKey;
+    std::vector<CachedResult> cached;
+    if(use_cache) {
+      cache_open();
+      cache_key(&qspec, cacheKey);
     }
+    if(use_cache && cache_lookup(cacheKey, cached)) {
+      cacheHits++;
+      stats_phase("reporter");
+      stats_count("results", cached.size());
+      for(unsigned int k = 0; k < cached.size(); k++) {
+        CachedResult &r = cached[k];
+        reporter->add_point(key_index(r.ikey.c_str()), r.qpos, r.ipos, r.dist);
+      }
+    } else {
+      advise_library(adb);
+      rs = audiodb_query_spec(adb, &qspec);
+
+      if(rs == NULL) {
+        error("audiodb_query_spec failed");
+      }
 
-    for(unsigned int k = 0; k < rs->nresults; k++) {
-      adb_result_t r = rs->results[k];
-      reporter->add_point(audiodb_key_index(adb, r.ikey), r.qpos, r.ipos, r.dist);
+      if(use_cache) {
+        cacheMisses++;
+        cache_store(cacheKey, rs);
+      }
+      stats_phase("reporter");
+      stats_count("results", rs->nresults);
+      for(unsigned int k = 0; k < rs->nresults; k++) {
+        adb_result_t r = rs->results[k];
+        reporter->add_point(key_index(r.ikey), r.qpos, r.ipos, r.dist);
+      }
+      audiodb_query_free_results(adb, &qspec, rs);
     }
-    audiodb_query_free_results(adb, &qspec, rs);
+    if(use_cache)
+      cache_report();
   }
 
   // FIXME: we don't yet free everything up if there are error
   // conditions during the construction of the query spec (including
   // the datum itself).
-  if(datum.data) {
-    free(datum.data);
-    datum.data = NULL;
-  }
-  if(datum.power) {
-    free(datum.power);
-    datum.power = NULL;
+  datumFree(&datum);
+  if((qspec.refine.flags & ADB_REFINE_INCLUDE_KEYLIST) && shards.empty()) {
+    delete[] qspec.refine.include.keys;
   }
-  if(datum.times) {
-    free(datum.times);
-    datum.times = NULL;
+
+  stats_phase("report");
+  query_report(reporter);
+  deadline_report();
+}
+
+void audioDB::query_report(ReporterBase *r) {
+  r->report(adb, use_rotate);
+  stats_count("deduplicated", ((Reporter *) r)->duplicates);
+  if(((Reporter *) r)->spilled)
+    stats_count("spilled", ((Reporter *) r)->spilled);
+}
+
+// Set the search parameters of qspec for the query type, and make the
+// reporter its results go to
+ReporterBase *audioDB::query_reporter(adb_query_spec_t *qspec, uint32_t nfiles) {
+  ReporterBase *r = 0;
+  switch(queryType) {
+  case O2_POINT_QUERY:
+    qspec->qid.sequence_length = 1;
+    qspec->params.accumulation = ADB_ACCUMULATION_DB;
+    qspec->params.distance = ADB_DISTANCE_DOT_PRODUCT;
+    qspec->params.npoints = pointNN;
+    qspec->params.ntracks = 0;
+    r = new pointQueryReporter< std::greater < NNresult > >(pointNN);
+    break;
+  case O2_TRACK_QUERY:
+    qspec->qid.sequence_length = 1;
+    qspec->params.accumulation = ADB_ACCUMULATION_PER_TRACK;
+    qspec->params.distance = ADB_DISTANCE_DOT_PRODUCT;
+    qspec->params.npoints = pointNN;
+    qspec->params.ntracks = trackNN;
+    r = new trackAveragingReporter< std::greater< NNresult > >(pointNN, trackNN, nfiles);
+    break;
+  case O2_SEQUENCE_QUERY:
+  case O2_N_SEQUENCE_QUERY:
+    qspec->params.accumulation = ADB_ACCUMULATION_PER_TRACK;
+    if (distance_kullback)
+      qspec->params.distance = ADB_DISTANCE_KULLBACK_LEIBLER_DIVERGENCE;
+    else
+      qspec->params.distance = no_unit_norming ? ADB_DISTANCE_EUCLIDEAN : ADB_DISTANCE_EUCLIDEAN_NORMED;
+    qspec->params.npoints = pointNN;
+    qspec->params.ntracks = trackNN;
+    switch(queryType) {
+    case O2_SEQUENCE_QUERY:
+      if(!(qspec->refine.flags & ADB_REFINE_RADIUS)) {
+        r = new trackAveragingReporter< std::less< NNresult > >(pointNN, trackNN, nfiles);
+      } else {
+	r = new trackSequenceQueryRadReporter(trackNN, nfiles);
+      }
+      break;
+    case O2_N_SEQUENCE_QUERY:
+      if(!(qspec->refine.flags & ADB_REFINE_RADIUS)) {
+        r = new trackSequenceQueryNNReporter< std::less < NNresult > >(pointNN, trackNN, nfiles);
+      } else if(reporterMemory) {
+        r = new trackSequenceQueryRadNNSpillReporter(pointNN, trackNN, nfiles, (size_t) reporterMemory << 20);
+      } else {
+	r = new trackSequenceQueryRadNNReporter(pointNN, trackNN, nfiles);
+      }
+      break;
+    }
+    break;
+  case O2_WARP_SEQUENCE_QUERY:
+    qspec->params.accumulation = ADB_ACCUMULATION_PER_TRACK;
+    qspec->params.distance = no_unit_norming ? ADB_DISTANCE_EUCLIDEAN : ADB_DISTANCE_EUCLIDEAN_NORMED;
+    qspec->params.npoints = pointNN;
+    qspec->params.ntracks = trackNN;
+    if(!(qspec->refine.flags & ADB_REFINE_RADIUS)) {
+      r = new trackSequenceQueryNNReporter< std::less < NNresult > >(pointNN, trackNN, nfiles);
+    } else if(reporterMemory) {
+      r = new trackSequenceQueryRadNNSpillReporter(pointNN, trackNN, nfiles, (size_t) reporterMemory << 20);
+    } else {
+      r = new trackSequenceQueryRadNNReporter(pointNN, trackNN, nfiles);
+    }
+    break;
+  case O2_ONE_TO_ONE_N_SEQUENCE_QUERY:
+    qspec->params.accumulation = ADB_ACCUMULATION_ONE_TO_ONE;
+    if (distance_kullback)
+      qspec->params.distance = ADB_DISTANCE_KULLBACK_LEIBLER_DIVERGENCE;
+    else
+      qspec->params.distance = no_unit_norming ? ADB_DISTANCE_EUCLIDEAN : ADB_DISTANCE_EUCLIDEAN_NORMED;
+    qspec->params.npoints = 0;
+    qspec->params.ntracks = 0;
+    if(!(qspec->refine.flags & ADB_REFINE_RADIUS)) {
+      error("query-type not yet supported");
+    } else {
+      r = new trackSequenceQueryRadNNReporterOneToOne(pointNN,trackNN, adb->header->numFiles);
+    }
+    break;
+  default:
+    error("unrecognized queryType");
   }
 
-  reporter->report(adb, use_rotate);
+  return r;
 }
 
 void audioDB::liszt(const char* dbName, unsigned offset, unsigned numLines) {
@@ -1064,22 +1441,12 @@ void audioDB::sample(const char *dbName) {
   spec.params.accumulation = ADB_ACCUMULATION_DB;
   spec.params.npoints = nsamples;
 
+  advise_library(adb);
   if(!(results = audiodb_sample_spec(adb, &spec))) {
     error("error in audiodb_sample_spec");
   }
 
-  if(datum.data) {
-    free(datum.data);
-    datum.data = NULL;
-  }
-  if(datum.power) {
-    free(datum.power);
-    datum.power = NULL;
-  }
-  if(datum.times) {
-    free(datum.times);
-    datum.times = NULL;
-  }
+  datumFree(&datum);
 
   if(results->nresults != nsamples) {
     error("mismatch in sample count");
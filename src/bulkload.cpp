@@ -0,0 +1,249 @@
+// Bulk loading
+//
+// --BULKPACK packs the tracks named by a --featureList (with its
+// --keyList, --timesList and --powerList) into a single container
+// file, and --BULKLOAD appends every track in a container to a
+// database.  Loading a catalogue from a container costs one open and
+// one mapping rather than an open, stat, read and close of three files
+// per track, and the container is read front to back, so that a bulk
+// load runs at the speed of the disk rather than of its metadata.
+//
+// A container holds a header (magic number, dimension, number of
+// tracks, whether times and power are present, and the offset of the
+// table of contents), then each track's features, power and times
+// (start and end of each vector, as inserted) as native doubles, then
+// the keys, NUL-terminated, and last the table of contents: one entry
+// per track giving the offsets of its data and key and its number of
+// vectors.  Every double is 8-byte aligned, so tracks are passed to
+// the library straight from the mapped file.
+
+#include "audioDB.h"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t dim;
+  uint32_t ntracks;
+  uint32_t flags;
+  uint64_t tocOffset;
+} bulk_header_t;
+
+typedef struct {
+  uint64_t data;
+  uint64_t power;
+  uint64_t times;
+  uint64_t key;
+  uint32_t nvectors;
+  uint32_t pad;
+} bulk_entry_t;
+
+static bool bulk_write(int fd, const void *buf, size_t count) {
+  const char *p = (const char *) buf;
+  while(count) {
+    ssize_t n = write(fd, p, count);
+    if(n <= 0)
+      return false;
+    p += n;
+    count -= n;
+  }
+  return true;
+}
+
+void audioDB::bulkpack(const char *containerName, const char *inFile) {
+  std::ifstream filesIn(inFile);
+  if(!filesIn.is_open())
+    error("Could not open batch in file", inFile);
+  std::ifstream keysIn;
+  if(key) {
+    keysIn.open(key);
+    if(!keysIn.is_open())
+      error("Could not open batch key file", key);
+  }
+
+  int fd = open(containerName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(fd < 0)
+    error("failed to create container file", containerName, "open");
+  bulk_header_t h = {O2_BULK_MAGIC, 0, 0, 0, 0};
+  if(usingTimes)
+    h.flags |= O2_FLAG_TIMES;
+  if(usingPower)
+    h.flags |= O2_FLAG_POWER;
+  if(!bulk_write(fd, &h, sizeof(h)))
+    error("failed to write container file", containerName, "write");
+
+  std::vector<bulk_entry_t> toc;
+  std::string keys;
+  uint64_t offset = sizeof(h);
+  char *thisFile = new char[MAXSTR];
+  char *thisKey = new char[MAXSTR];
+  char *thisTimesFileName = new char[MAXSTR];
+  char *thisPowerFileName = new char[MAXSTR];
+
+  stats_phase("pack");
+  while(filesIn.getline(thisFile, MAXSTR)) {
+    if(key && !keysIn.getline(thisKey, MAXSTR))
+      error("not enough keys in keyList", key);
+    if(usingTimes && !timesFile->getline(thisTimesFileName, MAXSTR))
+      error("not enough timestamp files in timesList", timesFileName);
+    if(usingPower && !powerFile->getline(thisPowerFileName, MAXSTR))
+      error("not enough power files in powerList", powerFileName);
+
+    bulk_entry_t e = {0, 0, 0, 0, 0, 0};
+    uint32_t dim;
+    double *data = readFeatureFile(thisFile, &dim, &e.nvectors);
+    if(!h.dim)
+      h.dim = dim;
+    else if(dim != h.dim)
+      error("feature file dimension differs from the first feature file", thisFile);
+    size_t n = (size_t) e.nvectors * dim * sizeof(double);
+    e.data = offset;
+    if(!bulk_write(fd, data, n))
+      error("failed to write container file", containerName, "write");
+    offset += n;
+    free(data);
+
+    n = (size_t) e.nvectors * sizeof(double);
+    if(usingPower) {
+      uint32_t one, np;
+      double *power = readFeatureFile(thisPowerFileName, &one, &np);
+      if(one != 1)
+        error("malformed power file dimensionality", thisPowerFileName);
+      if(np != e.nvectors)
+        error("power file length does not match feature file", thisPowerFileName);
+      e.power = offset;
+      if(!bulk_write(fd, power, n))
+        error("failed to write container file", containerName, "write");
+      offset += n;
+      free(power);
+    }
+    if(usingTimes) {
+      double *times = new double[2 * e.nvectors + 1];
+      insertTimeStamps(e.nvectors, thisTimesFileName, times);
+      e.times = offset;
+      if(!bulk_write(fd, times, 2 * n))
+        error("failed to write container file", containerName, "write");
+      offset += 2 * n;
+      delete[] times;
+    }
+
+    e.key = keys.size();
+    keys.append(key ? thisKey : thisFile);
+    keys.push_back('\0');
+    toc.push_back(e);
+    stats_count("tracks");
+  }
+
+  // keys follow the data, and the table of contents follows the keys
+  stats_phase("toc");
+  for(unsigned k = 0; k < toc.size(); k++)
+    toc[k].key += offset;
+  offset += keys.size();
+  keys.append(ALIGN_UP(offset, 3) - offset, '\0');
+  offset = ALIGN_UP(offset, 3);
+  h.ntracks = toc.size();
+  h.tocOffset = offset;
+  if(!bulk_write(fd, keys.data(), keys.size()) ||
+     (h.ntracks && !bulk_write(fd, &toc[0], h.ntracks * sizeof(bulk_entry_t))) ||
+     pwrite(fd, &h, sizeof(h), 0) != (ssize_t) sizeof(h))
+    error("failed to write container file", containerName, "write");
+  if(close(fd))
+    error("failed to write container file", containerName, "close");
+  stats_phase(NULL);
+
+  VERB_LOG(0, "%s %s %u tracks %ju bytes.\n", COM_BULKPACK, containerName, h.ntracks, (intmax_t) (offset + h.ntracks * sizeof(bulk_entry_t)));
+
+  delete[] thisPowerFileName;
+  delete[] thisTimesFileName;
+  delete[] thisKey;
+  delete[] thisFile;
+}
+
+void audioDB::bulkload(const char *dbName, const char *containerName) {
+  stats_phase("open");
+  if(!adb) {
+    if(!(adb = audiodb_open(dbName, O_RDWR))) {
+      error("failed to open database", dbName);
+    }
+  }
+  if(adb->header->flags & O2_FLAG_LARGE_ADB)
+    error("--BULKLOAD cannot add to a database holding feature file names", dbName);
+
+  int fd = open(containerName, O_RDONLY);
+  if(fd < 0)
+    error("failed to open container file", containerName, "open");
+  struct stat st;
+  if(fstat(fd, &st))
+    error("fstat error finding size of container", containerName, "fstat");
+  if(st.st_size < (off_t) sizeof(bulk_header_t))
+    error("container file too short", containerName);
+  // a private mapping, as the library may rewrite the data it is given
+  void *m = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(m == MAP_FAILED)
+    error("mmap error for container file", containerName, "mmap");
+  madvise(m, st.st_size, MADV_SEQUENTIAL);
+
+  char *base = (char *) m;
+  uint64_t size = st.st_size;
+  bulk_header_t *h = (bulk_header_t *) base;
+  if(h->magic != O2_BULK_MAGIC || h->tocOffset % sizeof(double) || h->tocOffset > size ||
+     (size - h->tocOffset) / sizeof(bulk_entry_t) < h->ntracks) {
+    munmap(m, st.st_size);
+    error("malformed container file", containerName);
+  }
+  bulk_entry_t *toc = (bulk_entry_t *) (base + h->tocOffset);
+
+  stats_phase("keys");
+  keyhash_init();
+  stats_phase("insert");
+
+  unsigned totalVectors = 0;
+  for(Uns32T k = 0; k < h->ntracks; k++) {
+    bulk_entry_t &e = toc[k];
+    uint64_t n = (uint64_t) e.nvectors * h->dim * sizeof(double);
+    uint64_t np = (uint64_t) e.nvectors * sizeof(double);
+    if(e.data % sizeof(double) || e.data > h->tocOffset || n > h->tocOffset - e.data ||
+       ((h->flags & O2_FLAG_POWER) && (e.power % sizeof(double) || e.power > h->tocOffset || np > h->tocOffset - e.power)) ||
+       ((h->flags & O2_FLAG_TIMES) && (e.times % sizeof(double) || e.times > h->tocOffset || 2 * np > h->tocOffset - e.times)) ||
+       e.key >= h->tocOffset || !memchr(base + e.key, '\0', h->tocOffset - e.key)) {
+      munmap(m, st.st_size);
+      error("malformed container file", containerName);
+    }
+
+    adb_datum_t datum = {0};
+    datum.nvectors = e.nvectors;
+    datum.dim = h->dim;
+    datum.key = base + e.key;
+    datum.data = (double *) (base + e.data);
+    datum.power = (h->flags & O2_FLAG_POWER) ? (double *) (base + e.power) : NULL;
+    datum.times = (h->flags & O2_FLAG_TIMES) ? (double *) (base + e.times) : NULL;
+
+    if(key_index(datum.key) != O2_ERR_KEYNOTFOUND) {
+      VERB_LOG(1, "%s: key already in database, skipping\n", datum.key);
+      stats_count("duplicates");
+      continue;
+    }
+    if(audiodb_insert_datum(adb, &datum)) {
+      munmap(m, st.st_size);
+      error("insertion failure", datum.key);
+    }
+    totalVectors += e.nvectors;
+    stats_count("tracks");
+    if(adb->header->numFiles > keyHashCount)
+      keyhash_insert(adb->header->numFiles - 1);
+
+    // the track will not be read again
+    uint64_t start = ALIGN_PAGE_DOWN(e.data);
+    if(start < e.data + n)
+      madvise(base + start, ALIGN_PAGE_DOWN(e.data + n) - start, MADV_DONTNEED);
+  }
+  munmap(m, st.st_size);
+
+  stats_phase("keys");
+  keyhash_write();
+  stats_phase(NULL);
+
+  VERB_LOG(0, "%s %s %u vectors %ju bytes.\n", COM_BULKLOAD, dbName, totalVectors, (intmax_t) (totalVectors * adb->header->dim * sizeof(double)));
+
+  // Report status
+  status(dbName);
+}
@@ -0,0 +1,341 @@
+// Query result cache
+//
+// Results of audiodb_query_spec() are cached on disk, in the directory
+// dbName.cache, one file per query.  Only searches made by the library
+// are cached: --cache is refused for the FFT, warped and rotated
+// searches.  The cache key is
+// a serialization of everything the results depend on: the query
+// datum (its key, or its feature, power and times data), the query
+// spec (identification, parameters and refinements, including the
+// keylists), the database's numFiles, length and flags, and the
+// modification time and size of any LSH index for the query's radius
+// and sequence length.  Inserting into the database or (re)building
+// the index therefore changes the key of every query; stale entries
+// are removed when the cache is next opened against a changed
+// database.  Otherwise the cache holds at most O2_CACHE_MAX_ENTRIES
+// entries of O2_CACHE_MAX_BYTES in all, the least recently used being
+// removed when an entry is added beyond either.
+//
+// Entry files are named by the FNV-1a hash of the key and hold the key
+// itself, so that hash collisions are detected.  A hit sets the
+// entry's modification time, by which the least recently used are
+// found.  Hit and miss counts are kept in dbName.cache/stats.
+//
+// The cache never fails a query: if its directory cannot be created
+// or its files read or written, queries miss, and are not stored.
+
+#include "audioDB.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/file.h>
+
+#define O2_CACHE_MAGIC (('Q' << 24) | ('C' << 16) | ('A' << 8) | 'O')
+#define O2_CACHE_SUFFIX ".qc"
+#define O2_CACHE_MAX_ENTRIES (4096U)
+#define O2_CACHE_MAX_BYTES (268435456U) // 256MB
+
+// An entry file, for eviction
+typedef struct {
+  time_t mtime;
+  off_t size;
+  std::string name;
+} CacheEntry;
+
+static bool cache_entry_newer(const CacheEntry &a, const CacheEntry &b) {
+  return a.mtime > b.mtime;
+}
+
+static bool cache_is_entry(const char *name) {
+  size_t len = strlen(name);
+  return len > strlen(O2_CACHE_SUFFIX) && !strcmp(name + len - strlen(O2_CACHE_SUFFIX), O2_CACHE_SUFFIX);
+}
+
+static void cache_append(std::string &s, const void *p, size_t n) {
+  s.append((const char *) p, n);
+}
+
+static void cache_append_string(std::string &s, const char *str) {
+  uint32_t n = str ? strlen(str) : 0;
+  cache_append(s, &n, sizeof(uint32_t));
+  if(n)
+    cache_append(s, str, n);
+}
+
+static uint64_t cache_hash(const std::string &s) {
+  uint64_t h = 14695981039346656037ULL;
+  for(size_t i = 0; i < s.size(); i++) {
+    h ^= (unsigned char) s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static void cache_append_keylist(std::string &s, const adb_keylist_t *k) {
+  cache_append(s, &k->nkeys, sizeof(uint32_t));
+  for(uint32_t i = 0; i < k->nkeys; i++)
+    cache_append_string(s, k->keys[i]);
+}
+
+char *audioDB::cache_path(const char *name) {
+  char *path = new char[strlen(dbName) + strlen(name) + 16];
+  sprintf(path, "%s.cache%s%s", dbName, *name ? "/" : "", name);
+  return path;
+}
+
+void audioDB::cache_key(const adb_query_spec_t *qspec, std::string &key) {
+  const adb_datum_t *datum = qspec->qid.datum;
+  adb_status_t status;
+  if(audiodb_status(adb, &status))
+    error("Failed to retrieve database status", dbName);
+
+  uint32_t magic = O2_CACHE_MAGIC;
+  cache_append(key, &magic, sizeof(uint32_t));
+
+  // database generation
+  cache_append(key, &status.numFiles, sizeof(status.numFiles));
+  cache_append(key, &status.length, sizeof(status.length));
+  cache_append(key, &status.flags, sizeof(status.flags));
+  struct stat st;
+  memset(&st, 0, sizeof(struct stat));
+  char *indexName = audiodb_index_get_name(dbName, radius, sequenceLength);
+  if(indexName) {
+    if(stat(indexName, &st))
+      memset(&st, 0, sizeof(struct stat));
+    delete[] indexName;
+  }
+  cache_append(key, &st.st_mtime, sizeof(st.st_mtime));
+  cache_append(key, &st.st_size, sizeof(st.st_size));
+
+  // query datum
+  cache_append_string(key, datum->key);
+  cache_append(key, &datum->nvectors, sizeof(uint32_t));
+  cache_append(key, &datum->dim, sizeof(uint32_t));
+  uint8_t present = (datum->data ? 1 : 0) | (datum->power ? 2 : 0) | (datum->times ? 4 : 0);
+  cache_append(key, &present, sizeof(uint8_t));
+  if(datum->data)
+    cache_append(key, datum->data, (size_t) datum->nvectors * datum->dim * sizeof(double));
+  if(datum->power)
+    cache_append(key, datum->power, datum->nvectors * sizeof(double));
+  if(datum->times)
+    cache_append(key, datum->times, 2 * datum->nvectors * sizeof(double));
+
+  // query spec
+  cache_append(key, &qspec->qid.sequence_length, sizeof(uint32_t));
+  cache_append(key, &qspec->qid.flags, sizeof(uint32_t));
+  cache_append(key, &qspec->qid.sequence_start, sizeof(uint32_t));
+  cache_append(key, &qspec->params, sizeof(adb_query_parameters_t));
+  const adb_query_refine_t *refine = &qspec->refine;
+  cache_append(key, &refine->flags, sizeof(uint32_t));
+  if(refine->flags & ADB_REFINE_INCLUDE_KEYLIST)
+    cache_append_keylist(key, &refine->include);
+  if(refine->flags & ADB_REFINE_EXCLUDE_KEYLIST)
+    cache_append_keylist(key, &refine->exclude);
+  if(refine->flags & ADB_REFINE_RADIUS)
+    cache_append(key, &refine->radius, sizeof(double));
+  if(refine->flags & ADB_REFINE_ABSOLUTE_THRESHOLD)
+    cache_append(key, &refine->absolute_threshold, sizeof(double));
+  if(refine->flags & ADB_REFINE_RELATIVE_THRESHOLD)
+    cache_append(key, &refine->relative_threshold, sizeof(double));
+  if(refine->flags & ADB_REFINE_DURATION_RATIO)
+    cache_append(key, &refine->duration_ratio, sizeof(double));
+  if(refine->flags & ADB_REFINE_HOP_SIZE) {
+    cache_append(key, &refine->qhopsize, sizeof(uint32_t));
+    cache_append(key, &refine->ihopsize, sizeof(uint32_t));
+  }
+}
+
+// Create the cache directory if necessary, and empty it if the
+// database has changed since it was last used
+void audioDB::cache_open() {
+  char *dir = cache_path("");
+  if(mkdir(dir, 0777) && errno != EEXIST) {
+    VERB_LOG(1, "failed to create query cache directory %s: %s\n", dir, strerror(errno));
+    delete[] dir;
+    return;
+  }
+
+  adb_status_t status;
+  if(audiodb_status(adb, &status))
+    error("Failed to retrieve database status", dbName);
+  char generation[128];
+  snprintf(generation, sizeof(generation), "%u %jd %u\n", status.numFiles, (intmax_t) status.length, status.flags);
+
+  char *generationName = cache_path("generation");
+  char old[128] = "";
+  FILE *f = fopen(generationName, "r");
+  if(f) {
+    if(!fgets(old, sizeof(old), f))
+      old[0] = 0;
+    fclose(f);
+  }
+  if(strcmp(old, generation)) {
+    DIR *d = opendir(dir);
+    if(d) {
+      struct dirent *e;
+      while((e = readdir(d))) {
+        if(cache_is_entry(e->d_name)) {
+          char *entry = cache_path(e->d_name);
+          unlink(entry);
+          delete[] entry;
+        }
+      }
+      closedir(d);
+    }
+    if((f = fopen(generationName, "w"))) {
+      fputs(generation, f);
+      fclose(f);
+    }
+  }
+  delete[] generationName;
+  delete[] dir;
+}
+
+bool audioDB::cache_lookup(const std::string &key, std::vector<CachedResult> &results) {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx%s", (unsigned long long) cache_hash(key), O2_CACHE_SUFFIX);
+  char *entryName = cache_path(name);
+  FILE *f = fopen(entryName, "rb");
+  if(!f) {
+    delete[] entryName;
+    return false;
+  }
+
+  bool hit = false;
+  uint32_t keylen, nresults;
+  if(fread(&keylen, sizeof(uint32_t), 1, f) == 1 && keylen == key.size()) {
+    std::string stored(keylen, '\0');
+    if(fread(&stored[0], 1, keylen, f) == keylen && stored == key &&
+       fread(&nresults, sizeof(uint32_t), 1, f) == 1) {
+      results.clear();
+      results.reserve(nresults);
+      uint32_t k;
+      for(k = 0; k < nresults; k++) {
+        CachedResult r;
+        uint32_t n;
+        if(fread(&n, sizeof(uint32_t), 1, f) != 1 || n >= MAXSTR)
+          break;
+        r.ikey.resize(n);
+        if((n && fread(&r.ikey[0], 1, n, f) != n) ||
+           fread(&r.qpos, sizeof(uint32_t), 1, f) != 1 ||
+           fread(&r.ipos, sizeof(uint32_t), 1, f) != 1 ||
+           fread(&r.dist, sizeof(double), 1, f) != 1)
+          break;
+        results.push_back(r);
+      }
+      hit = (k == nresults);
+    }
+  }
+  fclose(f);
+  if(hit)
+    utimes(entryName, NULL);
+  delete[] entryName;
+  return hit;
+}
+
+void audioDB::cache_store(const std::string &key, const adb_query_results_t *rs) {
+  // write to a temporary file and rename, so that concurrent
+  // queries never see a partial entry
+  char name[48];
+  snprintf(name, sizeof(name), "%016llx%s", (unsigned long long) cache_hash(key), O2_CACHE_SUFFIX);
+  char *entryName = cache_path(name);
+  snprintf(name + strlen(name), sizeof(name) - strlen(name), ".%d", (int) getpid());
+  char *tmpName = cache_path(name);
+
+  FILE *f = fopen(tmpName, "wb");
+  if(!f) {
+    VERB_LOG(1, "failed to write query cache entry %s\n", tmpName);
+  } else {
+    uint32_t keylen = key.size();
+    uint32_t nresults = rs->nresults;
+    bool ok = fwrite(&keylen, sizeof(uint32_t), 1, f) == 1 &&
+      fwrite(key.data(), 1, keylen, f) == keylen &&
+      fwrite(&nresults, sizeof(uint32_t), 1, f) == 1;
+    for(uint32_t k = 0; ok && k < nresults; k++) {
+      const adb_result_t &r = rs->results[k];
+      uint32_t n = strlen(r.ikey);
+      ok = fwrite(&n, sizeof(uint32_t), 1, f) == 1 &&
+        fwrite(r.ikey, 1, n, f) == n &&
+        fwrite(&r.qpos, sizeof(uint32_t), 1, f) == 1 &&
+        fwrite(&r.ipos, sizeof(uint32_t), 1, f) == 1 &&
+        fwrite(&r.dist, sizeof(double), 1, f) == 1;
+    }
+    if(fclose(f) || !ok || rename(tmpName, entryName)) {
+      unlink(tmpName);
+      VERB_LOG(1, "failed to write query cache entry %s\n", entryName);
+    } else {
+      cache_evict();
+    }
+  }
+  delete[] entryName;
+  delete[] tmpName;
+}
+
+// Remove the least recently used entries beyond O2_CACHE_MAX_ENTRIES
+// or O2_CACHE_MAX_BYTES
+void audioDB::cache_evict() {
+  char *dir = cache_path("");
+  DIR *d = opendir(dir);
+  delete[] dir;
+  if(!d)
+    return;
+  std::vector<CacheEntry> entries;
+  struct dirent *e;
+  while((e = readdir(d))) {
+    if(!cache_is_entry(e->d_name))
+      continue;
+    char *entry = cache_path(e->d_name);
+    struct stat st;
+    if(stat(entry, &st) == 0) {
+      CacheEntry c = {st.st_mtime, st.st_size, e->d_name};
+      entries.push_back(c);
+    }
+    delete[] entry;
+  }
+  closedir(d);
+
+  std::sort(entries.begin(), entries.end(), cache_entry_newer);
+  off_t bytes = 0;
+  for(size_t k = 0; k < entries.size(); k++) {
+    bytes += entries[k].size;
+    if(k < O2_CACHE_MAX_ENTRIES && bytes <= (off_t) O2_CACHE_MAX_BYTES)
+      continue;
+    char *entry = cache_path(entries[k].name.c_str());
+    if(unlink(entry) == 0)
+      VERB_LOG(2, "evicted query cache entry %s\n", entry);
+    delete[] entry;
+  }
+}
+
+// Add this process's hits and misses to the totals in
+// dbName.cache/stats, and report them
+void audioDB::cache_report() {
+  unsigned long long hits = 0, misses = 0;
+  char *statsName = cache_path("stats");
+  int fd = open(statsName, O_RDWR | O_CREAT, 0666);
+  if(fd < 0) {
+    VERB_LOG(1, "failed to open query cache statistics %s\n", statsName);
+    delete[] statsName;
+    return;
+  }
+  flock(fd, LOCK_EX);
+  char buf[128];
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  if(n > 0) {
+    buf[n] = 0;
+    if(sscanf(buf, "hits %llu misses %llu", &hits, &misses) != 2)
+      hits = misses = 0;
+  }
+  hits += cacheHits;
+  misses += cacheMisses;
+  n = snprintf(buf, sizeof(buf), "hits %llu misses %llu\n", hits, misses);
+  if(ftruncate(fd, 0) || pwrite(fd, buf, n, 0) != n)
+    VERB_LOG(1, "failed to update query cache statistics %s\n", statsName);
+  flock(fd, LOCK_UN);
+  close(fd);
+  delete[] statsName;
+
+  VERB_LOG(1, "query cache: %u hits, %u misses (total %llu hits, %llu misses)\n",
+           cacheHits, cacheMisses, hits, misses);
+}
@@ -1,5 +1,16 @@
 #include "audioDB.h"
 
+#include <ctype.h>
+#include <pthread.h>
+#if __cplusplus >= 201703L
+#include <charconv>
+#endif
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+#define O2_HAVE_FROM_CHARS 1
+#else
+#define O2_HAVE_FROM_CHARS 0
+#endif
+
 #if defined(O2_DEBUG)
 void sigterm_action(int signal, siginfo_t *info, void *context) {
   exit(128+signal);
@@ -18,7 +29,10 @@ void audioDB::error(const char* a, const char* b, const char *sysFunc) {
   exit(1);
 }
 
-void audioDB::initDBHeader(const char* dbName) {
+// Open the database and work out the extents of its tables, mapping
+// those in the mask tables (O2_TABLE_*); others are mapped when first
+// needed, through map_tables()
+void audioDB::initDBHeader(const char* dbName, unsigned tables) {
   if(!adb) {
     adb = audiodb_open(dbName, forWrite ? O_RDWR : O_RDONLY);
     if(!adb) {
@@ -50,19 +64,88 @@ void audioDB::initDBHeader(const char* dbName) {
 	l2normTableLength = ALIGN_PAGE_UP(dbH->length / dbH->dim);
       }
     }
-    CHECKED_MMAP(char *, fileTable, dbH->fileTableOffset, fileTableLength);
-    CHECKED_MMAP(unsigned *, trackTable, dbH->trackTableOffset, trackTableLength);
-    if( dbH->flags & O2_FLAG_LARGE_ADB ){
-      CHECKED_MMAP(char *, featureFileNameTable, dbH->dataOffset, fileTableLength);
-      if( dbH->flags & O2_FLAG_TIMES )
-	CHECKED_MMAP(char *, timesFileNameTable, dbH->timesTableOffset, fileTableLength);
-      if( dbH->flags & O2_FLAG_POWER )
-	CHECKED_MMAP(char *, powerFileNameTable, dbH->powerTableOffset, fileTableLength);
+    map_tables(tables);
+    // scans read the data table through dbfid
+    if(!(dbH->flags & O2_FLAG_LARGE_ADB) && tableAdvice != MADV_NORMAL) {
+      posix_fadvise(dbfid, dbH->dataOffset, dbH->length,
+                    tableAdvice == MADV_RANDOM ? POSIX_FADV_RANDOM : POSIX_FADV_SEQUENTIAL);
+    }
+  }
+}
+
+// Searches made by the library read the database through its own
+// descriptor rather than through our mappings: advise the kernel of
+// --access and --preload for the whole file there.  Huge pages apply
+// only to mappings, so --hugepages has no effect on such searches.
+void audioDB::advise_library(adb_t *a) {
+  if(tableAdvice != MADV_NORMAL)
+    posix_fadvise(a->fd, 0, 0, tableAdvice == MADV_RANDOM ? POSIX_FADV_RANDOM : POSIX_FADV_SEQUENTIAL);
+  if(preloadTables)
+    posix_fadvise(a->fd, 0, 0, POSIX_FADV_WILLNEED);
+  if(hugeTables && !hugeWarned) {
+    hugeWarned = true;
+    fprintf(stderr, "warning: --hugepages has no effect on searches made by the library\n");
+  }
+}
+
+// Map one table, with the advice given by --access, --preload and
+// --hugepages
+void *audioDB::map_table(const char *name, off_t start, size_t length) {
+  int flags = MAP_SHARED;
+#if defined(MAP_POPULATE)
+  if(preloadTables) {
+    flags |= MAP_POPULATE;
+  }
+#endif
+  void *tmp = mmap(0, length, (PROT_READ | (forWrite ? PROT_WRITE : 0)), flags, dbfid, start);
+  if(tmp == (void *) -1) {
+    error("mmap error for db table", name, "mmap");
+  }
+  if(tableAdvice != MADV_NORMAL) {
+    madvise(tmp, length, tableAdvice);
+  }
+  if(preloadTables) {
+    madvise(tmp, length, MADV_WILLNEED);
+  }
+#if defined(MADV_HUGEPAGE)
+  if(hugeTables) {
+    madvise(tmp, length, MADV_HUGEPAGE);
+  }
+#endif
+  return tmp;
+}
+
+// Map the tables in the mask tables that are not mapped already
+void audioDB::map_tables(unsigned tables) {
+  if(!dbH || !(forWrite || (dbH->length > 0))) {
+    return;
+  }
+  if((tables & O2_TABLE_FILE) && !fileTable) {
+    fileTable = (char *) map_table("fileTable", dbH->fileTableOffset, fileTableLength);
+  }
+  if((tables & O2_TABLE_TRACK) && !trackTable) {
+    trackTable = (unsigned *) map_table("trackTable", dbH->trackTableOffset, trackTableLength);
+  }
+  if( dbH->flags & O2_FLAG_LARGE_ADB ){
+    if((tables & O2_TABLE_FEATURES) && !featureFileNameTable) {
+      featureFileNameTable = (char *) map_table("featureFileNameTable", dbH->dataOffset, fileTableLength);
+    }
+    if((tables & O2_TABLE_TIMES) && (dbH->flags & O2_FLAG_TIMES) && !timesFileNameTable) {
+      timesFileNameTable = (char *) map_table("timesFileNameTable", dbH->timesTableOffset, fileTableLength);
     }
-    else{
-      CHECKED_MMAP(double *, timesTable, dbH->timesTableOffset, timesTableLength);
-      CHECKED_MMAP(double *, powerTable, dbH->powerTableOffset, powerTableLength);
-      CHECKED_MMAP(double *, l2normTable, dbH->l2normTableOffset, l2normTableLength);
+    if((tables & O2_TABLE_POWER) && (dbH->flags & O2_FLAG_POWER) && !powerFileNameTable) {
+      powerFileNameTable = (char *) map_table("powerFileNameTable", dbH->powerTableOffset, fileTableLength);
+    }
+  }
+  else{
+    if((tables & O2_TABLE_TIMES) && !timesTable) {
+      timesTable = (double *) map_table("timesTable", dbH->timesTableOffset, timesTableLength);
+    }
+    if((tables & O2_TABLE_POWER) && !powerTable) {
+      powerTable = (double *) map_table("powerTable", dbH->powerTableOffset, powerTableLength);
+    }
+    if((tables & O2_TABLE_L2NORM) && !l2normTable) {
+      l2normTable = (double *) map_table("l2normTable", dbH->l2normTableOffset, l2normTableLength);
     }
   }
 }
@@ -126,38 +209,192 @@ void audioDB::prefix_name(char** const name, const char* prefix){
   *name = prefixedName; // side effect new name to old name
 }
 
-void audioDB::insertTimeStamps(unsigned numVectors, std::ifstream *timesFile, double *timesdata) {
+// Read numVectors+1 time points from a times file into timesdata, as
+// the start and end of each of numVectors vectors.  The file is either
+// text, whitespace-separated numbers, or binary: the magic number
+// O2_TIMES_MAGIC, a 32-bit count and that many doubles.  The file is
+// mapped and parsed in place, without locale or stream overheads.
+void audioDB::insertTimeStamps(unsigned numVectors, const char *fileName, double *timesdata) {
   assert(usingTimes);
 
-  unsigned numtimes = 0;
+  int fd = open(fileName, O_RDONLY);
+  if(fd < 0) {
+    error("problem opening times file on timestamped database", fileName);
+  }
+  struct stat st;
+  if(fstat(fd, &st)) {
+    error("fstat error finding size of times file", fileName, "fstat");
+  }
+  if(st.st_size == 0) {
+    error("no entries in times file", fileName);
+  }
+  void *m = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(m == MAP_FAILED) {
+    error("mmap error for times file", fileName, "mmap");
+  }
+  madvise(m, st.st_size, MADV_SEQUENTIAL);
 
-  if(!timesFile->is_open()) {
-    error("problem opening times file on timestamped database", timesFileName);
+  size_t numtimes = 0;
+  const char *p = (const char *) m;
+  const char *end = p + st.st_size;
+  if(st.st_size >= (off_t) (2 * sizeof(uint32_t)) && *(uint32_t *) p == O2_TIMES_MAGIC) {
+    numtimes = ((uint32_t *) p)[1];
+    const double *t = (const double *) (p + 2 * sizeof(uint32_t));
+    if((size_t) (st.st_size - 2 * sizeof(uint32_t)) != numtimes * sizeof(double)) {
+      munmap(m, st.st_size);
+      error("malformed binary times file", fileName);
+    }
+    for(size_t i = 0; i < numVectors && i + 1 < numtimes; i++) {
+      timesdata[2 * i] = t[i];
+      timesdata[2 * i + 1] = t[i + 1];
+    }
+  } else {
+#if !O2_HAVE_FROM_CHARS
+    std::vector<char> copy;
+#endif
+    double timepoint = 0;
+    for(;;) {
+      while(p < end && isspace((unsigned char) *p)) {
+        p++;
+      }
+      if(p == end) {
+        break;
+      }
+      double next;
+      // istream extraction accepts a leading plus sign; from_chars
+      // and strtod do not agree on it, so take it here
+      const char *q = (*p == '+') ? p + 1 : p;
+#if O2_HAVE_FROM_CHARS
+      std::from_chars_result r = std::from_chars(q, end, next);
+      if(r.ec != std::errc() || (r.ptr < end && !isspace((unsigned char) *r.ptr))) {
+        munmap(m, st.st_size);
+        error("malformed times file", fileName);
+      }
+      p = r.ptr;
+#else
+      // strtod needs a terminated string: parse a copy of the token
+      const char *e = q;
+      while(e < end && !isspace((unsigned char) *e)) {
+        e++;
+      }
+      copy.assign(q, e);
+      copy.push_back('\0');
+      char *stop;
+      next = strtod(&copy[0], &stop);
+      if(stop != &copy[0] + (e - q) || e == q) {
+        munmap(m, st.st_size);
+        error("malformed times file", fileName);
+      }
+      p = e;
+#endif
+      if(numtimes > numVectors) {
+        munmap(m, st.st_size);
+        error("too many timepoints in times file", fileName);
+      }
+      if(numtimes) {
+        timesdata[0] = timepoint;
+        timesdata[1] = next;
+        timesdata += 2;
+      }
+      timepoint = next;
+      numtimes++;
+    }
   }
+  munmap(m, st.st_size);
 
-  double timepoint, next;
-  *timesFile >> timepoint;
-  if (timesFile->eof()) {
-    error("no entries in times file", timesFileName);
+  if(numtimes == 0) {
+    error("no entries in times file", fileName);
+  }
+  if(numtimes < (size_t) numVectors + 1) {
+    error("too few timepoints in times file", fileName);
   }
-  numtimes++;
-  do {
-    *timesFile >> next;
-    if (timesFile->eof()) {
-      break;
+  if(numtimes > (size_t) numVectors + 1) {
+    error("too many timepoints in times file", fileName);
+  }
+}
+
+static pthread_mutex_t track_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Read the feature vectors of a track, or count of them from first,
+// into *fvpp, growing the buffer (of *nfvp bytes) as necessary.
+// vectorOffset is the position of the track's first vector in the
+// data table; LARGE_ADB tracks are read from their feature files
+// instead, one thread at a time, since the file cache is shared.
+void audioDB::read_track_data(Uns32T trackID, off_t vectorOffset, double** fvpp, size_t* nfvp, Uns32T first, Uns32T count) {
+  if(first > trackTable[trackID])
+    first = trackTable[trackID];
+  if(count > trackTable[trackID] - first)
+    count = trackTable[trackID] - first;
+  size_t nbytes = (size_t) count * dbH->dim * sizeof(double);
+  if(nbytes > *nfvp) {
+    free(*fvpp);
+    if(!(*fvpp = (double *) malloc(nbytes)))
+      error("failed to allocate track buffer", "", "malloc");
+    *nfvp = nbytes;
+  }
+  if(!nbytes)
+    return;
+
+  size_t skip = (size_t) first * dbH->dim;
+  ssize_t got;
+  if(dbH->flags & O2_FLAG_LARGE_ADB) {
+    pthread_mutex_lock(&track_files_lock);
+    const double *packed = pack_track(trackID, 0);
+    if(packed) {
+      memcpy(*fvpp, packed + skip, nbytes);
+      got = nbytes;
+    } else {
+      map_tables(O2_TABLE_FEATURES);
+      got = pread(track_file(trackID, featureFileNameTable), *fvpp, nbytes, sizeof(uint32_t) + skip * sizeof(double));
     }
-    numtimes++;
-    timesdata[0] = timepoint;
-    timepoint = (timesdata[1] = next);
-    timesdata += 2;
-  } while (numtimes < numVectors + 1);
+    pthread_mutex_unlock(&track_files_lock);
+  } else {
+    got = pread(dbfid, *fvpp, nbytes, dbH->dataOffset + (vectorOffset * dbH->dim + skip) * sizeof(double));
+  }
+  if(got < 0)
+    error("read error for track data", "", "pread");
+  if((size_t) got != nbytes)
+    error("short read of track data", audiodb_index_key(adb, trackID));
+}
 
-  if (numtimes < numVectors + 1) {
-    error("too few timepoints in times file", timesFileName);
+// Read the power values of a LARGE_ADB track, from the pack or its
+// power file, under the same lock as read_track_data()
+void audioDB::read_track_power(Uns32T trackID, double *power) {
+  pthread_mutex_lock(&track_files_lock);
+  const double *packed = pack_track(trackID, 1);
+  if(packed) {
+    memcpy(power, packed, trackTable[trackID] * sizeof(double));
+  } else {
+    int fd = track_file(trackID, powerFileNameTable);
+    if(lseek(fd, 0, SEEK_SET) < 0)
+      error("failed to rewind power file", "", "lseek");
+    insertPowerData(trackTable[trackID], fd, power);
   }
+  pthread_mutex_unlock(&track_files_lock);
+}
 
-  *timesFile >> next;
-  if (!timesFile->eof()) {
-    error("too many timepoints in times file", timesFileName);
+// Which tracks a query should visit, from its include and exclude
+// keylists
+void audioDB::init_track_mask(const adb_query_spec_t *qspec, bool *include) {
+  bool restricted = qspec->refine.flags & ADB_REFINE_INCLUDE_KEYLIST;
+  for(Uns32T i = 0; i < dbH->numFiles; i++)
+    include[i] = !restricted;
+  if(restricted && keylistBitmap) {
+    for(Uns32T i = 0; i < dbH->numFiles; i++)
+      include[i] = keylistBitmap[i >> 5] & (1U << (i & 31));
+  } else if(restricted) {
+    for(Uns32T k = 0; k < qspec->refine.include.nkeys; k++) {
+      Uns32T index = key_index(qspec->refine.include.keys[k]);
+      if(index != O2_ERR_KEYNOTFOUND)
+        include[index] = true;
+    }
+  }
+  if(qspec->refine.flags & ADB_REFINE_EXCLUDE_KEYLIST) {
+    for(Uns32T k = 0; k < qspec->refine.exclude.nkeys; k++) {
+      Uns32T index = key_index(qspec->refine.exclude.keys[k]);
+      if(index != O2_ERR_KEYNOTFOUND)
+        include[index] = false;
+    }
   }
 }
@@ -0,0 +1,100 @@
+// Deadlines
+//
+// --timeout-ms bounds the time a query may take, counted from the
+// start of the command.  The search checks the deadline between units
+// of work and, once it has passed, stops: the reporter reports the
+// best results found so far, and a line on stderr marks them as
+// partial, with the fraction of the database that was searched.
+//
+// Exhaustive library queries are run in O2_DEADLINE_ROUNDS rounds,
+// each restricted (by include keylist) to a subset of the tracks, so
+// that they can be stopped between rounds; the FFT and warped sequence
+// searches stop between tasks or tracks, and --rotate between
+// rotations.  Indexed (LSH) queries, which visit only the candidates
+// the index gives, are run whole, except those evaluated exactly in
+// batches (lshexact.cpp), which stop between tracks.  Tracks are
+// visited interleaved, round r taking every O2_DEADLINE_ROUNDS'th
+// track from the r'th, so that however early the deadline falls the
+// tracks searched are spread across the database rather than being
+// its first few.
+
+#include "audioDB.h"
+
+static double deadline_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void audioDB::deadline_set(unsigned ms) {
+  deadline = deadline_now() + ms / 1000.0;
+}
+
+bool audioDB::deadline_passed() {
+  return deadline > 0 && deadline_now() >= deadline;
+}
+
+// The order in which to visit n tracks (or tasks): as they come, or
+// with a deadline interleaved
+void audioDB::deadline_order(size_t n, std::vector<size_t> &order) {
+  order.clear();
+  unsigned rounds = deadline > 0 ? O2_DEADLINE_ROUNDS : 1;
+  for(unsigned r = 0; r < rounds; r++)
+    for(size_t k = r; k < n; k += rounds)
+      order.push_back(k);
+}
+
+// An exhaustive library query, in rounds over interleaved subsets of
+// the tracks it would visit, until the deadline
+void audioDB::deadline_query(adb_query_spec_t *qspec) {
+  forWrite = false;
+  initDBHeader(dbName, O2_TABLE_TRACK);
+  bool *include = new bool[dbH->numFiles];
+  init_track_mask(qspec, include);
+  std::vector<Uns32T> tracks;
+  for(Uns32T k = 0; k < dbH->numFiles; k++) {
+    if(include[k]) {
+      tracks.push_back(k);
+      searchableVectors += trackTable[k];
+    }
+  }
+  delete[] include;
+
+  advise_library(adb);
+  adb_query_spec_t spec = *qspec;
+  spec.refine.flags |= ADB_REFINE_INCLUDE_KEYLIST;
+  spec.refine.flags &= ~ADB_REFINE_EXCLUDE_KEYLIST;
+  std::vector<const char *> keys;
+  for(unsigned r = 0; r < O2_DEADLINE_ROUNDS && r < tracks.size(); r++) {
+    if(deadline_passed())
+      break;
+    keys.clear();
+    uint64_t n = 0;
+    for(size_t k = r; k < tracks.size(); k += O2_DEADLINE_ROUNDS) {
+      keys.push_back(audiodb_index_key(adb, tracks[k]));
+      n += trackTable[tracks[k]];
+    }
+    spec.refine.include.nkeys = keys.size();
+    spec.refine.include.keys = &keys[0];
+    adb_query_results_t *rs = audiodb_query_spec(adb, &spec);
+    if(rs == NULL)
+      error("audiodb_query_spec failed");
+    stats_count("rounds");
+    stats_count("results", rs->nresults);
+    for(unsigned int k = 0; k < rs->nresults; k++) {
+      adb_result_t res = rs->results[k];
+      reporter->add_point(key_index(res.ikey), res.qpos, res.ipos, res.dist);
+    }
+    audiodb_query_free_results(adb, &spec, rs);
+    searchedVectors += n;
+  }
+}
+
+// Mark the results as partial, if the deadline stopped the search
+void audioDB::deadline_report() {
+  if(!deadline || searchedVectors >= searchableVectors)
+    return;
+  double fraction = (double) searchedVectors / searchableVectors;
+  stats_count("deadline_coverage_percent", (unsigned long long) (100 * fraction));
+  fprintf(stderr, "partial results: deadline passed with %.4f of the database searched\n", fraction);
+}
@@ -0,0 +1,109 @@
+// Feature file cache
+//
+// A LARGE_ADB database records the names of its tracks' feature,
+// power and times files rather than their contents, so indexing and
+// querying it open every track's files in turn.  Open files are kept
+// in a small cache, least recently used first out, each opened and
+// checked once however often its track is read; their paths are
+// resolved against --adb_feature_root once, on opening.  Tracks are
+// visited in order, so on each visit the files of the next few tracks
+// are opened too, and the kernel advised to read them ahead, so that
+// their data is arriving while the current track is processed.
+
+#include "audioDB.h"
+
+#define O2_FILE_CACHE_SIZE (64)
+#define O2_FILE_READAHEAD (4)
+
+// The path of the file named for track trackID in table, one of the
+// LARGE_ADB file name tables
+void audioDB::track_file_path(Uns32T trackID, const char *table, char *path) {
+  const char *name = table + trackID * O2_FILETABLE_ENTRY_SIZE;
+  size_t n = strnlen(name, O2_FILETABLE_ENTRY_SIZE);
+  if(adb_feature_root && *name != '/') {
+    if(strlen(adb_feature_root) + n + 2 > O2_MAXFILESTR)
+      error("error: path prefix + filename too long", adb_feature_root);
+    snprintf(path, O2_MAXFILESTR, "%s/%.*s", adb_feature_root, (int) n, name);
+  } else {
+    snprintf(path, O2_MAXFILESTR, "%.*s", (int) n, name);
+  }
+}
+
+// Open track trackID's file from table, checking its dimension and
+// length; dim is the expected dimension (1 for power files).  Feature
+// files must hold at least the track's vectors, power files exactly
+// one value per vector.  Files opened ahead (quiet) are not reported,
+// but left to fail when their track is reached.
+int audioDB::track_file_open(Uns32T trackID, const char *table, unsigned dim, bool quiet) {
+  char path[O2_MAXFILESTR];
+  track_file_path(trackID, table, path);
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  uint32_t test = 0;
+  bool power = table == powerFileNameTable;
+  off_t n = 0;
+  if(fd >= 0 && (fstat(fd, &st) < 0 || pread(fd, &test, sizeof(test), 0) != (ssize_t) sizeof(test) || test != dim ||
+                 (n = (st.st_size - sizeof(uint32_t)) / (dim * sizeof(double))) < trackTable[trackID] ||
+                 (power && n != trackTable[trackID]))) {
+    close(fd);
+    if(quiet)
+      return -1;
+    if(test != dim) {
+      std::cerr << "error: expected dimension: " << dim << ", got : " << test << std::endl;
+      error("track file dimensions do not match database table dimensions", path);
+    }
+    if(power)
+      error("Dimension mismatch: numPowers != numVectors", path);
+    error("track file shorter than its track", path);
+  }
+  if(fd < 0) {
+    if(quiet)
+      return -1;
+    error("failed to open track file", path, "open");
+  }
+  stats_count("track files opened");
+  return fd;
+}
+
+// A descriptor for track trackID's file from table (featureFileNameTable
+// or powerFileNameTable), opened if it is not in the cache
+int audioDB::track_file(Uns32T trackID, const char *table) {
+  int fd = track_file_cached(trackID, table, false);
+  // read ahead the tracks that follow
+  for(Uns32T k = trackID + 1; k <= trackID + O2_FILE_READAHEAD && k < dbH->numFiles; k++)
+    track_file_cached(k, table, true);
+  return fd;
+}
+
+int audioDB::track_file_cached(Uns32T trackID, const char *table, bool quiet) {
+  TrackFile *victim = 0;
+  for(unsigned k = 0; k < trackFiles.size(); k++) {
+    TrackFile &f = trackFiles[k];
+    if(f.trackID == trackID && f.table == table) {
+      f.used = ++trackFileClock;
+      return f.fd;
+    }
+    if(!victim || f.used < victim->used)
+      victim = &f;
+  }
+  unsigned dim = (table == powerFileNameTable) ? 1 : dbH->dim;
+  int fd = track_file_open(trackID, table, dim, quiet);
+  if(fd < 0)
+    return fd;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fd, 0, sizeof(uint32_t) + (off_t) trackTable[trackID] * dim * sizeof(double), POSIX_FADV_WILLNEED);
+  TrackFile f = {table, trackID, fd, ++trackFileClock};
+  if(trackFiles.size() < O2_FILE_CACHE_SIZE) {
+    trackFiles.push_back(f);
+  } else {
+    close(victim->fd);
+    *victim = f;
+  }
+  return fd;
+}
+
+void audioDB::track_files_close() {
+  for(unsigned k = 0; k < trackFiles.size(); k++)
+    close(trackFiles[k].fd);
+  trackFiles.clear();
+}
@@ -10,9 +10,28 @@
 //   Date: 23 June 2008
 //
 // 19th August 2008 - added O2_FLAG_LARGE_ADB support
+//
+// With --threads, the tracks' shingles are built and normed in
+// parallel, and only their insertion into the tables is serial.
+//
+// A rotation-invariant index (rotation.cpp) is named with a further
+// .rot, and a compressed index (zindex.cpp) with a final .z.
 
 #include "audioDB.h"
 
+// The name of the index for this radius and sequence length, either
+// rotation-invariant or not
+char *audioDB::index_get_name() {
+  char *name = audiodb_index_get_name(dbName, radius, sequenceLength);
+  if(!name || !lsh_rotation_invariant)
+    return name;
+  char *variant = new char[strlen(name) + 5];
+  strcpy(variant, name);
+  strcat(variant, ".rot");
+  delete[] name;
+  return variant;
+}
+
 /*******  LSH indexing audioDB database access forall s \in {S} *******/
 
 // Prepare the AudioDB database for read access and allocate auxillary memory
@@ -55,12 +74,13 @@ void audioDB::index_initialize(double **snp, double **vsnp, double **spp, double
 /************************ LSH indexing ***********************************/
 void audioDB::index_index_db(const char* dbName){
   char* newIndexName;
-  double *fvp = 0, *sNorm = 0, *snPtr = 0, *sPower = 0, *spPtr = 0;
+  double *sNorm = 0, *snPtr = 0, *sPower = 0, *spPtr = 0;
   Uns32T dbVectors = 0;
 
 
   printf("INDEX: initializing header\n");
   // Check if audioDB exists, initialize header and open database for read
+  stats_phase("open");
   forWrite = false;
   initDBHeader(dbName);
 
@@ -70,7 +90,10 @@ void audioDB::index_index_db(const char* dbName){
   if(dbH->flags & O2_FLAG_TIMES)
     usingTimes = true;
 
-  newIndexName = audiodb_index_get_name(dbName, radius, sequenceLength);
+  // queries never write the key hash, so bring it up to date here
+  keyhash_init(true);
+
+  newIndexName = index_get_name();
   if(!newIndexName) {
     error("failed to get index name", dbName);
   }
@@ -83,11 +106,23 @@ void audioDB::index_index_db(const char* dbName){
   VERB_LOG(1, "INDEX: seqlen %d\n", sequenceLength);
   VERB_LOG(1, "INDEX: lsh_w %f\n", lsh_param_w);
   VERB_LOG(1, "INDEX: lsh_k %d\n", lsh_param_k);
-  VERB_LOG(1, "INDEX: lsh_m %d\n", lsh_param_m);
+  VERB_LOG(1, "INDEX: lsh_m %d (%d tables)\n", lsh_param_m, lsh_param_m * (lsh_param_m - 1) / 2);
   VERB_LOG(1, "INDEX: lsh_N %d\n", lsh_param_N);
   VERB_LOG(1, "INDEX: lsh_C %d\n", lsh_param_ncols);
   VERB_LOG(1, "INDEX: lsh_b %d\n", lsh_param_b);
   VERB_LOG(1, "INDEX: normalized? %s\n", normalizedDistance?"true":"false"); 
+  VERB_LOG(1, "INDEX: rotation-invariant? %s\n", lsh_rotation_invariant?"true":"false");
+  VERB_LOG(1, "INDEX: compressed? %s\n", lsh_compress?"true":"false");
+
+  if(lsh_compress) {
+    delete[] newIndexName;
+    newIndexName = zindex_get_name();
+    if(!newIndexName)
+      error("failed to get index name", dbName);
+    zindex_build(newIndexName);
+    delete[] newIndexName;
+    return;
+  }
 
   if((lshfid = open(newIndexName,O_RDONLY))<0){
     printf("INDEX: constructing new LSH index\n");  
@@ -109,7 +144,9 @@ void audioDB::index_index_db(const char* dbName){
     if( ! (dbH->flags & O2_FLAG_LARGE_ADB) ){
       index_initialize(&sNorm, &snPtr, &sPower, &spPtr, &dbVectors);  
     }
-    index_insert_tracks(0, endTrack, &fvp, &sNorm, &snPtr, &sPower, &spPtr);
+    stats_phase("insert");
+    index_insert_tracks(0, endTrack, sNorm, sPower);
+    stats_phase("serialize");
     lsh->serialize(newIndexName, lsh_in_core?O2_SERIAL_FILEFORMAT2:O2_SERIAL_FILEFORMAT1);
     
     // Clean up
@@ -126,6 +163,7 @@ void audioDB::index_index_db(const char* dbName){
     char* mergeIndexName = newIndexName;
 
     // Get the lsh header info and find how many tracks are inserted already
+    stats_phase("index_load");
     lsh = new LSH(mergeIndexName, false); // lshInCore=false to avoid loading hashTables here
     assert(lsh);
     Uns32T maxs = audiodb_index_to_track_id(adb, lsh->get_maxp())+1;
@@ -144,20 +182,25 @@ void audioDB::index_index_db(const char* dbName){
 	endTrack = dbH->numFiles;
       printf("Indexing track range: %d - %d\n", startTrack, endTrack);
       fflush(stdout);
+      stats_phase("index_load");
       lsh = new LSH(mergeIndexName, false); // Initialize empty LSH tables
       assert(lsh);
       
       // Insert up to lsh_param_b database tracks
-      index_insert_tracks(startTrack, endTrack, &fvp, &sNorm, &snPtr, &sPower, &spPtr);
+      stats_phase("insert");
+      index_insert_tracks(startTrack, endTrack, sNorm, sPower);
 
       // Serialize to file (merging is performed here)
+      stats_phase("serialize");
       lsh->serialize(mergeIndexName, lsh_in_core?O2_SERIAL_FILEFORMAT2:O2_SERIAL_FILEFORMAT1); // Serialize core LSH heap to disk
       delete lsh;
       lsh = 0;
     }
     
+    stats_phase(NULL);
     close(lshfid);    
     printf("INDEX: done constructing LSH index.\n");  
+    index_report_size(newIndexName);
     fflush(stdout);
     
   }
@@ -172,6 +215,23 @@ void audioDB::index_index_db(const char* dbName){
 }
 
 
+// The size of the index, against that of the features it indexes: the
+// tables are stored by lshlib as raw point identifiers, so on large
+// databases they can outgrow the features
+void audioDB::index_report_size(const char *indexName) {
+  struct stat st;
+  if(stat(indexName, &st))
+    return;
+  uint64_t featureBytes = 0;
+  for(Uns32T k = 0; k < dbH->numFiles; k++)
+    featureBytes += (uint64_t) trackTable[k] * dbH->dim * sizeof(double);
+  printf("INDEX: %s %ju bytes", indexName, (uintmax_t) st.st_size);
+  if(featureBytes)
+    printf(" (%.2f times the feature data)", (double) st.st_size / featureBytes);
+  printf("\n");
+  stats_count("index_bytes", st.st_size);
+}
+
 void audioDB::insertPowerData(unsigned numVectors, int powerfd, double *powerdata) {
   if(usingPower){
     int one;
@@ -194,159 +254,160 @@ void audioDB::insertPowerData(unsigned numVectors, int powerfd, double *powerdat
   }
 }
 
-// initialize auxillary track data from filesystem
-// pre-conditions:
-// dbH->flags & O2_FLAG_LARGE_ADB
-// feature data allocated and copied (fvp)
-//
-// post-conditions:
-// allocated power data
-// allocated l2norm data
-//
-void audioDB::init_track_aux_data(Uns32T trackID, double* fvp, double** sNormpp,double** snPtrp, double** sPowerp, double** spPtrp){  
-  if( !(dbH->flags & O2_FLAG_LARGE_ADB) )
-    error("error: init_track_large_adb required O2_FLAG_LARGE_ADB");
-
-  // Allocate and read the power sequence
-  if(trackTable[trackID]>=sequenceLength){
-    
-    char* prefixedString = new char[O2_MAXFILESTR];
-    char* tmpStr = prefixedString;
-    // Open and check dimensions of power file
-    strncpy(prefixedString, powerFileNameTable+trackID*O2_FILETABLE_ENTRY_SIZE, O2_MAXFILESTR);
-    prefix_name((char ** const)&prefixedString, adb_feature_root);
-    if(prefixedString!=tmpStr)
-      delete[] tmpStr;
-    powerfd = open(prefixedString, O_RDONLY);
-    if (powerfd < 0) {
-      error("failed to open power file", prefixedString);
-    }
-    if (fstat(powerfd, &statbuf) < 0) {
-      error("fstat error finding size of power file", prefixedString, "fstat");
-    }
-    
-    if( (statbuf.st_size - sizeof(int)) / (sizeof(double)) != trackTable[trackID] )
-      error("Dimension mismatch: numPowers != numVectors", prefixedString);
-   
-    *sPowerp = new double[trackTable[trackID]]; // Allocate memory for power values
-    assert(*sPowerp);
-    *spPtrp = *sPowerp;
-    insertPowerData(trackTable[trackID], powerfd, *sPowerp);
-    if (0 < powerfd) {
-      close(powerfd);
-    }
-    
-    audiodb_sequence_sum(*sPowerp, trackTable[trackID], sequenceLength);
-    audiodb_sequence_average(*sPowerp, trackTable[trackID], sequenceLength);
-    powerTable = 0;
-
-    // Allocate and calculate the l2norm sequence
-    *sNormpp = new double[trackTable[trackID]];
-    assert(*sNormpp);
-    *snPtrp = *sNormpp;
-    audiodb_l2norm_buffer(fvp, dbH->dim, trackTable[trackID], *sNormpp);
-    audiodb_sequence_sum(*sNormpp, trackTable[trackID], sequenceLength);
-    audiodb_sequence_sqrt(*sNormpp, trackTable[trackID], sequenceLength);
-  }
+// The state shared by the threads of an index build
+typedef struct {
+  audioDB *db;
+  double *sNorm;
+  double *sPower;
+  std::vector<IndexTrack> *tracks;
+  std::vector<IndexThread> *threads;
+} IndexBuild;
+
+static void index_task(void *arg, unsigned index, const Task *task, unsigned thread) {
+  IndexBuild *b = (IndexBuild *) arg;
+  b->db->index_shingle_track(task, b->sNorm, b->sPower, &(*b->tracks)[index], &(*b->threads)[thread]);
 }
 
-void audioDB::index_insert_tracks(Uns32T start_track, Uns32T end_track,
-				  double** fvpp, double** sNormpp,double** snPtrp, 
-				  double** sPowerp, double** spPtrp){  
-  size_t nfv = 0;
-  double* fvp = 0; // Keep pointer for memory allocation and free() for track data
-  Uns32T trackID = 0;
-
+// Insert the shingles of tracks [start_track, end_track) into lsh.
+// The shingles of as many tracks as fit in O2_INDEX_SHINGLE_MEMORY are
+// built and normed at once, a track to a task, on --threads threads
+// (tasks.cpp), and then inserted one track at a time, in track order,
+// so that the index does not depend on the number of threads.  sNorm
+// and sPower are the sequence norms and powers of every vector, unless
+// the database is LARGE_ADB, whose tracks' are computed as they are
+// read.
+void audioDB::index_insert_tracks(Uns32T start_track, Uns32T end_track, double *sNorm, double *sPower) {
   VERB_LOG(1, "indexing tracks...");
 
-  int trackfd = dbfid;
-  for(trackID = start_track ; trackID < end_track ; trackID++ ){
-    if( dbH->flags & O2_FLAG_LARGE_ADB ){
-      char* prefixedString = new char[O2_MAXFILESTR];
-      char* tmpStr = prefixedString;
-      // Open and check dimensions of feature file
-      strncpy(prefixedString, featureFileNameTable+trackID*O2_FILETABLE_ENTRY_SIZE, O2_MAXFILESTR);
-      prefix_name((char ** const) &prefixedString, adb_feature_root);
-      if(prefixedString!=tmpStr)
-	delete[] tmpStr;
-      initInputFile(prefixedString);
-      trackfd = infid;
-    }
-    if(audiodb_read_data(adb, trackfd, trackID, &fvp, &nfv))
-      error("failed to read data");
-    *fvpp = fvp; // Protect memory allocation and free() for track data
-    
-    if( dbH->flags & O2_FLAG_LARGE_ADB )
-      // Load power and calculate power and l2norm sequence sums
-      init_track_aux_data(trackID, fvp, sNormpp, snPtrp, sPowerp, spPtrp);
-    
-    if(!index_insert_track(trackID, fvpp, snPtrp, spPtrp))
-      break;    
-    if ( dbH->flags & O2_FLAG_LARGE_ADB ){
-      close(infid);
-      delete[] *sNormpp;
-      delete[] *sPowerp;
-      *sNormpp = *sPowerp = *snPtrp = *snPtrp = 0;
+  off_t vectorOffset = 0;
+  for(Uns32T k = 0; k < start_track; k++)
+    vectorOffset += trackTable[k];
+  std::vector<IndexThread> ithreads(threads);
+  for(unsigned k = 0; k < threads; k++) {
+    ithreads[k].fvp = 0;
+    ithreads[k].nfv = 0;
+  }
+
+  Uns32T trackID = start_track;
+  while(trackID < end_track) {
+    // the next tracks whose shingles fit, and at least one
+    Uns32T first = trackID;
+    std::vector<Task> tasks;
+    std::vector<Uns32T> slots;
+    uint64_t bytes = 0;
+    for(; trackID < end_track; trackID++) {
+      Uns32T numVecs = trackTable[trackID] < sequenceLength ? 0 : trackTable[trackID] - sequenceLength + 1;
+      uint64_t trackBytes = (uint64_t) numVecs * sequenceLength * dbH->dim * sizeof(float);
+      if(trackID > first && bytes + trackBytes > O2_INDEX_SHINGLE_MEMORY)
+        break;
+      bytes += trackBytes;
+      slots.push_back(numVecs ? tasks.size() : ~0U);
+      if(numVecs) {
+        Task task = {trackID, vectorOffset, 0, numVecs};
+        tasks.push_back(task);
+      }
+      vectorOffset += trackTable[trackID];
     }
-  } // end for(trackID = start_track ; ... )
+
+    std::vector<IndexTrack> built(tasks.size());
+    IndexBuild b;
+    b.db = this;
+    b.sNorm = sNorm;
+    b.sPower = sPower;
+    b.tracks = &built;
+    b.threads = &ithreads;
+    tasks_run(tasks, index_task, &b);
+
+    for(Uns32T k = first; k < trackID; k++)
+      index_insert_track(k, slots[k - first] == ~0U ? 0 : &built[slots[k - first]]);
+  }
+
+  for(unsigned k = 0; k < threads; k++)
+    free(ithreads[k].fvp);
   std::cout << "finished inserting." << endl;
 }
 
-int audioDB::index_insert_track(Uns32T trackID, double** fvpp, double** snpp, double** sppp){
-  // Loop over the current input track's vectors
-  Uns32T numVecs = 0;
-  
-  if (trackTable[trackID] < sequenceLength - 1) {
-    numVecs = 0;
+// Build and norm the shingles of one track, on one of the threads of
+// an index build
+void audioDB::index_shingle_track(const Task *task, double *sNorm, double *sPower, IndexTrack *t, IndexThread *thread) {
+  Uns32T trackID = task->trackID;
+  Uns32T n = trackTable[trackID];
+  Uns32T d = dbH->dim;
+  Uns32T l = sequenceLength;
+
+  read_track_data(trackID, task->vectorOffset, &thread->fvp, &thread->nfv);
+  double *sn;
+  std::vector<double> norms;
+  if(dbH->flags & O2_FLAG_LARGE_ADB) {
+    // the power and norm sequences, from the track's files
+    t->power.assign(n, 0);
+    if(usingPower)
+      read_track_power(trackID, &t->power[0]);
+    audiodb_sequence_sum(&t->power[0], n, l);
+    audiodb_sequence_average(&t->power[0], n, l);
+    norms.resize(n);
+    audiodb_l2norm_buffer(thread->fvp, d, n, &norms[0]);
+    audiodb_sequence_sum(&norms[0], n, l);
+    audiodb_sequence_sqrt(&norms[0], n, l);
+    sn = &norms[0];
+    t->sp = &t->power[0];
   } else {
-    numVecs = trackTable[trackID] - sequenceLength + 1;
+    sn = sNorm + task->vectorOffset;
+    t->sp = sPower + task->vectorOffset;
   }
 
-  
-  Uns32T numVecsAboveThreshold = 0, collisionCount = 0; 
-  if(numVecs){
-    std::vector<std::vector<float> > *vv = audiodb_index_initialize_shingles(numVecs, dbH->dim, sequenceLength);
-    
-    for( Uns32T pointID = 0 ; pointID < numVecs; pointID++ )
-      audiodb_index_make_shingle(vv, pointID, *fvpp, dbH->dim, sequenceLength);
-    int vcount = audiodb_index_norm_shingles(vv, *snpp, *sppp, dbH->dim, sequenceLength, radius, normalizedDistance, use_absolute_threshold, absolute_threshold);
-    if(vcount == -1) {
-      audiodb_index_delete_shingles(vv);
+  t->vv = audiodb_index_initialize_shingles(task->count, d, l);
+  for(Uns32T pointID = 0; pointID < task->count; pointID++)
+    audiodb_index_make_shingle(t->vv, pointID, thread->fvp, d, l);
+  t->vcount = audiodb_index_norm_shingles(t->vv, sn, t->sp, d, l, radius, normalizedDistance, use_absolute_threshold, absolute_threshold);
+  if(t->vcount != -1 && lsh_rotation_invariant)
+    rotation_project_shingles(t->vv, d);
+}
+
+// Insert one track's shingles, if it has any, into lsh
+void audioDB::index_insert_track(Uns32T trackID, IndexTrack *t) {
+  Uns32T numVecsAboveThreshold = 0, collisionCount = 0;
+  if(t) {
+    if(t->vcount == -1) {
+      audiodb_index_delete_shingles(t->vv);
       error("failed to norm shingles");
     }
-    numVecsAboveThreshold = vcount;
-    collisionCount = index_insert_shingles(vv, trackID, *sppp);
-    audiodb_index_delete_shingles(vv);
+    numVecsAboveThreshold = t->vcount;
+    collisionCount = index_insert_shingles(t->vv, trackID, t->sp);
+    audiodb_index_delete_shingles(t->vv);
+    t->vv = 0;
+    std::vector<double>().swap(t->power);
   }
+  stats_count("tracks");
+  stats_count("collisions", collisionCount);
 
   float meanCollisionCount = numVecsAboveThreshold?(float)collisionCount/numVecsAboveThreshold:0;
 
-  /* audiodb_index_norm_shingles() only goes as far as the end of the
-     sequence, which is right, but the space allocated is for the
-     whole track.  */
-
-  /* But numVecs will be <trackTable[track] if trackTable[track]>O2_MAXTRACKLEN
-   * So let's be certain the pointers are in the correct place
-   */
-
-  if( !(dbH->flags & O2_FLAG_LARGE_ADB) ){
-    *snpp += trackTable[trackID];
-    *sppp += trackTable[trackID];
-    *fvpp += trackTable[trackID] * dbH->dim;
-  }
-
-  std::cout << " n=" << trackTable[trackID] << " n'=" << numVecsAboveThreshold << " E[#c]=" << lsh->get_mean_collision_rate() << " E[#p]=" << meanCollisionCount << endl;
+  std::cout << " n=" << trackTable[trackID] << " n'=" << numVecsAboveThreshold;
+  if(lsh)
+    std::cout << " E[#c]=" << lsh->get_mean_collision_rate() << " E[#p]=" << meanCollisionCount;
+  std::cout << endl;
   std::cout.flush();  
-  return true;
 }
 
 Uns32T audioDB::index_insert_shingles(vector<vector<float> >* vv, Uns32T trackID, double* spp){
   Uns32T collisionCount = 0;
+  unsigned long long shingles = 0, powerRejected = 0;
   cout << "[" << trackID << "]" << fileTable+trackID*O2_FILETABLE_ENTRY_SIZE;
   for( Uns32T pointID=0 ; pointID < (*vv).size(); pointID+=sequenceHop){
-    if(!use_absolute_threshold || (use_absolute_threshold && (*spp >= absolute_threshold)))
-      collisionCount += lsh->insert_point((*vv)[pointID], audiodb_index_from_trackinfo(adb, trackID, pointID));
+    if(!use_absolute_threshold || (use_absolute_threshold && (*spp >= absolute_threshold))) {
+      Uns32T point = audiodb_index_from_trackinfo(adb, trackID, pointID);
+      if(zindex)
+        zindex_insert_point(zindex, (*vv)[pointID], point);
+      else
+        collisionCount += lsh->insert_point((*vv)[pointID], point);
+      shingles++;
+    } else {
+      powerRejected++;
+    }
     spp+=sequenceHop;
     }
+  stats_count("shingles", shingles);
+  stats_count("power_rejected", powerRejected);
   return collisionCount;
 }
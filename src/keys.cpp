@@ -0,0 +1,218 @@
+// Key hash and keylists
+//
+// A persistent open-addressing hash table from track keys to track
+// indices, kept alongside the database in dbName.keys, so that
+// resolving a key costs one hash and (usually) one string comparison.
+// The file holds a header identifying the database state it was built
+// from (number of tracks, data length and a hash of the first and last
+// keys) followed by the slots, each holding a track index plus one (0
+// for an empty slot).  It is written only by the commands that change
+// the database (insertion) or already write alongside it (--INDEX);
+// a query finding it missing or out of date builds the table in memory
+// and leaves the file alone, so queries never write.
+//
+// Keylists given to -K may be text, one key per line, or binary: the
+// magic number O2_KEYLIST_MAGIC, a count, and that many 32-bit track
+// indices.  Either way the restriction is built as a bitmap over the
+// tracks without allocating per key.  The library's query interface
+// takes keys only, so the bitmap is handed on to it as pointers to its
+// own key strings, which it resolves again itself.
+
+#include "audioDB.h"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t numFiles;
+  uint32_t nslots;
+  uint32_t fingerprint;
+  uint64_t length;
+} keyhash_header_t;
+
+static uint32_t keyhash_hash(const char *key) {
+  uint32_t h = 2166136261U;
+  for(; *key; key++) {
+    h ^= (unsigned char) *key;
+    h *= 16777619U;
+  }
+  return h;
+}
+
+uint32_t audioDB::keyhash_fingerprint() {
+  if(!adb->header->numFiles)
+    return 0;
+  return keyhash_hash(audiodb_index_key(adb, 0)) ^
+    (keyhash_hash(audiodb_index_key(adb, adb->header->numFiles - 1)) * 31);
+}
+
+void audioDB::keyhash_insert(Uns32T index) {
+  // keep the load factor at or below one half
+  if(2 * (keyHashCount + 1) > keyHashSlots) {
+    Uns32T *old = keyHash;
+    Uns32T oldSlots = keyHashSlots;
+    keyHashSlots = keyHashSlots ? 2 * keyHashSlots : 1024;
+    keyHash = new Uns32T[keyHashSlots];
+    memset(keyHash, 0, keyHashSlots * sizeof(Uns32T));
+    keyHashCount = 0;
+    for(Uns32T i = 0; i < oldSlots; i++)
+      if(old[i])
+        keyhash_insert(old[i] - 1);
+    delete[] old;
+  }
+  Uns32T mask = keyHashSlots - 1;
+  Uns32T slot = keyhash_hash(audiodb_index_key(adb, index)) & mask;
+  while(keyHash[slot])
+    slot = (slot + 1) & mask;
+  keyHash[slot] = index + 1;
+  keyHashCount++;
+}
+
+void audioDB::keyhash_write() {
+  char *hashName = new char[strlen(dbName) + 16];
+  sprintf(hashName, "%s.keys", dbName);
+  char *tmpName = new char[strlen(hashName) + 16];
+  sprintf(tmpName, "%s.%d", hashName, (int) getpid());
+
+  keyhash_header_t h;
+  h.magic = O2_KEYHASH_MAGIC;
+  h.numFiles = adb->header->numFiles;
+  h.nslots = keyHashSlots;
+  h.fingerprint = keyhash_fingerprint();
+  h.length = adb->header->length;
+
+  int fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  bool ok = fd >= 0 &&
+    write(fd, &h, sizeof(h)) == (ssize_t) sizeof(h) &&
+    write(fd, keyHash, keyHashSlots * sizeof(Uns32T)) == (ssize_t) (keyHashSlots * sizeof(Uns32T));
+  if(fd >= 0)
+    ok = (close(fd) == 0) && ok;
+  if(!ok || rename(tmpName, hashName)) {
+    unlink(tmpName);
+    VERB_LOG(1, "failed to write key hash %s\n", hashName);
+  }
+  delete[] tmpName;
+  delete[] hashName;
+}
+
+// Load dbName.keys, or rebuild the table if it is missing or does not
+// match the database, writing it back only if save is set
+void audioDB::keyhash_init(bool save) {
+  if(keyHash)
+    return;
+
+  char *hashName = new char[strlen(dbName) + 16];
+  sprintf(hashName, "%s.keys", dbName);
+  keyhash_header_t h;
+  int fd = open(hashName, O_RDONLY);
+  delete[] hashName;
+  if(fd >= 0) {
+    if(read(fd, &h, sizeof(h)) == (ssize_t) sizeof(h) &&
+       h.magic == O2_KEYHASH_MAGIC &&
+       h.numFiles == adb->header->numFiles &&
+       h.length == (uint64_t) adb->header->length &&
+       h.fingerprint == keyhash_fingerprint() &&
+       h.nslots && !(h.nslots & (h.nslots - 1))) {
+      keyHash = new Uns32T[h.nslots];
+      if(read(fd, keyHash, h.nslots * sizeof(Uns32T)) == (ssize_t) (h.nslots * sizeof(Uns32T))) {
+        keyHashSlots = h.nslots;
+        keyHashCount = h.numFiles;
+      } else {
+        delete[] keyHash;
+        keyHash = 0;
+      }
+    }
+    close(fd);
+  }
+  if(keyHash)
+    return;
+
+  VERB_LOG(1, "building key hash for %u tracks\n", adb->header->numFiles);
+  keyHashSlots = 1024;
+  while(keyHashSlots < 2 * adb->header->numFiles)
+    keyHashSlots <<= 1;
+  keyHash = new Uns32T[keyHashSlots];
+  memset(keyHash, 0, keyHashSlots * sizeof(Uns32T));
+  keyHashCount = 0;
+  for(Uns32T i = 0; i < adb->header->numFiles; i++)
+    keyhash_insert(i);
+  if(save)
+    keyhash_write();
+}
+
+// Track index of key, or O2_ERR_KEYNOTFOUND
+Uns32T audioDB::key_index(const char *key) {
+  keyhash_init();
+  Uns32T mask = keyHashSlots - 1;
+  for(Uns32T slot = keyhash_hash(key) & mask; keyHash[slot]; slot = (slot + 1) & mask) {
+    if(!strcmp(audiodb_index_key(adb, keyHash[slot] - 1), key))
+      return keyHash[slot] - 1;
+  }
+  return O2_ERR_KEYNOTFOUND;
+}
+
+// Read the -K keylist (text or binary) into keylistBitmap, and point
+// the include keylist at the library's copies of the keys.  For a
+// federated query the bitmap covers the tracks of every shard, and
+// shards_query() builds each shard's keylist.
+void audioDB::keylist_restrict(adb_keylist_t *include) {
+  Uns32T numFiles = shards.empty() ? adb->header->numFiles : shards_numFiles();
+  Uns32T nwords = (numFiles + 31) / 32;
+  keylistBitmap = new Uns32T[nwords ? nwords : 1];
+  memset(keylistBitmap, 0, (nwords ? nwords : 1) * sizeof(Uns32T));
+
+  uint32_t magic = 0;
+  trackFile->read((char *) &magic, sizeof(uint32_t));
+  if(trackFile->gcount() == sizeof(uint32_t) && magic == O2_KEYLIST_MAGIC) {
+    uint32_t count, index;
+    if(!trackFile->read((char *) &count, sizeof(uint32_t)))
+      error("short read of binary keyList", trackFileName);
+    for(uint32_t k = 0; k < count; k++) {
+      if(!trackFile->read((char *) &index, sizeof(uint32_t)))
+        error("short read of binary keyList", trackFileName);
+      if(index >= numFiles)
+        error("track index out of range in binary keyList", trackFileName);
+      keylistBitmap[index >> 5] |= 1U << (index & 31);
+    }
+  } else {
+    trackFile->clear();
+    trackFile->seekg(0);
+    char k[MAXSTR];
+    trackFile->getline(k, MAXSTR);
+    while(!trackFile->eof()) {
+      if(shards.empty()) {
+        Uns32T index = key_index(k);
+        if(index != O2_ERR_KEYNOTFOUND)
+          keylistBitmap[index >> 5] |= 1U << (index & 31);
+      } else {
+        for(unsigned s = 0; s < shards.size(); s++) {
+          uint32_t index = audiodb_key_index(shards[s].adb, k);
+          if(index != (uint32_t) -1) {
+            index += shards[s].base;
+            keylistBitmap[index >> 5] |= 1U << (index & 31);
+          }
+        }
+      }
+      trackFile->getline(k, MAXSTR);
+    }
+  }
+
+  include->nkeys = 0;
+  include->keys = NULL;
+  if(!shards.empty())
+    return;
+  keylist_keys(include);
+}
+
+// Point the include keylist at the library's copies of the keys of
+// the tracks in keylistBitmap (of a single database)
+void audioDB::keylist_keys(adb_keylist_t *include) {
+  Uns32T numFiles = adb->header->numFiles;
+  Uns32T nwords = (numFiles + 31) / 32;
+  include->nkeys = 0;
+  for(Uns32T w = 0; w < nwords; w++)
+    include->nkeys += __builtin_popcount(keylistBitmap[w]);
+  include->keys = new const char *[include->nkeys ? include->nkeys : 1];
+  uint32_t n = 0;
+  for(Uns32T i = 0; i < numFiles; i++)
+    if(keylistBitmap[i >> 5] & (1U << (i & 31)))
+      include->keys[n++] = audiodb_index_key(adb, i);
+}
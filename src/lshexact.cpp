@@ -0,0 +1,299 @@
+// Batched LSH candidate evaluation
+//
+// With --lsh_exact the points an LSH index gives for a sequence radius
+// query are checked against the exact distance.  Evaluated in the
+// order they come out of the hash buckets, they are read from all over
+// the database, one window at a time.  Instead, the candidates of
+// every query position are first gathered from all of the index's
+// tables, the repeats (a point found in several tables) dropped with a
+// bitmap of point identifiers, and the rest sorted by track, position
+// and query position.  Each track's candidates are then evaluated
+// together, from a single read of the span of the track they cover,
+// while the kernel is asked to read the next track's span ahead.
+//
+// Queries with power thresholds or times are left to the library,
+// which applies them to the candidates as it finds them.  Queries of a
+// compressed index (zindex.cpp), and --rotate queries of a
+// rotation-invariant index (rotation.cpp), which the library does not
+// know of, are always evaluated here, the last at every rotation.  A
+// compressed index is read in preference to lshlib's.
+//
+// --lsh_tables N probes only the first N tables of a compressed index,
+// for faster searches at lower recall.  The index is mapped, so only
+// the pages of those tables are read.  Each table's hash functions are
+// drawn independently of the others', so any N of them are as good as
+// the first N.  lshlib's indexes (O2_SERIAL_FILEFORMAT2) cannot be
+// probed in part: its retrieval visits every table, and with
+// lsh_use_u_functions its tables share their functions in pairs.
+
+#include "audioDB.h"
+
+#include <algorithm>
+
+typedef struct {
+  Uns32T trackID;
+  Uns32T spos;
+  Uns32T qpos;
+} LshCandidate;
+
+static bool lsh_candidate_less(const LshCandidate &a, const LshCandidate &b) {
+  if(a.trackID != b.trackID)
+    return a.trackID < b.trackID;
+  if(a.spos != b.spos)
+    return a.spos < b.spos;
+  return a.qpos < b.qpos;
+}
+
+// The dot product of a sequence of l vectors of d dimensions, q
+// rotated by r as rotateDatum() would, and another, t
+static double lsh_dot(const double *q, const double *t, Uns32T d, Uns32T l, int r) {
+  Uns32T rr = ((r % (int) d) + d) % d;
+  double dot = 0;
+  for(Uns32T f = 0; f < l; f++, q += d, t += d) {
+    for(Uns32T j = 0; j + rr < d; j++)
+      dot += q[j + rr] * t[j];
+    for(Uns32T j = d - rr; j < d; j++)
+      dot += q[j + rr - d] * t[j];
+  }
+  return dot;
+}
+
+// The candidates of one query position, as the index gives them
+typedef struct {
+  std::vector<uint32_t> seen;
+  std::vector<Uns32T> points;
+  unsigned long long repeats;
+} LshGather;
+
+static void lsh_gather(void *caller, Uns32T pointID, Uns32T qpos, float dist) {
+  LshGather *g = (LshGather *) caller;
+  size_t word = pointID >> 5;
+  if(word >= g->seen.size())
+    g->seen.resize(word + 1 + (word >> 2), 0);
+  uint32_t bit = 1U << (pointID & 31);
+  if(g->seen[word] & bit) {
+    g->repeats++;
+    return;
+  }
+  g->seen[word] |= bit;
+  g->points.push_back(pointID);
+}
+
+// Whether a query is one whose candidates are evaluated here
+bool audioDB::lsh_batch_applies(const adb_query_spec_t *qspec) {
+  bool applies = radius && !use_cache && shards.empty() &&
+    (queryType == O2_SEQUENCE_QUERY || queryType == O2_N_SEQUENCE_QUERY) &&
+    (qspec->params.distance == ADB_DISTANCE_EUCLIDEAN_NORMED || qspec->params.distance == ADB_DISTANCE_EUCLIDEAN) &&
+    !(qspec->refine.flags & (ADB_REFINE_ABSOLUTE_THRESHOLD | ADB_REFINE_RELATIVE_THRESHOLD | ADB_REFINE_DURATION_RATIO));
+  if(lsh_tables) {
+    if(!applies)
+      error("--lsh_tables applies only to sequence and nsequence radius searches, without power thresholds, times or --cache");
+    if(!zindex_exists())
+      error("--lsh_tables needs a compressed index for this radius and sequence length: build one with --INDEX --lsh_compress");
+    return true;
+  }
+  return applies && (lsh_exact || use_rotate || zindex_exists()) && mass_index_exists();
+}
+
+void audioDB::lsh_batch_query(const adb_query_spec_t *qspec) {
+  const adb_datum_t *datum = qspec->qid.datum;
+  Uns32T l = sequenceLength;
+  Uns32T qhop = qspec->refine.qhopsize;
+  Uns32T ihop = qspec->refine.ihopsize;
+  bool normed = qspec->params.distance == ADB_DISTANCE_EUCLIDEAN_NORMED;
+
+  forWrite = false;
+  initDBHeader(dbName, O2_TABLE_TRACK);
+  if(dbH->flags & O2_FLAG_L2NORM)
+    map_tables(O2_TABLE_L2NORM);
+  Uns32T d = dbH->dim;
+  if(datum->dim != d)
+    error("query dimension does not match database dimension");
+  if(datum->nvectors < l)
+    error("Query sequence too short for sequence length", inFile);
+
+  Uns32T qstart, nq;
+  if(qspec->qid.flags & ADB_QID_FLAG_EXHAUSTIVE) {
+    qstart = 0;
+    nq = (datum->nvectors - l) / qhop + 1;
+  } else {
+    qstart = qspec->qid.sequence_start;
+    if(qstart > datum->nvectors - l)
+      error("queryPoint > numVectors-wL+1 in query");
+    nq = 1;
+  }
+
+  // query shingles, normed as the index's were
+  Uns32T nvecs = datum->nvectors - l + 1;
+  double *qn = new double[datum->nvectors];
+  double *qp = new double[datum->nvectors];
+  audiodb_l2norm_buffer(datum->data, d, datum->nvectors, qn);
+  audiodb_sequence_sum(qn, datum->nvectors, l);
+  audiodb_sequence_sqrt(qn, datum->nvectors, l);
+  memset(qp, 0, datum->nvectors * sizeof(double));
+  std::vector<std::vector<float> > *vv = audiodb_index_initialize_shingles(nvecs, d, l);
+  for(Uns32T k = 0; k < nvecs; k++)
+    audiodb_index_make_shingle(vv, k, datum->data, d, l);
+  if(audiodb_index_norm_shingles(vv, qn, qp, d, l, radius, normed, false, 0) == -1)
+    error("failed to norm query shingles");
+  int rmin = 0, rmax = 0;
+  if(use_rotate) {
+    rotation_project_shingles(vv, d);
+    rmin = rotate == -1 ? 0 : -rotate;
+    rmax = rotate == -1 ? (int) d - 1 : rotate;
+  }
+
+  stats_phase("index_load");
+  char *indexName = zindex_get_name();
+  if(!indexName)
+    error("failed to get index name", dbName);
+  ZIndex z;
+  LSH *index = 0;
+  Uns32T ntables = 0;
+  if(zindex_open(&z, indexName)) {
+    if(z.dim != l * d)
+      error("compressed index does not match the sequence length and dimension", indexName);
+    ntables = z.ntables;
+    if(lsh_tables) {
+      if(lsh_tables > z.ntables)
+        error("--lsh_tables is more than the tables of the compressed index", indexName);
+      ntables = lsh_tables;
+    }
+    stats_count("index_bytes", z.length);
+    stats_count("index_tables", ntables);
+    stats_count("index_table_bytes", zindex_table_bytes(&z, ntables));
+    VERB_LOG(1, "compressed index %s: %ju bytes, probing %u of %u tables\n", indexName, (uintmax_t) z.length, ntables, z.ntables);
+  } else {
+    delete[] indexName;
+    indexName = index_get_name();
+    index = new LSH(indexName, lsh_in_core);
+    struct stat st;
+    if(stat(indexName, &st) == 0)
+      stats_count("index_bytes", st.st_size);
+  }
+
+  // every table's candidates for each query position, without repeats
+  stats_phase("candidates");
+  LshGather g;
+  g.repeats = 0;
+  std::vector<LshCandidate> candidates;
+  bool *include = new bool[dbH->numFiles];
+  init_track_mask(qspec, include);
+  for(Uns32T k = 0; k < nq; k++) {
+    Uns32T qpos = qstart + k * qhop;
+    if(normed && !(qn[qpos] > 0))
+      continue;
+    if(!index)
+      zindex_retrieve_point(&z, (*vv)[qpos], qpos, ntables, lsh_gather, &g);
+    else if(lsh_in_core)
+      index->retrieve_point((*vv)[qpos], qpos, lsh_gather, &g);
+    else
+      index->serial_retrieve_point(indexName, (*vv)[qpos], qpos, lsh_gather, &g);
+    for(size_t j = 0; j < g.points.size(); j++) {
+      Uns32T pointID = g.points[j];
+      g.seen[pointID >> 5] = 0;
+      Uns32T trackID = audiodb_index_to_track_id(adb, pointID);
+      if(trackID >= dbH->numFiles || !include[trackID])
+        continue;
+      Uns32T spos = audiodb_index_to_track_pos(adb, trackID, pointID);
+      if(trackTable[trackID] < l || spos > trackTable[trackID] - l || spos % ihop)
+        continue;
+      LshCandidate c = {trackID, spos, qpos};
+      candidates.push_back(c);
+    }
+    g.points.clear();
+  }
+  delete[] include;
+  std::vector<uint32_t>().swap(g.seen);
+  audiodb_index_delete_shingles(vv);
+  if(index)
+    delete index;
+  else
+    zindex_close(&z);
+  delete[] indexName;
+  std::sort(candidates.begin(), candidates.end(), lsh_candidate_less);
+  stats_count("candidates", candidates.size());
+  stats_count("duplicate_candidates", g.repeats);
+
+  std::vector<off_t> vectorOffsets(dbH->numFiles + 1, 0);
+  for(Uns32T i = 0; i < dbH->numFiles; i++)
+    vectorOffsets[i + 1] = vectorOffsets[i] + trackTable[i];
+  bool prefetch = !(dbH->flags & O2_FLAG_LARGE_ADB);
+
+  // each track's candidates from one read of the span they cover
+  stats_phase("search");
+  double *fvp = 0;
+  size_t nfv = 0;
+  unsigned long long tracks = 0, distances = 0, results = 0;
+  for(size_t c0 = 0, c1; c0 < candidates.size(); c0 = c1) {
+    Uns32T trackID = candidates[c0].trackID;
+    Uns32T first = candidates[c0].spos, last = first;
+    for(c1 = c0; c1 < candidates.size() && candidates[c1].trackID == trackID; c1++)
+      last = candidates[c1].spos;
+    searchableVectors += c1 - c0;
+    if(deadline_passed())
+      continue;
+    if(prefetch && c1 < candidates.size()) {
+      const LshCandidate &next = candidates[c1];
+      size_t c2 = c1;
+      while(c2 + 1 < candidates.size() && candidates[c2 + 1].trackID == next.trackID)
+        c2++;
+      off_t span = candidates[c2].spos - next.spos + l;
+      posix_fadvise(dbfid, dbH->dataOffset + (vectorOffsets[next.trackID] + next.spos) * d * sizeof(double),
+                    span * d * sizeof(double), POSIX_FADV_WILLNEED);
+    }
+    read_track_data(trackID, vectorOffsets[trackID], &fvp, &nfv, first, last - first + l);
+    tracks++;
+
+    Uns32T spos = ~0U;
+    double sn = 0;
+    for(size_t c = c0; c < c1; c++) {
+      const LshCandidate &cand = candidates[c];
+      const double *t = fvp + (size_t) (cand.spos - first) * d;
+      if(cand.spos != spos) {
+        spos = cand.spos;
+        sn = 0;
+        if(l2normTable) {
+          for(Uns32T i = 0; i < l; i++)
+            sn += l2normTable[vectorOffsets[trackID] + spos + i];
+        } else {
+          for(size_t i = 0; i < (size_t) l * d; i++)
+            sn += t[i] * t[i];
+        }
+        sn = sqrt(sn);
+      }
+      // the best rotation, the first of any that are equally good
+      const double *q = datum->data + (size_t) cand.qpos * d;
+      double dot = -DBL_MAX;
+      int rot = 0;
+      for(int r = rmin; r <= rmax; r++) {
+        double x = lsh_dot(q, t, d, l, r);
+        if(x > dot) {
+          dot = x;
+          rot = r;
+        }
+      }
+      distances += rmax - rmin + 1;
+      double dist;
+      if(normed) {
+        if(!(sn > 0))
+          continue;
+        dist = 2 - (2 / (qn[cand.qpos] * sn)) * dot;
+      } else {
+        dist = qn[cand.qpos] * qn[cand.qpos] + sn * sn - 2 * dot;
+      }
+      if(!(dist <= radius))
+        continue;
+      reporter->add_point(trackID, cand.qpos, cand.spos, dist, rot);
+      results++;
+    }
+    searchedVectors += c1 - c0;
+  }
+
+  free(fvp);
+  delete[] qn;
+  delete[] qp;
+  stats_count("tracks", tracks);
+  stats_count("distances", distances);
+  stats_count("results", results);
+}
@@ -0,0 +1,414 @@
+// FFT distance profiles
+//
+// Exhaustive sequence search for long sequence lengths, in the style
+// of Mueen's MASS: the sliding dot products between a query sequence
+// and every offset of a track are computed for all dimensions at once
+// by FFT convolution, and combined with running sums of the
+// per-vector squared norms (l2normTable) to give the normed (or
+// plain) Euclidean distance profile of the track.
+//
+// The direct search costs O(n.l.d) per query position; this costs
+// O(n.d.log(N)), where the FFT length N is fixed per query so that
+// long tracks are processed block by block (overlap-save), and the
+// query spectra are computed once and reused for every track.
+//
+// The results are passed to the same reporters as library queries.
+// With --threads the tracks, long ones split into pieces, are shared
+// between threads by the work-stealing scheduler (tasks.cpp), and with
+// --timeout-ms the tasks left when the deadline passes are skipped.
+
+#include "audioDB.h"
+
+#include <pthread.h>
+#include <gsl/gsl_fft_real.h>
+#include <gsl/gsl_fft_halfcomplex.h>
+
+// accumulate the product of two halfcomplex (gsl radix2) spectra
+static void mass_hc_multiply_accumulate(const double *a, const double *b, double *acc, size_t n) {
+  acc[0] += a[0] * b[0];
+  acc[n/2] += a[n/2] * b[n/2];
+  for(size_t i = 1; i < n/2; i++) {
+    double ar = a[i], ai = a[n-i];
+    double br = b[i], bi = b[n-i];
+    acc[i] += ar * br - ai * bi;
+    acc[n-i] += ar * bi + ai * br;
+  }
+}
+
+// window sums of x[0..n-1] of length l, by running sum
+static void mass_window_sum(const double *x, Uns32T n, Uns32T l, double *out) {
+  double sum = 0;
+  for(Uns32T i = 0; i < l; i++)
+    sum += x[i];
+  out[0] = sum;
+  for(Uns32T i = l; i < n; i++) {
+    sum += x[i] - x[i-l];
+    out[i-l+1] = sum;
+  }
+}
+
+// An LSH index for this radius and sequence length, lshlib's or the
+// compressed one, answers radius queries faster than either
+// exhaustive search, so leave those to the library or the batched LSH
+// search.
+bool audioDB::mass_index_exists() {
+  if(!radius)
+    return false;
+  char *indexName = index_get_name();
+  if(!indexName)
+    return false;
+  bool exists = access(indexName, R_OK) == 0;
+  delete[] indexName;
+  return exists || zindex_exists();
+}
+
+// Spectra of the reversed query sequences starting at qstart,
+// qstart+qhop, ... (nq of them), one halfcomplex array of fftlen
+// per dimension, so that multiplication by a track spectrum gives
+// the sliding dot product.
+void audioDB::mass_query_spectra(const adb_datum_t *datum, Uns32T qstart, Uns32T nq, Uns32T qhop, size_t fftlen, double *qspectra) {
+  Uns32T d = datum->dim;
+  for(Uns32T k = 0; k < nq; k++) {
+    const double *q = datum->data + (size_t) (qstart + k * qhop) * d;
+    for(Uns32T j = 0; j < d; j++) {
+      double *s = qspectra + ((size_t) k * d + j) * fftlen;
+      for(Uns32T i = 0; i < sequenceLength; i++)
+        s[i] = q[(size_t) (sequenceLength - 1 - i) * d + j];
+      memset(s + sequenceLength, 0, (fftlen - sequenceLength) * sizeof(double));
+      gsl_fft_real_radix2_transform(s, 1, fftlen);
+    }
+  }
+}
+
+// Distance profiles of one task, the windows of a track or of part of
+// one, against a set of query batches, which share the sequence
+// length, refinements and FFT length.  The task's data is read, and its
+// norms, powers and spectra computed, once for all of them.  Blocks
+// start at the same offsets within a track however it is split into
+// tasks, and their sequence norms and powers are summed afresh, so
+// that the distances do not depend on the number of threads.
+void audioDB::mass_track(const Task *task, const adb_query_spec_t *qspec, MassBatch *batches, unsigned nbatches, size_t fftlen, MassThread *t) {
+  Uns32T trackID = task->trackID;
+  Uns32T d = dbH->dim;
+  Uns32T l = sequenceLength;
+  Uns32T ihop = qspec->refine.ihopsize;
+  uint32_t flags = qspec->refine.flags;
+  bool normed = qspec->params.distance == ADB_DISTANCE_EUCLIDEAN_NORMED;
+  bool thresholds = flags & (ADB_REFINE_ABSOLUTE_THRESHOLD | ADB_REFINE_RELATIVE_THRESHOLD);
+
+  unsigned long long distances = 0, powerRejected = 0, results = 0;
+
+  // the task's windows cover l-1 vectors beyond them
+  Uns32T n = task->count + l - 1;
+  read_track_data(trackID, task->vectorOffset, &t->fvp, &t->nfv, task->first, n);
+  double *fvp = t->fvp;
+  const double *l2norms = 0, *powers = 0;
+  if((dbH->flags & O2_FLAG_L2NORM) && l2normTable)
+    l2norms = l2normTable + task->vectorOffset + task->first;
+  if(thresholds)
+    powers = powerTable + task->vectorOffset + task->first;
+  double *sn = &t->sn[0], *sp = &t->sp[0], *acc = &t->acc[0], *tspectra = &t->tspectra[0];
+
+  // overlap-save: each block of fftlen vectors yields fftlen-l+1 offsets
+  size_t step = fftlen - l + 1;
+  for(size_t start = 0; start < task->count; start += step) {
+    size_t len = n - start < fftlen ? n - start : fftlen;
+    size_t nwin = len - l + 1;
+
+    // sequence norms from the per-vector squared norms
+    if(l2norms) {
+      mass_window_sum(l2norms + start, len, l, sn);
+    } else {
+      audiodb_l2norm_buffer(fvp + start * d, d, len, &t->norms[0]);
+      mass_window_sum(&t->norms[0], len, l, sn);
+    }
+    for(size_t o = 0; o < nwin; o++)
+      sn[o] = sqrt(sn[o]);
+    if(thresholds) {
+      mass_window_sum(powers + start, len, l, sp);
+      for(size_t o = 0; o < nwin; o++)
+        sp[o] /= l;
+    }
+
+    for(Uns32T j = 0; j < d; j++) {
+      double *ts = tspectra + j * fftlen;
+      for(size_t i = 0; i < len; i++)
+        ts[i] = fvp[(start + i) * d + j];
+      memset(ts + len, 0, (fftlen - len) * sizeof(double));
+      gsl_fft_real_radix2_transform(ts, 1, fftlen);
+    }
+    for(unsigned b = 0; b < nbatches; b++) {
+      const MassBatch &batch = batches[b];
+      for(Uns32T k = 0; k < batch.nq; k++) {
+        const double *qn = batch.qn;
+        const double *qp = batch.qp;
+        if(normed && !(qn[k] > 0))
+          continue;
+        memset(acc, 0, fftlen * sizeof(double));
+        for(Uns32T j = 0; j < d; j++)
+          mass_hc_multiply_accumulate(tspectra + j * fftlen, batch.qspectra + ((size_t) k * d + j) * fftlen, acc, fftlen);
+        gsl_fft_halfcomplex_radix2_inverse(acc, 1, fftlen);
+
+        for(size_t o = 0; o < nwin; o++) {
+          Uns32T spos = task->first + start + o;
+          if(spos % ihop)
+            continue;
+          if(thresholds) {
+            if((flags & ADB_REFINE_ABSOLUTE_THRESHOLD) &&
+               (qp[k] < qspec->refine.absolute_threshold || sp[o] < qspec->refine.absolute_threshold)) {
+              powerRejected++;
+              continue;
+            }
+            if((flags & ADB_REFINE_RELATIVE_THRESHOLD) &&
+               fabs(qp[k] - sp[o]) > qspec->refine.relative_threshold) {
+              powerRejected++;
+              continue;
+            }
+          }
+          distances++;
+          double dot = acc[o + l - 1];
+          double dist;
+          if(normed) {
+            if(!(sn[o] > 0))
+              continue;
+            dist = 2 - (2 / (qn[k] * sn[o])) * dot;
+          } else {
+            dist = qn[k] * qn[k] + sn[o] * sn[o] - 2 * dot;
+          }
+          if((flags & ADB_REFINE_RADIUS) && !(dist <= qspec->refine.radius))
+            continue;
+          Uns32T qpos = batch.qstart + k * batch.qhop;
+          if(t->buffered) {
+            MassResult r = {batch.reporter, trackID, qpos, spos, dist};
+            t->results.push_back(r);
+          } else {
+            batch.reporter->add_point(trackID, qpos, spos, dist);
+          }
+          results++;
+        }
+      }
+    }
+  }
+
+  if(!task->first)
+    stats_count("tracks");
+  stats_count("distances", distances);
+  stats_count("power_rejected", powerRejected);
+  stats_count("results", results);
+}
+
+// The state shared by the threads of a scan
+typedef struct {
+  audioDB *db;
+  const adb_query_spec_t *qspec;
+  MassBatch *batches;
+  unsigned nbatches;
+  size_t fftlen;
+  std::vector<MassThread> *threads;
+  std::vector<std::vector<MassResult> > pending;
+  std::vector<char> done;
+  size_t next;
+  uint64_t searched;
+  pthread_mutex_t lock;
+} MassScan;
+
+// Search one task, unless the deadline has passed; with several
+// threads, report its results, and those of the tasks after it that
+// finished first, once the tasks before it have reported, so that the
+// reporters see the results in the order one thread would give them
+static void mass_task(void *arg, unsigned index, const Task *task, unsigned thread) {
+  MassScan *s = (MassScan *) arg;
+  MassThread *t = &(*s->threads)[thread];
+  bool searched = !s->db->deadline_passed();
+  if(searched)
+    s->db->mass_track(task, s->qspec, s->batches, s->nbatches, s->fftlen, t);
+  pthread_mutex_lock(&s->lock);
+  if(searched)
+    s->searched += task->count;
+  if(!t->buffered) {
+    pthread_mutex_unlock(&s->lock);
+    return;
+  }
+  s->pending[index].swap(t->results);
+  s->done[index] = 1;
+  while(s->next < s->done.size() && s->done[s->next]) {
+    std::vector<MassResult> &rs = s->pending[s->next];
+    for(size_t k = 0; k < rs.size(); k++)
+      rs[k].reporter->add_point(rs[k].trackID, rs[k].qpos, rs[k].spos, rs[k].dist);
+    std::vector<MassResult>().swap(rs);
+    s->next++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  t->results.clear();
+}
+
+void audioDB::mass_query(const adb_query_spec_t *qspec) {
+  adb_query_spec_t spec = *qspec;
+  mass_queries(&spec, &reporter, 1);
+}
+
+// Search for each of nqueries queries, qspecs[i] reporting to
+// reporters[i]; the queries share everything but their datum and
+// query position.  The database is scanned once for as many queries'
+// spectra as fit in O2_MASS_QUERY_MEMORY, so a batch of queries costs
+// a single scan where they fit.
+void audioDB::mass_queries(adb_query_spec_t *qspecs, ReporterBase **reporters, unsigned nqueries) {
+  const adb_query_spec_t *qspec = &qspecs[0];
+  uint32_t flags = qspec->refine.flags;
+
+  forWrite = false;
+  initDBHeader(dbName, O2_TABLE_TRACK);
+  if(dbH->flags & O2_FLAG_L2NORM)
+    map_tables(O2_TABLE_L2NORM);
+  if(flags & (ADB_REFINE_ABSOLUTE_THRESHOLD | ADB_REFINE_RELATIVE_THRESHOLD))
+    map_tables(O2_TABLE_POWER);
+
+  if(flags & ADB_REFINE_DURATION_RATIO)
+    error("times refinement is not supported by the FFT sequence search");
+  if((flags & (ADB_REFINE_ABSOLUTE_THRESHOLD | ADB_REFINE_RELATIVE_THRESHOLD)) && (dbH->flags & O2_FLAG_LARGE_ADB))
+    error("power thresholds are not supported by the FFT sequence search on LARGE_ADB databases");
+
+  Uns32T l = sequenceLength;
+  Uns32T d = dbH->dim;
+  Uns32T qhop = qspec->refine.qhopsize;
+
+  // FFT length: a power of two at least four times the sequence
+  // length, so that most of each block yields valid offsets
+  size_t fftlen = 1024;
+  while(fftlen < 4 * (size_t) l)
+    fftlen <<= 1;
+
+  // query spectra are held in batches bounded by O2_MASS_QUERY_MEMORY
+  size_t qbatch = O2_MASS_QUERY_MEMORY / (d * fftlen * sizeof(double));
+  if(qbatch < 1)
+    qbatch = 1;
+
+  // query norms and powers, and each query's positions in batches
+  std::vector<MassBatch> batches;
+  std::vector<double *> owned;
+  for(unsigned i = 0; i < nqueries; i++) {
+    const adb_datum_t *datum = qspecs[i].qid.datum;
+    const char *name = datum->key ? datum->key : inFile;
+    if(datum->dim != d)
+      error("query dimension does not match database dimension", name);
+    if(datum->nvectors < l)
+      error("Query sequence too short for sequence length", name);
+    if((flags & (ADB_REFINE_ABSOLUTE_THRESHOLD | ADB_REFINE_RELATIVE_THRESHOLD)) && !datum->power)
+      error("power threshold given but no query power", name);
+
+    Uns32T qstart, nq;
+    if(qspecs[i].qid.flags & ADB_QID_FLAG_EXHAUSTIVE) {
+      qstart = 0;
+      nq = (datum->nvectors - l) / qhop + 1;
+    } else {
+      qstart = qspecs[i].qid.sequence_start;
+      if(qstart > datum->nvectors - l)
+        error("queryPoint > numVectors-wL+1 in query", name);
+      nq = 1;
+    }
+
+    double *norms = new double[datum->nvectors];
+    double *qn = new double[datum->nvectors - l + 1];
+    double *qp = 0;
+    audiodb_l2norm_buffer(datum->data, d, datum->nvectors, norms);
+    mass_window_sum(norms, datum->nvectors, l, qn);
+    delete[] norms;
+    for(Uns32T k = 0; k < nq; k++)
+      qn[k] = sqrt(qn[qstart + k * qhop]);
+    owned.push_back(qn);
+    if(datum->power) {
+      qp = new double[datum->nvectors - l + 1];
+      mass_window_sum(datum->power, datum->nvectors, l, qp);
+      for(Uns32T k = 0; k < nq; k++)
+        qp[k] = qp[qstart + k * qhop] / l;
+      owned.push_back(qp);
+    }
+
+    for(Uns32T k0 = 0; k0 < nq; k0 += qbatch) {
+      MassBatch b;
+      b.datum = datum;
+      b.reporter = reporters[i];
+      b.qn = qn + k0;
+      b.qp = qp ? qp + k0 : 0;
+      b.qstart = qstart + k0 * qhop;
+      b.nq = nq - k0 < qbatch ? nq - k0 : qbatch;
+      b.qhop = qhop;
+      b.qspectra = 0;
+      batches.push_back(b);
+    }
+  }
+
+  bool *include = new bool[dbH->numFiles];
+  init_track_mask(qspec, include);
+
+  // tasks split at block boundaries, and no larger than a thread's
+  // share of results can be held for: as no task starts more than
+  // O2_MASS_TASKS_AHEAD * threads after the oldest unreported one, at
+  // most that many tasks' results are held
+  size_t step = fftlen - l + 1;
+  size_t perWindow = 0;
+  for(size_t b = 0; b < batches.size(); b++)
+    perWindow += batches[b].nq;
+  if(perWindow > qbatch)
+    perWindow = qbatch;
+  std::vector<Task> split, tasks;
+  tasks_split(include, l, step, O2_MASS_TASK_RESULTS / perWindow, split);
+  delete[] include;
+  std::vector<size_t> order;
+  deadline_order(split.size(), order);
+  for(size_t k = 0; k < order.size(); k++)
+    tasks.push_back(split[order[k]]);
+
+  VERB_LOG(1, "FFT sequence search: l=%u queries=%u batches=%zu fftlen=%zu tasks=%zu\n", l, nqueries, batches.size(), fftlen, tasks.size());
+
+  std::vector<MassThread> mthreads(threads);
+  for(unsigned k = 0; k < threads; k++) {
+    MassThread &t = mthreads[k];
+    t.fvp = 0;
+    t.nfv = 0;
+    t.tspectra.resize(d * fftlen);
+    t.acc.resize(fftlen);
+    t.norms.resize(fftlen);
+    t.sn.resize(step);
+    t.sp.resize(step);
+    t.buffered = threads > 1;
+  }
+  double *qspectra = new double[qbatch * d * fftlen];
+
+  // one scan of the database per group of batches whose spectra fit
+  for(size_t b0 = 0; b0 < batches.size(); ) {
+    size_t b1 = b0, used = 0;
+    while(b1 < batches.size() && (b1 == b0 || used + batches[b1].nq <= qbatch)) {
+      batches[b1].qspectra = qspectra + used * d * fftlen;
+      used += batches[b1].nq;
+      b1++;
+    }
+    for(size_t b = b0; b < b1; b++)
+      mass_query_spectra(batches[b].datum, batches[b].qstart, batches[b].nq, qhop, fftlen, batches[b].qspectra);
+    stats_count("scans");
+    MassScan scan;
+    scan.db = this;
+    scan.qspec = qspec;
+    scan.batches = &batches[b0];
+    scan.nbatches = b1 - b0;
+    scan.fftlen = fftlen;
+    scan.threads = &mthreads;
+    scan.pending.resize(tasks.size());
+    scan.done.assign(tasks.size(), 0);
+    scan.next = 0;
+    scan.searched = 0;
+    pthread_mutex_init(&scan.lock, NULL);
+    tasks_run(tasks, mass_task, &scan, (size_t) O2_MASS_TASKS_AHEAD * threads);
+    pthread_mutex_destroy(&scan.lock);
+    for(size_t k = 0; k < tasks.size(); k++)
+      searchableVectors += tasks[k].count;
+    searchedVectors += scan.searched;
+    b0 = b1;
+  }
+
+  for(unsigned k = 0; k < threads; k++)
+    free(mthreads[k].fvp);
+  delete[] qspectra;
+  for(unsigned k = 0; k < owned.size(); k++)
+    delete[] owned[k];
+}
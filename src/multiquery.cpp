@@ -0,0 +1,87 @@
+// Shared-scan queries
+//
+// --QUERY sequence (or nsequence) with a --featureList, rather than
+// --features, runs every query named in the list, with power files
+// from a --powerList when thresholding, in a single pass over the
+// database: each track is read once, and its spectra computed once,
+// for all of the queries, by the FFT sequence search (mass.cpp), so a
+// batch of N queries costs one scan of the database rather than N.
+// Each query has its own reporter, and the results are printed query
+// by query, each preceded by a line naming the query's feature file.
+
+#include "audioDB.h"
+
+void audioDB::query_list(adb_query_spec_t *qspec, uint32_t nfiles) {
+  if(!shards.empty() || use_cache)
+    error("queries from a --featureList are not supported across several databases, or with --cache");
+  if(qspec->refine.flags & ADB_REFINE_DURATION_RATIO)
+    error("queries from a --featureList do not take times");
+
+  stats_phase("datum");
+  std::ifstream filesIn(queryListName);
+  if(!filesIn.is_open())
+    error("Could not open query list", queryListName);
+  std::ifstream powersIn;
+  if(queryPowerListName) {
+    powersIn.open(queryPowerListName);
+    if(!powersIn.is_open())
+      error("Could not open query power list", queryPowerListName);
+  }
+  bool thresholds = qspec->refine.flags & (ADB_REFINE_ABSOLUTE_THRESHOLD | ADB_REFINE_RELATIVE_THRESHOLD);
+  if(thresholds && !queryPowerListName)
+    error("power threshold but no --powerList given");
+
+  std::vector<std::string> names;
+  std::vector<adb_datum_t> datums;
+  std::string line, powerLine;
+  while(std::getline(filesIn, line)) {
+    if(line.empty())
+      continue;
+    adb_datum_t datum = {0};
+    datum.data = readFeatureFile(line.c_str(), &datum.dim, &datum.nvectors);
+    if(queryPowerListName) {
+      if(!std::getline(powersIn, powerLine))
+        error("not enough power files in powerList", queryPowerListName);
+      uint32_t one, n;
+      datum.power = readFeatureFile(powerLine.c_str(), &one, &n);
+      if(one != 1)
+        error("malformed power file dimensionality", powerLine.c_str());
+      if(n != datum.nvectors)
+        error("power file length does not match feature file", powerLine.c_str());
+    }
+    names.push_back(line);
+    datums.push_back(datum);
+  }
+  if(datums.empty())
+    error("no queries in query list", queryListName);
+
+  // the queries differ only in their datums, and in their reporters
+  unsigned nqueries = datums.size();
+  std::vector<adb_query_spec_t> qspecs(nqueries, *qspec);
+  std::vector<ReporterBase *> reporters(nqueries);
+  for(unsigned i = 0; i < nqueries; i++) {
+    adb_query_spec_t &s = qspecs[i];
+    s.qid.datum = &datums[i];
+    s.qid.sequence_length = sequenceLength;
+    s.qid.flags = usingQueryPoint ? 0 : ADB_QID_FLAG_EXHAUSTIVE;
+    s.qid.sequence_start = queryPoint;
+    reporters[i] = query_reporter(&s, nfiles);
+  }
+  stats_count("queries", nqueries);
+
+  stats_phase("search");
+  mass_queries(&qspecs[0], &reporters[0], nqueries);
+
+  stats_phase("report");
+  for(unsigned i = 0; i < nqueries; i++) {
+    std::cout << names[i] << std::endl;
+    query_report(reporters[i]);
+    delete reporters[i];
+  }
+  deadline_report();
+
+  for(unsigned i = 0; i < nqueries; i++) {
+    free(datums[i].data);
+    free(datums[i].power);
+  }
+}
@@ -0,0 +1,238 @@
+// Packed LARGE_ADB features
+//
+// --PACK copies the features, power and times of every track of a
+// LARGE_ADB database, read from the files its tables name, into one
+// file alongside the database, dbName.pack: a header (magic number,
+// dimension, number of tracks, which of power and times are present,
+// and the offset of the table of contents), then each track's data as
+// native doubles, each track's features starting on a 64-byte
+// boundary, and last the table of contents, one entry per track giving
+// the offset of its features, power and times, with the size and
+// modification time of the file each was copied from, and its number
+// of vectors.  Indexing and the FFT, warped sequence and batched LSH
+// searches map the pack when it is present and read tracks from it
+// rather than opening their files.  Queries left to the library (point
+// and track queries, shorter sequence queries and those using an LSH
+// index without exact evaluation) still read every track's files.
+//
+// The pack is a copy: tracks inserted since it was made, tracks whose
+// length has changed, and files whose size or modification time is not
+// that recorded (files since rewritten) are read from their files, and
+// --PACK may be run again at any time to bring it up to date.  Files
+// that have been removed are read from the pack.  Times are packed for
+// completeness, but the library reads a LARGE_ADB database's times
+// files itself.
+
+#include "audioDB.h"
+
+#define O2_PACK_ALIGN (64)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t dim;
+  uint32_t ntracks;
+  uint32_t flags;
+  uint64_t tocOffset;
+} pack_header_t;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t size;
+  int64_t mtime;
+} pack_file_t;
+
+typedef struct {
+  pack_file_t data;
+  pack_file_t power;
+  pack_file_t times;
+  uint32_t nvectors;
+  uint32_t pad;
+} pack_entry_t;
+
+// Record the size and modification time of the file a track's data
+// are copied from
+static void pack_stat(const char *path, pack_file_t *f) {
+  struct stat st;
+  if(stat(path, &st) == 0) {
+    f->size = st.st_size;
+    f->mtime = st.st_mtime;
+  }
+}
+
+char *audioDB::pack_path(const char *name) {
+  char *path = new char[strlen(name) + 8];
+  sprintf(path, "%s.pack", name);
+  return path;
+}
+
+static bool pack_write(int fd, const void *buf, size_t count, uint64_t *offset) {
+  const char *p = (const char *) buf;
+  *offset += count;
+  while(count) {
+    ssize_t n = write(fd, p, count);
+    if(n <= 0)
+      return false;
+    p += n;
+    count -= n;
+  }
+  return true;
+}
+
+void audioDB::pack(const char *dbName) {
+  stats_phase("open");
+  forWrite = false;
+  initDBHeader(dbName, O2_TABLE_TRACK | O2_TABLE_FEATURES | O2_TABLE_TIMES | O2_TABLE_POWER);
+  if(!(dbH->flags & O2_FLAG_LARGE_ADB))
+    error("--PACK applies only to LARGE_ADB databases, which hold feature file names", dbName);
+
+  char *path = pack_path(dbName);
+  char *tmpName = new char[strlen(path) + 16];
+  sprintf(tmpName, "%s.%d", path, (int) getpid());
+  int fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(fd < 0)
+    error("failed to create pack file", tmpName, "open");
+
+  Uns32T numFiles = dbH->numFiles;
+  pack_header_t h = {O2_PACK_MAGIC, dbH->dim, numFiles, dbH->flags & (O2_FLAG_POWER | O2_FLAG_TIMES), 0};
+  std::vector<pack_entry_t> toc(numFiles);
+  std::vector<double> buffer;
+  static const char zeros[O2_PACK_ALIGN] = {0};
+  uint64_t offset = 0;
+  bool ok = pack_write(fd, &h, sizeof(h), &offset);
+
+  stats_phase("pack");
+  for(Uns32T k = 0; ok && k < numFiles; k++) {
+    pack_entry_t &e = toc[k];
+    memset(&e, 0, sizeof(e));
+    e.nvectors = trackTable[k];
+    size_t n = (size_t) e.nvectors * dbH->dim;
+
+    char fileName[O2_MAXFILESTR];
+    ok = pack_write(fd, zeros, ALIGN_UP(offset, 6) - offset, &offset);
+    track_file_path(k, featureFileNameTable, fileName);
+    pack_stat(fileName, &e.data);
+    e.data.offset = offset;
+    buffer.resize(n + 1);
+    if(n && pread(track_file(k, featureFileNameTable), &buffer[0], n * sizeof(double), sizeof(uint32_t)) != (ssize_t) (n * sizeof(double)))
+      error("short read of track data", audiodb_index_key(adb, k));
+    ok = ok && pack_write(fd, &buffer[0], n * sizeof(double), &offset);
+
+    if(h.flags & O2_FLAG_POWER) {
+      track_file_path(k, powerFileNameTable, fileName);
+      pack_stat(fileName, &e.power);
+      e.power.offset = offset;
+      buffer.resize(e.nvectors + 1);
+      if(e.nvectors && pread(track_file(k, powerFileNameTable), &buffer[0], e.nvectors * sizeof(double), sizeof(uint32_t)) != (ssize_t) (e.nvectors * sizeof(double)))
+        error("short read of power data", audiodb_index_key(adb, k));
+      ok = ok && pack_write(fd, &buffer[0], e.nvectors * sizeof(double), &offset);
+    }
+    if(h.flags & O2_FLAG_TIMES) {
+      track_file_path(k, timesFileNameTable, fileName);
+      pack_stat(fileName, &e.times);
+      e.times.offset = offset;
+      buffer.resize(2 * (size_t) e.nvectors + 1);
+      insertTimeStamps(e.nvectors, fileName, &buffer[0]);
+      ok = ok && pack_write(fd, &buffer[0], 2 * e.nvectors * sizeof(double), &offset);
+    }
+    stats_count("tracks");
+  }
+
+  stats_phase("toc");
+  h.tocOffset = offset;
+  ok = ok && (!numFiles || pack_write(fd, &toc[0], numFiles * sizeof(pack_entry_t), &offset)) &&
+    pwrite(fd, &h, sizeof(h), 0) == (ssize_t) sizeof(h) && fsync(fd) == 0;
+  ok = (close(fd) == 0) && ok;
+  if(!ok || rename(tmpName, path)) {
+    unlink(tmpName);
+    error("failed to write pack file", path, "write");
+  }
+  stats_phase(NULL);
+
+  VERB_LOG(0, "%s %s %u tracks %ju bytes.\n", COM_PACK, dbName, numFiles, (uintmax_t) offset);
+  delete[] tmpName;
+  delete[] path;
+}
+
+// Map the database's pack, if it has one; packBase stays null if not
+void audioDB::pack_open() {
+  if(packBase || packChecked)
+    return;
+  packChecked = true;
+  if(!(dbH->flags & O2_FLAG_LARGE_ADB))
+    return;
+  char *path = pack_path(dbName);
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(pack_header_t)) {
+    if(fd >= 0)
+      close(fd);
+    delete[] path;
+    return;
+  }
+  // the descriptor is kept for audiodb_read_data(), when indexing
+  void *m = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if(m == MAP_FAILED)
+    error("mmap error for pack file", path, "mmap");
+  madvise(m, st.st_size, tableAdvice == MADV_NORMAL ? MADV_SEQUENTIAL : tableAdvice);
+
+  const pack_header_t *h = (const pack_header_t *) m;
+  uint64_t size = st.st_size;
+  if(h->magic == O2_PACK_MAGIC_V1) {
+    munmap(m, st.st_size);
+    error("pack file from an earlier version: run --PACK again", path);
+  }
+  if(h->magic != O2_PACK_MAGIC || h->dim != dbH->dim || h->tocOffset % sizeof(double) ||
+     h->tocOffset > size || (size - h->tocOffset) / sizeof(pack_entry_t) < h->ntracks) {
+    munmap(m, st.st_size);
+    error("malformed pack file", path);
+  }
+  VERB_LOG(1, "reading %u tracks from %s\n", h->ntracks, path);
+  packBase = (char *) m;
+  packLength = st.st_size;
+  packfd = fd;
+  delete[] path;
+}
+
+// Track trackID's features (which 0), power (1) or times (2) from the
+// pack, or null if they are to be read from its files: if the pack has
+// none, or the file they were copied from has since changed
+const double *audioDB::pack_track(Uns32T trackID, int which) {
+  pack_open();
+  if(!packBase)
+    return 0;
+  const pack_header_t *h = (const pack_header_t *) packBase;
+  if(trackID >= h->ntracks)
+    return 0;
+  const pack_entry_t *e = (const pack_entry_t *) (packBase + h->tocOffset) + trackID;
+  if(e->nvectors != trackTable[trackID])
+    return 0;
+  const pack_file_t *f;
+  const char *table;
+  uint64_t n = (uint64_t) e->nvectors * sizeof(double);
+  if(which == 0) {
+    f = &e->data;
+    table = featureFileNameTable;
+    n *= h->dim;
+  } else if(which == 1 && (h->flags & O2_FLAG_POWER)) {
+    f = &e->power;
+    table = powerFileNameTable;
+  } else if(which == 2 && (h->flags & O2_FLAG_TIMES)) {
+    f = &e->times;
+    table = timesFileNameTable;
+    n *= 2;
+  } else {
+    return 0;
+  }
+  char path[O2_MAXFILESTR];
+  struct stat st;
+  track_file_path(trackID, table, path);
+  if(stat(path, &st) == 0 && ((uint64_t) st.st_size != f->size || (int64_t) st.st_mtime != f->mtime)) {
+    stats_count("stale packed tracks");
+    return 0;
+  }
+  uint64_t at = f->offset;
+  if(at % sizeof(double) || at > h->tocOffset || n > h->tocOffset - at)
+    error("malformed pack file entry", audiodb_index_key(adb, trackID));
+  stats_count("packed tracks read");
+  return (const double *) (packBase + at);
+}
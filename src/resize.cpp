@@ -0,0 +1,195 @@
+// Database growth
+//
+// --RESIZE enlarges a database's capacity, given by --datasize (in MB)
+// and --ntracks as for --NEW, without replaying its inserts.  The
+// database file is laid out as the header, then the file, track, data,
+// times, power and l2norm tables, each sized from the capacity; the
+// new layout is computed the same way, and each table's used part is
+// copied to its new offset.  By default the database is copied,
+// table by table, into a new file which then replaces it, so that an
+// interrupted resize leaves the database as it was; with
+// --resize_in_place the tables are moved within the file itself, last
+// table first, and only the tables whose offsets change are touched.
+// The header, with the new offsets, is written last; but a table whose
+// new place overlaps its old one is overwritten as it is moved, so an
+// in-place resize is not safe against interruption, and a database
+// that matters should be backed up first (or resized by copying).
+//
+// Tracks keep their indices and positions, so LSH indexes, which
+// address points by track and position, remain valid, as does the key
+// hash.  Tables may only grow.
+
+#include "audioDB.h"
+
+#include <algorithm>
+
+#define O2_RESIZE_BUFFER (8U << 20)
+
+typedef struct {
+  off_t from;
+  off_t to;
+  off_t used;
+} resize_table_t;
+
+// Copy count bytes at offset from in fd to offset to in tofd.  Within
+// one file the destination is never before the source, so the copy
+// runs backwards in case the ranges overlap.
+void audioDB::resize_copy(int fd, off_t from, int tofd, off_t to, off_t count) {
+  std::vector<char> buffer(O2_RESIZE_BUFFER);
+  bool backwards = (fd == tofd && to > from);
+  off_t done = 0;
+  while(done < count) {
+    size_t n = (size_t) std::min((off_t) O2_RESIZE_BUFFER, count - done);
+    off_t at = backwards ? count - done - n : done;
+    if(pread(fd, &buffer[0], n, from + at) != (ssize_t) n)
+      error("read error while resizing database", dbName, "pread");
+    if(pwrite(tofd, &buffer[0], n, to + at) != (ssize_t) n)
+      error("write error while resizing database", dbName, "pwrite");
+    done += n;
+  }
+}
+
+// Offsets of the file, track, data, times, power and l2norm tables of
+// the database with header h, followed by the end of the database, and
+// the number of bytes in use in each table
+void audioDB::table_extents(const adb_header_t *h, off_t *offsets, off_t *used) {
+  bool large = h->flags & O2_FLAG_LARGE_ADB;
+  off_t perVector = large || !h->dim ? 0 : h->length / h->dim;
+  off_t perTrack = (off_t) O2_FILETABLE_ENTRY_SIZE * h->numFiles;
+  offsets[0] = h->fileTableOffset;
+  offsets[1] = h->trackTableOffset;
+  offsets[2] = h->dataOffset;
+  offsets[3] = h->timesTableOffset;
+  offsets[4] = h->powerTableOffset;
+  offsets[5] = h->l2normTableOffset;
+  offsets[6] = h->dbSize;
+  used[0] = perTrack;
+  used[1] = (off_t) O2_TRACKTABLE_ENTRY_SIZE * h->numFiles;
+  used[2] = large ? perTrack : h->length;
+  used[3] = large ? perTrack : 2 * perVector;
+  used[4] = large ? perTrack : perVector;
+  used[5] = large ? 0 : perVector;
+  for(int k = 0; k < 6; k++)
+    used[k] = std::min(used[k], offsets[k + 1] - offsets[k]);
+}
+
+void audioDB::resize(const char *dbName) {
+  stats_phase("open");
+  if(!(adb = audiodb_open(dbName, O_RDWR)))
+    error("failed to open database", dbName);
+  // times released by --COMPACT are expanded, to be moved with the
+  // rest; --COMPACT may be run again afterwards
+  times_expand(dbName, adb);
+  adb_header_t h = *adb->header;
+  audiodb_close(adb);
+  adb = NULL;
+
+  bool large = h.flags & O2_FLAG_LARGE_ADB;
+  if(!large && !h.dim)
+    error("an empty database can be created again with --NEW at the new size", dbName);
+  off_t oldTracks = (h.trackTableOffset - h.fileTableOffset) / O2_FILETABLE_ENTRY_SIZE;
+  off_t tracks = args_info.ntracks_given ? (off_t) ntracks : oldTracks;
+  if(tracks < oldTracks)
+    error("--RESIZE cannot reduce the number of tracks", dbName);
+  if(tracks > O2_MAXFILES)
+    error("--ntracks exceeds the maximum number of tracks", dbName);
+  off_t oldData = h.timesTableOffset - h.dataOffset;
+  off_t data = args_info.datasize_given ? (off_t) datasize * 1024 * 1024 : oldData;
+  if(!large && data < oldData)
+    error("--RESIZE cannot reduce the data size", dbName);
+  if(large && args_info.datasize_given)
+    VERB_LOG(1, "--datasize ignored: features of a LARGE_ADB database are kept in their own files\n");
+
+  // sizes of the file, track, data, times, power and l2norm tables,
+  // never smaller than they were
+  off_t oldOffsets[7], used[6];
+  table_extents(&h, oldOffsets, used);
+  off_t sizes[6];
+  sizes[0] = O2_FILETABLE_ENTRY_SIZE * tracks;
+  sizes[1] = O2_TRACKTABLE_ENTRY_SIZE * tracks;
+  if(large) {
+    sizes[2] = sizes[3] = sizes[4] = O2_FILETABLE_ENTRY_SIZE * tracks;
+    sizes[5] = h.dbSize > h.l2normTableOffset ? O2_FILETABLE_ENTRY_SIZE * tracks : 0;
+  } else {
+    sizes[2] = data;
+    sizes[3] = 2 * (data / h.dim);
+    sizes[4] = sizes[5] = data / h.dim;
+  }
+  off_t offsets[7];
+  offsets[0] = h.fileTableOffset;
+  for(int k = 0; k < 6; k++) {
+    sizes[k] = std::max(sizes[k], oldOffsets[k + 1] - oldOffsets[k]);
+    offsets[k + 1] = ALIGN_PAGE_UP(offsets[k] + sizes[k]);
+  }
+
+  resize_table_t tables[6];
+  for(int k = 0; k < 6; k++) {
+    tables[k].from = oldOffsets[k];
+    tables[k].to = offsets[k];
+    tables[k].used = used[k];
+  }
+
+  adb_header_t resized = h;
+  resized.trackTableOffset = offsets[1];
+  resized.dataOffset = offsets[2];
+  resized.timesTableOffset = offsets[3];
+  resized.powerTableOffset = offsets[4];
+  resized.l2normTableOffset = offsets[5];
+  resized.dbSize = offsets[6];
+
+  int fd = open(dbName, O_RDWR);
+  if(fd < 0)
+    error("failed to open database", dbName, "open");
+
+  if(args_info.resize_in_place_flag) {
+    stats_phase("move");
+    if(ftruncate(fd, resized.dbSize))
+      error("failed to grow database file", dbName, "ftruncate");
+    for(int k = 5; k > 0; k--) {
+      resize_table_t &t = tables[k];
+      if(t.to == t.from || !t.used)
+        continue;
+      VERB_LOG(1, "moving table %d: %ju bytes from %ju to %ju\n", k, (uintmax_t) t.used, (uintmax_t) t.from, (uintmax_t) t.to);
+      // what is left behind, in free space of the tables before it, is
+      // not cleared: until the header is written it is the table
+      resize_copy(fd, t.from, fd, t.to, t.used);
+    }
+    stats_phase("header");
+    if(fsync(fd) ||
+       pwrite(fd, &resized, sizeof(resized), 0) != (ssize_t) sizeof(resized) ||
+       fsync(fd))
+      error("failed to write database header", dbName, "pwrite");
+    close(fd);
+  } else {
+    stats_phase("copy");
+    char *tmpName = new char[strlen(dbName) + 32];
+    sprintf(tmpName, "%s.resize.%d", dbName, (int) getpid());
+    struct stat st;
+    if(fstat(fd, &st))
+      error("fstat error finding mode of database", dbName, "fstat");
+    int tofd = open(tmpName, O_RDWR | O_CREAT | O_EXCL, st.st_mode & 0777);
+    if(tofd < 0)
+      error("failed to create resized database", tmpName, "open");
+    // unused space is left as holes
+    if(ftruncate(tofd, resized.dbSize))
+      error("failed to size resized database", tmpName, "ftruncate");
+    resize_copy(fd, 0, tofd, 0, h.fileTableOffset);
+    for(int k = 0; k < 6; k++)
+      resize_copy(fd, tables[k].from, tofd, tables[k].to, tables[k].used);
+    stats_phase("header");
+    if(pwrite(tofd, &resized, sizeof(resized), 0) != (ssize_t) sizeof(resized) || fsync(tofd))
+      error("failed to write database header", tmpName, "pwrite");
+    close(tofd);
+    close(fd);
+    if(rename(tmpName, dbName)) {
+      unlink(tmpName);
+      error("failed to replace database", dbName, "rename");
+    }
+    delete[] tmpName;
+  }
+  stats_phase(NULL);
+
+  VERB_LOG(0, "%s %s %ju tracks %ju bytes of data.\n", COM_RESIZE, dbName, (uintmax_t) tracks,
+           (uintmax_t) (large ? 0 : offsets[3] - offsets[2]));
+  status(dbName);
+}
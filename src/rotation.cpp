@@ -0,0 +1,49 @@
+// Rotation-invariant LSH
+//
+// --INDEX --rotation-invariant hashes, in place of each shingle, the
+// magnitudes of the discrete Fourier transform of each of its vectors,
+// taken across the dimensions and scaled by 1/sqrt(dim) so that their
+// norm is the vector's.  Rotating a vector (as --rotate does, by the
+// same amount for every vector of a sequence) changes only the phases
+// of its transform, so every rotation of a shingle has the same
+// projection; and the magnitudes of two transforms differ by no more
+// than the transforms do, so the distance between the projections of
+// two shingles is at most their distance at any rotation.  The
+// candidates an index of projections gives for a query therefore cover
+// those of all of its rotations, and --rotate radius queries take them
+// from a single lookup, evaluating each exactly at every rotation and
+// keeping the best (lshexact.cpp).
+//
+// The index is kept alongside the others, as
+// dbName.lsh.${radius}.${sequenceLength}.rot
+
+#include "audioDB.h"
+
+// Replace each vector of each shingle by its transform's magnitudes
+void audioDB::rotation_project_shingles(std::vector<std::vector<float> > *vv, Uns32T d) {
+  std::vector<double> c((size_t) d * d), s((size_t) d * d);
+  for(Uns32T k = 0; k < d; k++) {
+    for(Uns32T j = 0; j < d; j++) {
+      double a = 2 * M_PI * ((k * j) % d) / d;
+      c[k * d + j] = cos(a);
+      s[k * d + j] = sin(a);
+    }
+  }
+  double scale = 1 / sqrt((double) d);
+  std::vector<double> x(d);
+  for(size_t i = 0; i < vv->size(); i++) {
+    std::vector<float> &v = (*vv)[i];
+    for(size_t f = 0; f + d <= v.size(); f += d) {
+      for(Uns32T j = 0; j < d; j++)
+        x[j] = v[f + j];
+      for(Uns32T k = 0; k < d; k++) {
+        double re = 0, im = 0;
+        for(Uns32T j = 0; j < d; j++) {
+          re += x[j] * c[k * d + j];
+          im -= x[j] * s[k * d + j];
+        }
+        v[f + k] = scale * sqrt(re * re + im * im);
+      }
+    }
+  }
+}
@@ -0,0 +1,201 @@
+// Federated queries
+//
+// A query may be run against several databases (shards) at once: -d
+// given more than once, or -d @manifest, where the manifest names the
+// databases one per line (blank lines and lines starting with # are
+// ignored).  gengetopt splits the values of a repeated option at
+// commas, so a database whose name has one is given with it escaped
+// (-d 'a\,b'); and only --QUERY reads manifests, so other commands
+// take a name starting with @ as it is.  Tracks are
+// numbered consecutively across the shards, in the order given, and
+// every shard's results go to the one reporter, which therefore merges
+// them exactly as it would the results of a single database.  When
+// reporting, a key present in more than one shard is qualified by the
+// name of the shard it came from; and a -k query leaves out only the
+// track it was taken from, not those of the same key in other shards.
+//
+// The shards are queried through the library by a pool of --threads
+// threads, each shard with its own handle; the results are passed to
+// the reporter once all the shards have finished.
+
+#include "audioDB.h"
+
+#include <algorithm>
+#include <pthread.h>
+
+typedef struct {
+  std::vector<Shard> *shards;
+  const adb_query_spec_t *qspec;
+  const Uns32T *bitmap;
+  unsigned keyShard;
+  std::vector<adb_query_results_t *> results;
+  std::vector<char> failed;
+  unsigned next;
+  pthread_mutex_t lock;
+} ShardWork;
+
+static void *shards_worker(void *arg) {
+  ShardWork *w = (ShardWork *) arg;
+  for(;;) {
+    pthread_mutex_lock(&w->lock);
+    unsigned k = w->next++;
+    pthread_mutex_unlock(&w->lock);
+    if(k >= w->shards->size())
+      return NULL;
+
+    Shard &s = (*w->shards)[k];
+    adb_query_spec_t spec = *w->qspec;
+    if(k != w->keyShard)
+      spec.refine.flags &= ~ADB_REFINE_EXCLUDE_KEYLIST;
+    std::vector<const char *> keys;
+    if(spec.refine.flags & ADB_REFINE_INCLUDE_KEYLIST) {
+      // this shard's part of the keyList
+      for(Uns32T i = 0; i < s.numFiles; i++) {
+        Uns32T t = s.base + i;
+        if(w->bitmap[t >> 5] & (1U << (t & 31)))
+          keys.push_back(audiodb_index_key(s.adb, i));
+      }
+      if(keys.empty())
+        continue;
+      spec.refine.include.nkeys = keys.size();
+      spec.refine.include.keys = &keys[0];
+    }
+    w->results[k] = audiodb_query_spec(s.adb, &spec);
+    if(!w->results[k])
+      w->failed[k] = 1;
+  }
+}
+
+// Build the list of shards from the -d arguments
+void audioDB::shards_init() {
+  if(!O2_ACTION(COM_QUERY))
+    error("several databases may only be given to --QUERY");
+
+  std::vector<char *> names;
+  for(unsigned i = 0; i < databaseNames.size(); i++) {
+    const char *arg = databaseNames[i];
+    if(arg[0] != '@') {
+      names.push_back(strdup(arg));
+      continue;
+    }
+    std::ifstream manifest(arg + 1);
+    if(!manifest.is_open())
+      error("Could not open shard manifest", arg + 1);
+    std::string line;
+    while(std::getline(manifest, line)) {
+      size_t start = line.find_first_not_of(" \t\r");
+      if(start == std::string::npos || line[start] == '#')
+        continue;
+      size_t end = line.find_last_not_of(" \t\r");
+      names.push_back(strdup(line.substr(start, end - start + 1).c_str()));
+    }
+  }
+  if(names.empty())
+    error("no databases given", databaseNames[0]);
+
+  for(unsigned k = 0; k < names.size(); k++) {
+    if(adb_root) {
+      char *name = names[k];
+      prefix_name(&names[k], adb_root);
+      if(names[k] != name)
+        free(name);
+    }
+    Shard s;
+    s.name = names[k];
+    s.adb = NULL;
+    s.base = 0;
+    s.numFiles = 0;
+    shards.push_back(s);
+  }
+  shardNames = names;
+  dbName = shards[0].name;
+  // a manifest naming a single database is an ordinary query
+  if(shards.size() == 1)
+    shards.clear();
+}
+
+// Open every shard, numbering their tracks consecutively
+void audioDB::shards_open() {
+  Uns32T base = 0;
+  uint32_t dim = 0;
+  for(unsigned k = 0; k < shards.size(); k++) {
+    if(!(shards[k].adb = audiodb_open(shards[k].name, O_RDONLY)))
+      error("failed to open database", shards[k].name);
+    adb_status_t status;
+    if(audiodb_status(shards[k].adb, &status))
+      error("Failed to retrieve database status", shards[k].name);
+    if(k == 0)
+      dim = status.dim;
+    else if(status.dim != dim && status.numFiles)
+      error("database dimension differs from the first database", shards[k].name);
+    if(base + status.numFiles < base)
+      error("too many tracks across databases", shards[k].name);
+    shards[k].base = base;
+    shards[k].numFiles = status.numFiles;
+    base += status.numFiles;
+  }
+  adb = shards[0].adb;
+}
+
+Uns32T audioDB::shards_numFiles() {
+  return shards.back().base + shards.back().numFiles;
+}
+
+void audioDB::shards_query(adb_query_spec_t *qspec) {
+  adb_datum_t *datum = qspec->qid.datum;
+
+  // a key query uses the datum of the first shard with that key, and
+  // is then a feature query against every shard, leaving the key out
+  // only in that shard
+  unsigned keyShard = shards.size();
+  if(query_from_key) {
+    for(keyShard = 0; keyShard < shards.size(); keyShard++)
+      if(audiodb_key_index(shards[keyShard].adb, key) != (uint32_t) -1)
+        break;
+    if(keyShard == shards.size())
+      error("key not found in any database", key);
+    if(audiodb_retrieve_datum(shards[keyShard].adb, key, datum))
+      error("failed to retrieve query datum", key);
+    datum->key = NULL;
+  }
+
+  for(unsigned k = 0; k < shards.size(); k++)
+    advise_library(shards[k].adb);
+
+  ShardWork w;
+  w.shards = &shards;
+  w.qspec = qspec;
+  w.bitmap = keylistBitmap;
+  w.keyShard = keyShard;
+  w.results.assign(shards.size(), (adb_query_results_t *) NULL);
+  w.failed.assign(shards.size(), 0);
+  w.next = 0;
+  pthread_mutex_init(&w.lock, NULL);
+
+  unsigned nthreads = threads;
+  if(nthreads > shards.size())
+    nthreads = shards.size();
+  std::vector<pthread_t> threads(nthreads);
+  for(unsigned t = 0; t < nthreads; t++)
+    if(pthread_create(&threads[t], NULL, shards_worker, &w))
+      error("failed to start query thread", "", "pthread_create");
+  for(unsigned t = 0; t < nthreads; t++)
+    pthread_join(threads[t], NULL);
+  pthread_mutex_destroy(&w.lock);
+
+  stats_phase("reporter");
+  for(unsigned k = 0; k < shards.size(); k++) {
+    if(w.failed[k])
+      error("audiodb_query_spec failed", shards[k].name);
+    adb_query_results_t *rs = w.results[k];
+    if(!rs)
+      continue;
+    VERB_LOG(1, "%s: %u results\n", shards[k].name, rs->nresults);
+    stats_count("results", rs->nresults);
+    for(unsigned int i = 0; i < rs->nresults; i++) {
+      adb_result_t r = rs->results[i];
+      reporter->add_point(shards[k].base + audiodb_key_index(shards[k].adb, r.ikey), r.qpos, r.ipos, r.dist);
+    }
+    audiodb_query_free_results(shards[k].adb, qspec, rs);
+  }
+}
@@ -0,0 +1,280 @@
+// Binary snapshots
+//
+// --DUMP --snapshot writes the database as it is on disk, rather than
+// as feature, times and power files per track: the header and the
+// used part of every table, streamed in file order and split into
+// --chunks files of roughly equal size, which are written by a pool of
+// threads.  The file "snapshot" in the output directory, written last,
+// lists the database ranges saved and the length and checksum of each
+// chunk.  --RESTORE rebuilds a database from a snapshot directory, a
+// thread per chunk writing its ranges into place and checking its
+// checksum; the unused parts of the tables are left as holes, so the
+// restored database is identical, byte for byte, to the original.
+
+#include "audioDB.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <algorithm>
+
+#define O2_SNAPSHOT_BUFFER (8U << 20)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t nchunks;
+  uint32_t nranges;
+  uint32_t pad;
+  uint64_t dbSize;
+  uint64_t total;
+} snapshot_header_t;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t length;
+} snapshot_range_t;
+
+typedef struct {
+  uint64_t length;
+  uint64_t checksum;
+} snapshot_chunk_t;
+
+typedef struct {
+  int dbfd;
+  const char *dir;
+  bool restore;
+  std::vector<snapshot_range_t> *ranges;
+  std::vector<snapshot_chunk_t> *chunks;
+  std::vector<char> failed;
+  unsigned next;
+  pthread_mutex_t lock;
+} SnapshotWork;
+
+static std::string snapshot_name(const char *dir, const char *name) {
+  return std::string(dir) + "/" + name;
+}
+
+static std::string snapshot_chunk_name(const char *dir, unsigned k) {
+  char name[32];
+  snprintf(name, sizeof(name), "snapshot.%03u", k);
+  return snapshot_name(dir, name);
+}
+
+static uint64_t snapshot_checksum(uint64_t h, const char *p, size_t n) {
+  for(size_t i = 0; i < n; i++) {
+    h ^= (unsigned char) p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Copy one chunk between its file and the database: the chunk holds
+// bytes [start, start + length) of the concatenated ranges
+static bool snapshot_chunk(SnapshotWork *w, unsigned k, std::vector<char> &buffer) {
+  uint64_t start = 0;
+  for(unsigned j = 0; j < k; j++)
+    start += (*w->chunks)[j].length;
+  uint64_t length = (*w->chunks)[k].length;
+
+  std::string name = snapshot_chunk_name(w->dir, k);
+  int fd = w->restore ? open(name.c_str(), O_RDONLY) : open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(fd < 0)
+    return false;
+  if(w->restore)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  uint64_t checksum = 14695981039346656037ULL;
+  uint64_t base = 0;
+  bool ok = true;
+  for(unsigned r = 0; ok && r < w->ranges->size() && length; r++) {
+    const snapshot_range_t &range = (*w->ranges)[r];
+    if(base + range.length <= start) {
+      base += range.length;
+      continue;
+    }
+    uint64_t skip = start > base ? start - base : 0;
+    uint64_t n = std::min(range.length - skip, length);
+    off_t at = range.offset + skip;
+    while(ok && n) {
+      size_t m = (size_t) std::min(n, (uint64_t) buffer.size());
+      if(w->restore) {
+        ok = read(fd, &buffer[0], m) == (ssize_t) m &&
+          pwrite(w->dbfd, &buffer[0], m, at) == (ssize_t) m;
+      } else {
+        ok = pread(w->dbfd, &buffer[0], m, at) == (ssize_t) m &&
+          write(fd, &buffer[0], m) == (ssize_t) m;
+      }
+      checksum = snapshot_checksum(checksum, &buffer[0], m);
+      at += m;
+      n -= m;
+      length -= m;
+      start += m;
+    }
+    base += range.length;
+  }
+  if(!w->restore)
+    ok = ok && fsync(fd) == 0;
+  ok = (close(fd) == 0) && ok;
+  if(w->restore)
+    return ok && checksum == (*w->chunks)[k].checksum;
+  (*w->chunks)[k].checksum = checksum;
+  return ok;
+}
+
+static void *snapshot_worker(void *arg) {
+  SnapshotWork *w = (SnapshotWork *) arg;
+  std::vector<char> buffer(O2_SNAPSHOT_BUFFER);
+  for(;;) {
+    pthread_mutex_lock(&w->lock);
+    unsigned k = w->next++;
+    pthread_mutex_unlock(&w->lock);
+    if(k >= w->chunks->size())
+      return NULL;
+    if(!snapshot_chunk(w, k, buffer))
+      w->failed[k] = 1;
+  }
+}
+
+static void snapshot_run(SnapshotWork *w) {
+  w->failed.assign(w->chunks->size(), 0);
+  w->next = 0;
+  pthread_mutex_init(&w->lock, NULL);
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned nthreads = ncpu > 0 ? (unsigned) ncpu : 1;
+  if(nthreads > w->chunks->size())
+    nthreads = w->chunks->size();
+  std::vector<pthread_t> threads(nthreads);
+  unsigned started = 0;
+  for(; started < nthreads; started++)
+    if(pthread_create(&threads[started], NULL, snapshot_worker, w))
+      break;
+  // should no thread start, work in this one
+  if(!started)
+    snapshot_worker(w);
+  for(unsigned t = 0; t < started; t++)
+    pthread_join(threads[t], NULL);
+  pthread_mutex_destroy(&w->lock);
+}
+
+void audioDB::snapshot_dump(const char *dbName, const char *dir, unsigned nchunks) {
+  stats_phase("open");
+  off_t offsets[7], used[6];
+  table_extents(adb->header, offsets, used);
+  std::vector<snapshot_range_t> ranges;
+  snapshot_range_t header = {0, (uint64_t) offsets[0]};
+  ranges.push_back(header);
+  for(int k = 0; k < 6; k++) {
+    if(!used[k])
+      continue;
+    snapshot_range_t r = {(uint64_t) offsets[k], (uint64_t) used[k]};
+    ranges.push_back(r);
+  }
+  uint64_t total = 0;
+  for(unsigned r = 0; r < ranges.size(); r++)
+    total += ranges[r].length;
+  if(nchunks < 1)
+    nchunks = 1;
+  if(nchunks > total)
+    nchunks = total;
+
+  std::vector<snapshot_chunk_t> chunks(nchunks);
+  for(unsigned k = 0; k < nchunks; k++) {
+    chunks[k].length = total / nchunks + (k < total % nchunks ? 1 : 0);
+    chunks[k].checksum = 0;
+  }
+
+  if(mkdir(dir, 0777) && errno != EEXIST)
+    error("failed to create snapshot directory", dir, "mkdir");
+  std::string indexName = snapshot_name(dir, "snapshot");
+  if(access(indexName.c_str(), F_OK) == 0)
+    error("snapshot already exists", indexName.c_str());
+
+  SnapshotWork w;
+  w.dbfd = open(dbName, O_RDONLY);
+  if(w.dbfd < 0)
+    error("failed to open database", dbName, "open");
+  posix_fadvise(w.dbfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  w.dir = dir;
+  w.restore = false;
+  w.ranges = &ranges;
+  w.chunks = &chunks;
+  stats_phase("write");
+  snapshot_run(&w);
+  close(w.dbfd);
+  for(unsigned k = 0; k < nchunks; k++)
+    if(w.failed[k])
+      error("failed to write snapshot chunk", snapshot_chunk_name(dir, k).c_str());
+
+  stats_phase("index");
+  snapshot_header_t h = {O2_SNAPSHOT_MAGIC, nchunks, (uint32_t) ranges.size(), 0, (uint64_t) offsets[6], total};
+  int fd = open(indexName.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if(fd < 0)
+    error("failed to create snapshot", indexName.c_str(), "open");
+  bool ok = write(fd, &h, sizeof(h)) == (ssize_t) sizeof(h) &&
+    write(fd, &ranges[0], ranges.size() * sizeof(snapshot_range_t)) == (ssize_t) (ranges.size() * sizeof(snapshot_range_t)) &&
+    write(fd, &chunks[0], nchunks * sizeof(snapshot_chunk_t)) == (ssize_t) (nchunks * sizeof(snapshot_chunk_t)) &&
+    fsync(fd) == 0;
+  ok = (close(fd) == 0) && ok;
+  if(!ok) {
+    unlink(indexName.c_str());
+    error("failed to write snapshot", indexName.c_str(), "write");
+  }
+  stats_phase(NULL);
+  VERB_LOG(0, "%s %s %ju bytes in %u chunks.\n", COM_DUMP, dir, (uintmax_t) total, nchunks);
+}
+
+void audioDB::snapshot_restore(const char *dbName, const char *dir) {
+  stats_phase("index");
+  std::string indexName = snapshot_name(dir, "snapshot");
+  int fd = open(indexName.c_str(), O_RDONLY);
+  if(fd < 0)
+    error("failed to open snapshot", indexName.c_str(), "open");
+  snapshot_header_t h;
+  if(read(fd, &h, sizeof(h)) != (ssize_t) sizeof(h) || h.magic != O2_SNAPSHOT_MAGIC ||
+     !h.nchunks || !h.nranges || h.nranges > 8)
+    error("malformed snapshot", indexName.c_str());
+  std::vector<snapshot_range_t> ranges(h.nranges);
+  std::vector<snapshot_chunk_t> chunks(h.nchunks);
+  if(read(fd, &ranges[0], h.nranges * sizeof(snapshot_range_t)) != (ssize_t) (h.nranges * sizeof(snapshot_range_t)) ||
+     read(fd, &chunks[0], h.nchunks * sizeof(snapshot_chunk_t)) != (ssize_t) (h.nchunks * sizeof(snapshot_chunk_t)))
+    error("short read of snapshot", indexName.c_str());
+  close(fd);
+  uint64_t total = 0;
+  for(unsigned r = 0; r < h.nranges; r++) {
+    if(ranges[r].offset > h.dbSize || ranges[r].length > h.dbSize - ranges[r].offset)
+      error("malformed snapshot", indexName.c_str());
+    total += ranges[r].length;
+  }
+  for(unsigned k = 0; k < h.nchunks; k++)
+    total -= chunks[k].length;
+  if(total)
+    error("malformed snapshot", indexName.c_str());
+
+  SnapshotWork w;
+  w.dbfd = open(dbName, O_RDWR | O_CREAT | O_EXCL, 0666);
+  if(w.dbfd < 0)
+    error("failed to create database", dbName, "open");
+  if(ftruncate(w.dbfd, h.dbSize)) {
+    unlink(dbName);
+    error("failed to size database", dbName, "ftruncate");
+  }
+  w.dir = dir;
+  w.restore = true;
+  w.ranges = &ranges;
+  w.chunks = &chunks;
+  stats_phase("write");
+  snapshot_run(&w);
+  bool ok = fsync(w.dbfd) == 0;
+  close(w.dbfd);
+  for(unsigned k = 0; k < h.nchunks; k++) {
+    if(w.failed[k]) {
+      unlink(dbName);
+      error("failed to restore snapshot chunk (missing, short or corrupt)", snapshot_chunk_name(dir, k).c_str());
+    }
+  }
+  if(!ok) {
+    unlink(dbName);
+    error("failed to write database", dbName, "fsync");
+  }
+  stats_phase(NULL);
+  status(dbName);
+}
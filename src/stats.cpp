@@ -0,0 +1,93 @@
+// Profiling
+//
+// --stats times the phases of a command, by wall clock and by CPU time
+// (from getrusage(), so including every thread), and counts events
+// along the way.  When the command finishes a JSON object holding the
+// phases, the counters and the process's peak resident set size is
+// printed on stderr, leaving the command's own output untouched.
+//
+// A phase runs from one stats_phase() call to the next; phases
+// entered more than once accumulate.  Counters are kept in the order
+// they are first incremented, and may be incremented by any thread.
+
+#include "audioDB.h"
+
+#include <pthread.h>
+#include <sys/resource.h>
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double stats_now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static double stats_cpu() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+}
+
+// End the current phase, if any, and start the named one (none if
+// name is NULL)
+void audioDB::stats_phase(const char *name) {
+  if(!use_stats)
+    return;
+  double wall = stats_now(), cpu = stats_cpu();
+  if(statsCurrent >= 0) {
+    statsPhases[statsCurrent].wall += wall - statsWall;
+    statsPhases[statsCurrent].cpu += cpu - statsCpu;
+  }
+  statsCurrent = -1;
+  if(!name)
+    return;
+  for(unsigned k = 0; k < statsPhases.size(); k++)
+    if(!strcmp(statsPhases[k].name, name))
+      statsCurrent = k;
+  if(statsCurrent < 0) {
+    StatsPhase p = {name, 0, 0};
+    statsPhases.push_back(p);
+    statsCurrent = statsPhases.size() - 1;
+  }
+  statsWall = wall;
+  statsCpu = cpu;
+}
+
+void audioDB::stats_count(const char *name, unsigned long long n) {
+  if(!use_stats)
+    return;
+  pthread_mutex_lock(&stats_lock);
+  unsigned k = 0;
+  while(k < statsCounters.size() && strcmp(statsCounters[k].first, name))
+    k++;
+  if(k < statsCounters.size())
+    statsCounters[k].second += n;
+  else
+    statsCounters.push_back(std::make_pair(name, n));
+  pthread_mutex_unlock(&stats_lock);
+}
+
+void audioDB::stats_report() {
+  if(!use_stats)
+    return;
+  stats_phase(NULL);
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+
+  fprintf(stderr, "{\n  \"command\": \"%s\",\n  \"phases\": {", command);
+  for(unsigned k = 0; k < statsPhases.size(); k++)
+    fprintf(stderr, "%s\n    \"%s\": {\"wall\": %.6f, \"cpu\": %.6f}", k ? "," : "",
+            statsPhases[k].name, statsPhases[k].wall, statsPhases[k].cpu);
+  fprintf(stderr, "%s},\n  \"counters\": {", statsPhases.size() ? "\n  " : "");
+  for(unsigned k = 0; k < statsCounters.size(); k++)
+    fprintf(stderr, "%s\n    \"%s\": %llu", k ? "," : "", statsCounters[k].first, statsCounters[k].second);
+  // ru_maxrss is in kilobytes on Linux, bytes on Darwin
+#ifdef __APPLE__
+  long peak = ru.ru_maxrss / 1024;
+#else
+  long peak = ru.ru_maxrss;
+#endif
+  fprintf(stderr, "%s},\n  \"peak_rss_kb\": %ld\n}\n", statsCounters.size() ? "\n  " : "", peak);
+}
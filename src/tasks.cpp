@@ -0,0 +1,303 @@
+// Work-stealing scheduler
+//
+// Track lengths run from a few hundred vectors to hundreds of
+// thousands, so dealing the tracks out evenly between threads leaves
+// most of them idle while one works through a long recording.  The
+// work is cut into tasks instead: whole tracks, with long tracks split
+// into pieces of windows, each read with the sequenceLength-1 vectors
+// by which its last windows overlap the next piece.  Each thread starts
+// with a run of consecutive tasks in a deque of its own and takes them
+// from the front, in order; a thread whose deque is empty steals from
+// the back of the fullest other deque, the work furthest from its
+// owner.  A caller that holds the results of tasks finished out of
+// order until those before them have finished can bound them: a task
+// is then not started while it is more than a window of tasks ahead of
+// the oldest unfinished one, and a thread with none within the window
+// takes the oldest waiting task, wherever it is, or waits for the
+// oldest to finish.  --stats counts the tasks and the steals, and the time the
+// threads spent in tasks (busy) and waiting for the others to finish
+// (idle), whose ratio is their utilisation.
+
+#include "audioDB.h"
+
+#include <deque>
+#include <pthread.h>
+
+typedef struct {
+  std::deque<unsigned> tasks;
+  pthread_mutex_t lock;
+  double busy;
+  double finished;
+  unsigned long long steals;
+} TaskQueue;
+
+typedef struct {
+  const std::vector<Task> *tasks;
+  TaskFunction f;
+  void *arg;
+  std::vector<TaskQueue> queues;
+  // the window, if any, and the tasks finished, under lock
+  size_t window;
+  std::vector<char> finished;
+  size_t oldest;
+  pthread_mutex_t lock;
+  pthread_cond_t advanced;
+} TaskScheduler;
+
+typedef struct {
+  TaskScheduler *s;
+  unsigned thread;
+} TaskWorker;
+
+static double tasks_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Whether task index may start, being within the window
+static bool tasks_startable(TaskScheduler *s, unsigned index) {
+  if(!s->window)
+    return true;
+  pthread_mutex_lock(&s->lock);
+  bool startable = index < s->oldest + s->window;
+  pthread_mutex_unlock(&s->lock);
+  return startable;
+}
+
+// The oldest task waiting in any deque, if it may start; each deque
+// holds its tasks in order, so it is at the front of one of them
+static bool tasks_take_oldest(TaskScheduler *s, unsigned *index) {
+  for(;;) {
+    unsigned victim = 0;
+    bool any = false;
+    for(unsigned k = 0; k < s->queues.size(); k++) {
+      pthread_mutex_lock(&s->queues[k].lock);
+      if(!s->queues[k].tasks.empty() && (!any || s->queues[k].tasks.front() < *index)) {
+        *index = s->queues[k].tasks.front();
+        victim = k;
+        any = true;
+      }
+      pthread_mutex_unlock(&s->queues[k].lock);
+    }
+    if(!any || !tasks_startable(s, *index))
+      return false;
+    TaskQueue &q = s->queues[victim];
+    pthread_mutex_lock(&q.lock);
+    bool found = !q.tasks.empty() && q.tasks.front() == *index;
+    if(found)
+      q.tasks.pop_front();
+    pthread_mutex_unlock(&q.lock);
+    if(found)
+      return true;
+  }
+}
+
+// Whether any deque holds a task
+static bool tasks_waiting(TaskScheduler *s) {
+  for(unsigned k = 0; k < s->queues.size(); k++) {
+    pthread_mutex_lock(&s->queues[k].lock);
+    bool any = !s->queues[k].tasks.empty();
+    pthread_mutex_unlock(&s->queues[k].lock);
+    if(any)
+      return true;
+  }
+  return false;
+}
+
+// The next task for thread t, from its own deque or stolen, within the
+// window; false when every deque is empty, as tasks do not make more
+// tasks
+static bool tasks_take(TaskScheduler *s, unsigned t, unsigned *index) {
+  TaskQueue &own = s->queues[t];
+  for(;;) {
+    pthread_mutex_lock(&own.lock);
+    bool found = !own.tasks.empty() && tasks_startable(s, own.tasks.front());
+    if(found) {
+      *index = own.tasks.front();
+      own.tasks.pop_front();
+    }
+    pthread_mutex_unlock(&own.lock);
+    if(found)
+      return true;
+
+    unsigned victim = t;
+    size_t most = 0;
+    for(unsigned k = 0; k < s->queues.size(); k++) {
+      if(k == t)
+        continue;
+      pthread_mutex_lock(&s->queues[k].lock);
+      size_t n = s->queues[k].tasks.size();
+      pthread_mutex_unlock(&s->queues[k].lock);
+      if(n > most) {
+        most = n;
+        victim = k;
+      }
+    }
+    if(most) {
+      TaskQueue &q = s->queues[victim];
+      pthread_mutex_lock(&q.lock);
+      found = !q.tasks.empty() && tasks_startable(s, q.tasks.back());
+      if(found) {
+        *index = q.tasks.back();
+        q.tasks.pop_back();
+      }
+      pthread_mutex_unlock(&q.lock);
+      if(found) {
+        own.steals++;
+        return true;
+      }
+    }
+    if(!s->window) {
+      if(!most)
+        return false;
+      continue;
+    }
+
+    // nothing within the window at either end: the oldest task, or
+    // wait for the oldest running one to finish
+    if(tasks_take_oldest(s, index))
+      return true;
+    pthread_mutex_lock(&s->lock);
+    size_t oldest = s->oldest;
+    pthread_mutex_unlock(&s->lock);
+    if(!tasks_waiting(s))
+      return false;
+    pthread_mutex_lock(&s->lock);
+    while(s->oldest == oldest && s->oldest < s->finished.size())
+      pthread_cond_wait(&s->advanced, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+// Record that task index has finished
+static void tasks_finish(TaskScheduler *s, unsigned index) {
+  if(!s->window)
+    return;
+  pthread_mutex_lock(&s->lock);
+  s->finished[index] = 1;
+  if(index == s->oldest) {
+    while(s->oldest < s->finished.size() && s->finished[s->oldest])
+      s->oldest++;
+    pthread_cond_broadcast(&s->advanced);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void *tasks_worker(void *arg) {
+  TaskWorker *w = (TaskWorker *) arg;
+  TaskScheduler *s = w->s;
+  TaskQueue &own = s->queues[w->thread];
+  unsigned index;
+  while(tasks_take(s, w->thread, &index)) {
+    double start = tasks_now();
+    s->f(s->arg, index, &(*s->tasks)[index], w->thread);
+    own.busy += tasks_now() - start;
+    tasks_finish(s, index);
+  }
+  own.finished = tasks_now();
+  return NULL;
+}
+
+// The tasks covering the windows of length l of the tracks in include,
+// in track order.  With one thread each track is a task; with more,
+// tracks are cut into pieces of the windows each thread would have
+// O2_TASKS_PER_THREAD times over, but no more than maxGrain, rounded up
+// to a multiple of unit.
+void audioDB::tasks_split(const bool *include, Uns32T l, Uns32T unit, Uns32T maxGrain, std::vector<Task> &tasks) {
+  uint64_t total = 0;
+  for(Uns32T k = 0; k < dbH->numFiles; k++)
+    if(include[k] && trackTable[k] >= l)
+      total += trackTable[k] - l + 1;
+  uint64_t grain = ~(uint64_t) 0;
+  if(threads > 1) {
+    grain = total / ((uint64_t) threads * O2_TASKS_PER_THREAD) + 1;
+    if(grain > maxGrain)
+      grain = maxGrain;
+    grain = (grain + unit - 1) / unit * unit;
+  }
+  off_t vectorOffset = 0;
+  for(Uns32T k = 0; k < dbH->numFiles; k++) {
+    if(include[k] && trackTable[k] >= l) {
+      Uns32T nwin = trackTable[k] - l + 1;
+      for(uint64_t first = 0; first < nwin; first += grain) {
+        Task task = {k, vectorOffset, (Uns32T) first, (Uns32T) std::min(grain, nwin - first)};
+        tasks.push_back(task);
+      }
+    }
+    vectorOffset += trackTable[k];
+  }
+}
+
+// Run f on every task, on up to --threads threads, none starting more
+// than window tasks after the oldest unfinished one (unless window is 0)
+void audioDB::tasks_run(const std::vector<Task> &tasks, TaskFunction f, void *arg, size_t window) {
+  if(tasks.empty())
+    return;
+  unsigned nthreads = threads < tasks.size() ? threads : tasks.size();
+  TaskScheduler s;
+  s.tasks = &tasks;
+  s.f = f;
+  s.arg = arg;
+  s.queues.resize(nthreads);
+  s.window = nthreads > 1 ? window : 0;
+  if(s.window)
+    s.finished.assign(tasks.size(), 0);
+  s.oldest = 0;
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_cond_init(&s.advanced, NULL);
+  for(unsigned t = 0; t < nthreads; t++) {
+    TaskQueue &q = s.queues[t];
+    pthread_mutex_init(&q.lock, NULL);
+    q.busy = 0;
+    q.finished = 0;
+    q.steals = 0;
+    for(size_t k = t * tasks.size() / nthreads; k < (t + 1) * tasks.size() / nthreads; k++)
+      q.tasks.push_back(k);
+  }
+
+  std::vector<TaskWorker> workers(nthreads);
+  for(unsigned t = 0; t < nthreads; t++) {
+    workers[t].s = &s;
+    workers[t].thread = t;
+  }
+  double start = tasks_now();
+  if(nthreads == 1) {
+    tasks_worker(&workers[0]);
+  } else {
+    std::vector<pthread_t> ids(nthreads);
+    unsigned started = 0;
+    for(; started < nthreads; started++)
+      if(pthread_create(&ids[started], NULL, tasks_worker, &workers[started]))
+        break;
+    // should no thread start, work in this one; the threads that do
+    // start steal the tasks of those that did not
+    if(!started)
+      tasks_worker(&workers[0]);
+    for(unsigned t = 0; t < started; t++)
+      pthread_join(ids[t], NULL);
+    if(started < nthreads)
+      VERB_LOG(1, "started %u of %u threads\n", started ? started : 1, nthreads);
+  }
+  double end = tasks_now();
+
+  double busy = 0, idle = 0;
+  unsigned long long steals = 0;
+  for(unsigned t = 0; t < nthreads; t++) {
+    TaskQueue &q = s.queues[t];
+    if(q.finished) {
+      busy += q.busy;
+      idle += (end - start) - q.busy;
+    }
+    steals += q.steals;
+    pthread_mutex_destroy(&q.lock);
+  }
+  pthread_cond_destroy(&s.advanced);
+  pthread_mutex_destroy(&s.lock);
+  VERB_LOG(2, "%zu tasks on %u threads: %.0f%% utilisation, %llu steals\n", tasks.size(), nthreads,
+           busy + idle > 0 ? 100 * busy / (busy + idle) : 100.0, steals);
+  stats_count("tasks", tasks.size());
+  stats_count("steals", steals);
+  stats_count("thread_busy_us", (unsigned long long) (busy * 1e6));
+  stats_count("thread_idle_us", (unsigned long long) (idle * 1e6));
+}
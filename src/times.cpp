@@ -0,0 +1,395 @@
+// Compact times
+//
+// The times table of a database holds the start and end of every
+// vector, 16 bytes per vector, although almost every track's times lie
+// on a regular grid.  --COMPACT encodes each track as an onset, a hop
+// and a duration (vector i runs from onset + i * hop for duration, or
+// to the start of vector i + 1 when the vectors are contiguous), with
+// the vectors that do not fit the grid exactly kept verbatim in a list
+// of exceptions.  The encoding, in dbName.times, is lossless.  Once it
+// is written the times table's blocks are released from the database
+// file (which keeps its size and layout, so the library's offsets are
+// untouched) and from the page cache.
+//
+// A query refining by duration ratio (-t) keeps a track only if the
+// mean duration of its vectors is within the ratio of the query's.
+// Once a database's times are compacted that refinement is made here,
+// from the encoding, rather than by the library, which would read the
+// released table: the tracks whose durations are out of range are
+// removed from the query's include keylist, and the library is not
+// asked to refine.  --DUMP and --RESIZE, which copy the table as the
+// library reads it, first expand the encoded times back into the
+// database file, taking the table's space on disk again; the encoding
+// is kept, marked as expanded, and a later --COMPACT releases the
+// table again.
+
+#include "audioDB.h"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t numFiles;
+  uint32_t expanded;
+  uint32_t pad;
+  uint64_t nvectors;
+  uint64_t nexceptions;
+} times_header_t;
+
+#define O2_TIMES_CONTIGUOUS (0x1U)
+
+typedef struct {
+  double onset;
+  double hop;
+  double duration;
+  uint64_t vectorOffset;
+  uint64_t firstException;
+  uint32_t nvectors;
+  uint32_t nexceptions;
+  uint32_t flags;
+  uint32_t pad;
+} times_entry_t;
+
+typedef struct {
+  uint32_t index;
+  uint32_t pad;
+  double start;
+  double end;
+} times_exception_t;
+
+// The encoded times, as read from dbName.times
+struct times_encoding {
+  times_header_t h;
+  std::vector<times_entry_t> entries;
+  std::vector<times_exception_t> exceptions;
+};
+
+static double times_start(const times_entry_t *e, uint32_t i) {
+  return e->onset + i * e->hop;
+}
+
+static double times_end(const times_entry_t *e, uint32_t i) {
+  return (e->flags & O2_TIMES_CONTIGUOUS) ? times_start(e, i + 1) : times_start(e, i) + e->duration;
+}
+
+// The times of the track e, with its exceptions x, into t
+static void times_track(const times_entry_t *e, const times_exception_t *x, std::vector<double> &t) {
+  t.resize(2 * (size_t) e->nvectors + 1);
+  for(uint32_t i = 0; i < e->nvectors; i++) {
+    t[2 * i] = times_start(e, i);
+    t[2 * i + 1] = times_end(e, i);
+  }
+  for(uint32_t j = 0; j < e->nexceptions; j++) {
+    t[2 * x[j].index] = x[j].start;
+    t[2 * x[j].index + 1] = x[j].end;
+  }
+}
+
+// The mean duration of n vectors whose start and end times are t
+static double times_mean_duration(const double *t, uint32_t n) {
+  double sum = 0;
+  for(uint32_t i = 0; i < n; i++)
+    sum += t[2 * i + 1] - t[2 * i];
+  return sum / n;
+}
+
+// Number of vectors of the track's times t (start and end of each of
+// n vectors) that the grid e does not reproduce exactly
+static uint32_t times_misfits(const times_entry_t *e, const double *t, uint32_t n) {
+  uint32_t misfits = 0;
+  for(uint32_t i = 0; i < n; i++)
+    if(times_start(e, i) != t[2 * i] || times_end(e, i) != t[2 * i + 1])
+      misfits++;
+  return misfits;
+}
+
+char *audioDB::times_path(const char *name) {
+  char *path = new char[strlen(name) + 8];
+  sprintf(path, "%s.times", name);
+  return path;
+}
+
+void audioDB::times_compact(const char *dbName) {
+  if(!adb) {
+    if(!(adb = audiodb_open(dbName, O_RDWR))) {
+      error("failed to open database", dbName);
+    }
+  }
+  if(adb->header->flags & O2_FLAG_LARGE_ADB)
+    error("--COMPACT cannot encode the times of a database holding file names", dbName);
+  if(!(adb->header->flags & O2_FLAG_TIMES))
+    error("database has no times to compact", dbName);
+
+  // start from a complete times table
+  times_expand(dbName, adb);
+  forWrite = false;
+  initDBHeader(dbName, O2_TABLE_TRACK | O2_TABLE_TIMES);
+
+  Uns32T numFiles = dbH->numFiles;
+  std::vector<times_entry_t> entries(numFiles);
+  std::vector<times_exception_t> exceptions;
+  uint64_t offset = 0;
+  for(Uns32T k = 0; k < numFiles; k++) {
+    times_entry_t &e = entries[k];
+    uint32_t n = trackTable[k];
+    const double *t = timesTable + 2 * offset;
+    memset(&e, 0, sizeof(e));
+    e.vectorOffset = offset;
+    e.nvectors = n;
+    e.firstException = exceptions.size();
+    if(n) {
+      e.onset = t[0];
+      e.duration = t[1] - t[0];
+      e.flags = O2_TIMES_CONTIGUOUS;
+      for(uint32_t i = 0; i + 1 < n; i++)
+        if(t[2 * i + 1] != t[2 * i + 2])
+          e.flags = 0;
+      // the hop between the first two vectors, or the mean hop,
+      // whichever fits more of the track
+      e.hop = n > 1 ? t[2] - t[0] : e.duration;
+      uint32_t misfits = times_misfits(&e, t, n);
+      if(n > 2 && misfits) {
+        times_entry_t mean = e;
+        mean.hop = (t[2 * (n - 1)] - t[0]) / (n - 1);
+        uint32_t meanMisfits = times_misfits(&mean, t, n);
+        if(meanMisfits < misfits) {
+          e.hop = mean.hop;
+          misfits = meanMisfits;
+        }
+      }
+      for(uint32_t i = 0; misfits && i < n; i++) {
+        if(times_start(&e, i) != t[2 * i] || times_end(&e, i) != t[2 * i + 1]) {
+          times_exception_t x = {i, 0, t[2 * i], t[2 * i + 1]};
+          exceptions.push_back(x);
+        }
+      }
+    }
+    e.nexceptions = exceptions.size() - e.firstException;
+    offset += n;
+  }
+
+  times_header_t h = {O2_COMPACT_TIMES_MAGIC, numFiles, 0, 0, offset, exceptions.size()};
+  char *path = times_path(dbName);
+  char *tmpName = new char[strlen(path) + 16];
+  sprintf(tmpName, "%s.%d", path, (int) getpid());
+  int fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(fd < 0)
+    error("failed to create compact times file", tmpName, "open");
+  bool ok = write(fd, &h, sizeof(h)) == (ssize_t) sizeof(h) &&
+    (!numFiles || write(fd, &entries[0], numFiles * sizeof(times_entry_t)) == (ssize_t) (numFiles * sizeof(times_entry_t))) &&
+    (exceptions.empty() || write(fd, &exceptions[0], exceptions.size() * sizeof(times_exception_t)) == (ssize_t) (exceptions.size() * sizeof(times_exception_t))) &&
+    fsync(fd) == 0;
+  ok = (close(fd) == 0) && ok;
+  if(!ok || rename(tmpName, path)) {
+    unlink(tmpName);
+    error("failed to write compact times file", path, "write");
+  }
+
+  // only now that the encoding is safely on disk, release the table
+  off_t start = dbH->timesTableOffset;
+  off_t length = 2 * offset * sizeof(double);
+  if(timesTable) {
+    munmap(timesTable, timesTableLength);
+    timesTable = 0;
+  }
+#if defined(FALLOC_FL_PUNCH_HOLE)
+  if(length && fallocate(adb->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, length))
+    error("failed to release the times table", dbName, "fallocate");
+  posix_fadvise(adb->fd, start, length, POSIX_FADV_DONTNEED);
+#else
+  error("releasing the times table is not supported on this platform", dbName);
+#endif
+
+  VERB_LOG(0, "%s %s %u tracks %ju exceptions %ju bytes released, %ju bytes encoded.\n", COM_COMPACT, dbName, numFiles,
+           (uintmax_t) exceptions.size(), (uintmax_t) length,
+           (uintmax_t) (sizeof(h) + numFiles * sizeof(times_entry_t) + exceptions.size() * sizeof(times_exception_t)));
+  delete[] tmpName;
+  delete[] path;
+}
+
+// Open and read into enc the encoded times of the database name (open
+// as a), unless there are none, they do not match the database, or
+// they have been expanded; the file is returned open, or -1
+int audioDB::times_load(const char *name, adb_t *a, times_encoding *enc) {
+  times_header_t &h = enc->h;
+  std::vector<times_entry_t> &entries = enc->entries;
+  std::vector<times_exception_t> &exceptions = enc->exceptions;
+  char *path = times_path(name);
+  int fd = open(path, O_RDWR);
+  if(fd < 0)
+    fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    delete[] path;
+    return -1;
+  }
+  if(read(fd, &h, sizeof(h)) != (ssize_t) sizeof(h) || h.magic != O2_COMPACT_TIMES_MAGIC ||
+     h.numFiles > a->header->numFiles || (a->header->flags & O2_FLAG_LARGE_ADB)) {
+    VERB_LOG(1, "ignoring compact times file %s, which does not match the database\n", path);
+    close(fd);
+    delete[] path;
+    return -1;
+  }
+  if(h.expanded) {
+    close(fd);
+    delete[] path;
+    return -1;
+  }
+  entries.resize(h.numFiles);
+  exceptions.resize(h.nexceptions);
+  if((h.numFiles && read(fd, &entries[0], h.numFiles * sizeof(times_entry_t)) != (ssize_t) (h.numFiles * sizeof(times_entry_t))) ||
+     (h.nexceptions && read(fd, &exceptions[0], h.nexceptions * sizeof(times_exception_t)) != (ssize_t) (h.nexceptions * sizeof(times_exception_t))))
+    error("short read of compact times file", path);
+  for(Uns32T k = 0; k < h.numFiles; k++) {
+    const times_entry_t &e = entries[k];
+    if(e.nvectors != (*a->track_lengths)[k] || e.firstException + e.nexceptions > h.nexceptions)
+      error("compact times file does not match the database", path);
+    for(uint32_t j = 0; j < e.nexceptions; j++)
+      if(exceptions[e.firstException + j].index >= e.nvectors)
+        error("compact times file does not match the database", path);
+  }
+  delete[] path;
+  return fd;
+}
+
+// Write the encoded times of the database name (open as a) back into
+// its times table, if they have been released; whether they were
+bool audioDB::times_expand(const char *name, adb_t *a) {
+  times_encoding enc;
+  int fd = times_load(name, a, &enc);
+  times_header_t &h = enc.h;
+  if(fd < 0)
+    return false;
+
+  VERB_LOG(1, "expanding compact times for %u tracks\n", h.numFiles);
+  // the library's handle may be read-only
+  int dbfd = open(name, O_RDWR);
+  if(dbfd < 0)
+    error("expanding compact times needs write access to the database", name, "open");
+  std::vector<double> t;
+  for(Uns32T k = 0; k < h.numFiles; k++) {
+    const times_entry_t &e = enc.entries[k];
+    times_track(&e, e.nexceptions ? &enc.exceptions[e.firstException] : NULL, t);
+    size_t count = 2 * (size_t) e.nvectors * sizeof(double);
+    if(pwrite(dbfd, &t[0], count, a->header->timesTableOffset + 2 * e.vectorOffset * sizeof(double)) != (ssize_t) count)
+      error("failed to expand compact times", name, "pwrite");
+  }
+  if(fsync(dbfd))
+    error("failed to expand compact times", name, "fsync");
+  close(dbfd);
+
+  h.expanded = 1;
+  if(pwrite(fd, &h, sizeof(h), 0) != (ssize_t) sizeof(h))
+    VERB_LOG(1, "failed to mark compact times of %s as expanded\n", name);
+  close(fd);
+  return true;
+}
+
+// Append the mean duration of the vectors of each track of the
+// database name (open as a) to durations, from its compact times, if
+// it has them, or else its times table
+void audioDB::times_durations(const char *name, adb_t *a, std::vector<double> &durations) {
+  if(!(a->header->flags & O2_FLAG_TIMES) || (a->header->flags & O2_FLAG_LARGE_ADB))
+    error("duration ratio given but database has no times table", name);
+  times_encoding enc;
+  int fd = times_load(name, a, &enc);
+  times_header_t &h = enc.h;
+  if(fd >= 0)
+    close(fd);
+
+  Uns32T numFiles = a->header->numFiles;
+  std::vector<double> t;
+  off_t offset = 0;
+  for(Uns32T k = 0; k < numFiles; k++) {
+    uint32_t n = (*a->track_lengths)[k];
+    if(fd >= 0 && k < h.numFiles) {
+      const times_entry_t &e = enc.entries[k];
+      times_track(&e, e.nexceptions ? &enc.exceptions[e.firstException] : NULL, t);
+    } else {
+      size_t count = 2 * (size_t) n * sizeof(double);
+      t.resize(2 * (size_t) n + 1);
+      if(count && pread(a->fd, &t[0], count, a->header->timesTableOffset + 2 * offset * sizeof(double)) != (ssize_t) count)
+        error("short read of times table", name);
+    }
+    durations.push_back(times_mean_duration(&t[0], n));
+    offset += n;
+  }
+}
+
+// Make a query's duration ratio refinement, if any of its databases
+// has released its times table, by removing the tracks whose mean
+// durations are out of range from its include keylist; whether it did
+bool audioDB::times_restrict(adb_query_spec_t *qspec) {
+  if(!(qspec->refine.flags & ADB_REFINE_DURATION_RATIO))
+    return false;
+  std::vector<const char *> names;
+  std::vector<adb_t *> adbs;
+  if(shards.empty()) {
+    names.push_back(dbName);
+    adbs.push_back(adb);
+  }
+  for(unsigned k = 0; k < shards.size(); k++) {
+    names.push_back(shards[k].name);
+    adbs.push_back(shards[k].adb);
+  }
+  bool released = false;
+  for(unsigned k = 0; k < names.size() && !released; k++) {
+    times_encoding enc;
+    int fd = times_load(names[k], adbs[k], &enc);
+    if(fd >= 0) {
+      close(fd);
+      released = true;
+    }
+  }
+  if(!released)
+    return false;
+
+  std::vector<double> durations;
+  for(unsigned k = 0; k < names.size(); k++)
+    times_durations(names[k], adbs[k], durations);
+
+  // the query's mean duration, from its times file or its track's
+  const adb_datum_t *datum = qspec->qid.datum;
+  double qdur;
+  if(datum->times) {
+    qdur = times_mean_duration(datum->times, datum->nvectors);
+  } else {
+    Uns32T t = O2_ERR_KEYNOTFOUND;
+    if(shards.empty()) {
+      t = key_index(key);
+    } else {
+      for(unsigned s = 0; s < shards.size() && t == O2_ERR_KEYNOTFOUND; s++) {
+        uint32_t index = audiodb_key_index(shards[s].adb, key);
+        if(index != (uint32_t) -1)
+          t = shards[s].base + index;
+      }
+    }
+    if(t == O2_ERR_KEYNOTFOUND)
+      error("key not found", key);
+    qdur = durations[t];
+  }
+
+  Uns32T numFiles = durations.size();
+  Uns32T nwords = (numFiles + 31) / 32;
+  bool restricted = keylistBitmap;
+  if(!restricted) {
+    keylistBitmap = new Uns32T[nwords ? nwords : 1];
+    memset(keylistBitmap, 0, (nwords ? nwords : 1) * sizeof(Uns32T));
+    for(Uns32T i = 0; i < numFiles; i++)
+      keylistBitmap[i >> 5] |= 1U << (i & 31);
+  }
+  Uns32T kept = 0;
+  for(Uns32T i = 0; i < numFiles; i++) {
+    if(!(fabs(durations[i] - qdur) < qdur * qspec->refine.duration_ratio))
+      keylistBitmap[i >> 5] &= ~(1U << (i & 31));
+    else if(keylistBitmap[i >> 5] & (1U << (i & 31)))
+      kept++;
+  }
+  VERB_LOG(1, "duration ratio refined from compact times: %u of %u tracks kept\n", kept, numFiles);
+
+  qspec->refine.flags &= ~ADB_REFINE_DURATION_RATIO;
+  qspec->refine.flags |= ADB_REFINE_INCLUDE_KEYLIST;
+  if(shards.empty()) {
+    if(restricted)
+      delete[] qspec->refine.include.keys;
+    keylist_keys(&qspec->refine.include);
+  }
+  return true;
+}
@@ -0,0 +1,323 @@
+// Time-warped sequence search
+//
+// Sequence search tolerant of tempo variation: each query sequence of
+// length l is compared with every length-l window of each track by
+// dynamic time warping constrained to a Sakoe-Chiba band of width
+// r = ceil((expandfactor - 1) * l).  A result is always a window of
+// exactly l frames, so matches are never longer or shorter than the
+// query; the expand factor only bounds how far the alignment may stray
+// from the diagonal, each query frame being matched to window frames
+// at most r away, so that passages within the window may be played
+// faster or slower than the query's.
+//
+// Following the UCR suite, most windows are rejected without a full
+// alignment by a cascade of lower bounds: LB_Kim (first and last
+// frames), LB_Keogh of the window against the query envelope, and
+// LB_Keogh of the query against the track envelope; the alignment
+// itself is abandoned as soon as its partial cost plus the remaining
+// lower bound exceeds the pruning threshold.  The threshold is the
+// radius, if given, and otherwise the worst of the pointNN best
+// distances found so far in the current track.  --warp_no_bounds
+// turns the pruning off, for comparison with naive warped matching.
+//
+// The reported distance is the warped sum of squared frame distances
+// divided by l.  With --timeout-ms the search stops between tracks
+// once the deadline has passed.  Unless --no_unit_norming, each frame
+// is unit normed by itself, rather than each sequence as a whole as
+// the other sequence searches do, so the distances are not comparable
+// with theirs.
+
+#include "audioDB.h"
+
+#include <deque>
+#include <queue>
+
+#define WARP_INF (DBL_MAX)
+
+static inline double warp_frame_dist(const double *a, const double *b, Uns32T d) {
+  double sum = 0;
+  for(Uns32T j = 0; j < d; j++) {
+    double t = a[j] - b[j];
+    sum += t * t;
+  }
+  return sum;
+}
+
+static void warp_unit_norm(double *v, Uns32T n, Uns32T d) {
+  for(Uns32T i = 0; i < n; i++, v += d) {
+    double norm = 0;
+    for(Uns32T j = 0; j < d; j++)
+      norm += v[j] * v[j];
+    if(norm > 0) {
+      norm = sqrt(norm);
+      for(Uns32T j = 0; j < d; j++)
+        v[j] /= norm;
+    }
+  }
+}
+
+// Upper and lower envelopes (per dimension) of n frames within +/- r
+// frames, by Lemire's streaming min/max
+static void warp_envelope(const double *v, Uns32T n, Uns32T d, Uns32T r, double *upper, double *lower) {
+  for(Uns32T j = 0; j < d; j++) {
+    std::deque<Uns32T> du, dl;
+    for(Uns32T i = 0; i < n + r; i++) {
+      if(i < n) {
+        while(!du.empty() && v[(size_t) du.back() * d + j] <= v[(size_t) i * d + j])
+          du.pop_back();
+        du.push_back(i);
+        while(!dl.empty() && v[(size_t) dl.back() * d + j] >= v[(size_t) i * d + j])
+          dl.pop_back();
+        dl.push_back(i);
+      }
+      if(i >= r) {
+        Uns32T k = i - r;
+        while(du.front() + r < k)
+          du.pop_front();
+        while(dl.front() + r < k)
+          dl.pop_front();
+        upper[(size_t) k * d + j] = v[(size_t) du.front() * d + j];
+        lower[(size_t) k * d + j] = v[(size_t) dl.front() * d + j];
+      }
+    }
+  }
+}
+
+// LB_Keogh of l frames c against an envelope, with early abandoning;
+// the per-frame contributions are left in lb
+static double warp_lb_keogh(const double *c, const double *upper, const double *lower, Uns32T l, Uns32T d, double bsf, double *lb) {
+  double sum = 0;
+  for(Uns32T i = 0; i < l; i++) {
+    double t = 0;
+    for(Uns32T j = 0; j < d; j++) {
+      size_t k = (size_t) i * d + j;
+      if(c[k] > upper[k])
+        t += (c[k] - upper[k]) * (c[k] - upper[k]);
+      else if(c[k] < lower[k])
+        t += (lower[k] - c[k]) * (lower[k] - c[k]);
+    }
+    lb[i] = t;
+    sum += t;
+    if(sum > bsf)
+      return sum;
+  }
+  return sum;
+}
+
+// Banded DTW of two length-l sequences, abandoned (returning
+// WARP_INF) once the best partial path plus cb[] (the cumulative
+// lower bound of the frames not yet reached) exceeds bsf
+static double warp_dtw(const double *a, const double *b, const double *cb, Uns32T l, Uns32T d, Uns32T r, double bsf, double *prev, double *cur) {
+  for(Uns32T j = 0; j < l; j++)
+    prev[j] = cur[j] = WARP_INF;
+  for(Uns32T i = 0; i < l; i++) {
+    Uns32T jlo = i > r ? i - r : 0;
+    Uns32T jhi = i + r < l - 1 ? i + r : l - 1;
+    if(jlo > 0)
+      cur[jlo - 1] = WARP_INF;
+    double rowmin = WARP_INF;
+    for(Uns32T j = jlo; j <= jhi; j++) {
+      double best;
+      if(i == 0 && j == 0) {
+        best = 0;
+      } else {
+        best = WARP_INF;
+        if(i > 0 && prev[j] < best)
+          best = prev[j];
+        if(j > 0 && cur[j-1] < best)
+          best = cur[j-1];
+        if(i > 0 && j > 0 && prev[j-1] < best)
+          best = prev[j-1];
+      }
+      cur[j] = best == WARP_INF ? WARP_INF : best + warp_frame_dist(a + (size_t) i * d, b + (size_t) j * d, d);
+      if(cur[j] < rowmin)
+        rowmin = cur[j];
+    }
+    double rest = i + r + 1 < l ? cb[i + r + 1] : 0;
+    if(rowmin + rest > bsf)
+      return WARP_INF;
+    double *tmp = prev;
+    prev = cur;
+    cur = tmp;
+  }
+  return prev[l - 1];
+}
+
+void audioDB::warp_query(const adb_query_spec_t *qspec) {
+  const adb_datum_t *datum = qspec->qid.datum;
+  uint32_t flags = qspec->refine.flags;
+  struct timeval tv1, tv2;
+
+  forWrite = false;
+  initDBHeader(dbName, O2_TABLE_TRACK);
+
+  if(datum->dim != dbH->dim)
+    error("query dimension does not match database dimension");
+  if(datum->nvectors < sequenceLength)
+    error("Query sequence too short for sequence length", inFile);
+  if(flags & (ADB_REFINE_ABSOLUTE_THRESHOLD | ADB_REFINE_RELATIVE_THRESHOLD | ADB_REFINE_DURATION_RATIO))
+    error("power and times refinements are not supported by the warped sequence search");
+
+  gettimeofday(&tv1, NULL);
+
+  Uns32T l = sequenceLength;
+  Uns32T d = dbH->dim;
+  Uns32T r = (Uns32T) ceil((expandFactor - 1) * l);
+  if(r > l - 1)
+    r = l - 1;
+  bool normed = qspec->params.distance == ADB_DISTANCE_EUCLIDEAN_NORMED;
+  bool useRadius = flags & ADB_REFINE_RADIUS;
+  double radiusCost = useRadius ? qspec->refine.radius * l : WARP_INF;
+  Uns32T qhop = qspec->refine.qhopsize;
+  Uns32T ihop = qspec->refine.ihopsize;
+
+  Uns32T qstart, nq;
+  if(qspec->qid.flags & ADB_QID_FLAG_EXHAUSTIVE) {
+    qstart = 0;
+    nq = (datum->nvectors - l) / qhop + 1;
+  } else {
+    qstart = qspec->qid.sequence_start;
+    if(qstart > datum->nvectors - l)
+      error("queryPoint > numVectors-wL+1 in query");
+    nq = 1;
+  }
+
+  // query copy (normed) and envelopes
+  size_t qsize = (size_t) datum->nvectors * d;
+  double *query = new double[qsize];
+  memcpy(query, datum->data, qsize * sizeof(double));
+  if(normed)
+    warp_unit_norm(query, datum->nvectors, d);
+  double *qupper = new double[(size_t) nq * l * d];
+  double *qlower = new double[(size_t) nq * l * d];
+  for(Uns32T k = 0; k < nq; k++)
+    warp_envelope(query + (size_t) (qstart + k * qhop) * d, l, d, r,
+                  qupper + (size_t) k * l * d, qlower + (size_t) k * l * d);
+
+  bool *include = new bool[dbH->numFiles];
+  init_track_mask(qspec, include);
+
+  Uns32T maxTrack = 0;
+  for(Uns32T i = 0; i < dbH->numFiles; i++)
+    if(trackTable[i] > maxTrack)
+      maxTrack = trackTable[i];
+
+  double *tupper = new double[(size_t) maxTrack * d];
+  double *tlower = new double[(size_t) maxTrack * d];
+  double *lbq = new double[l];
+  double *lbt = new double[l];
+  double *cb = new double[l + 1];
+  double *prev = new double[l];
+  double *cur = new double[l];
+  double *fvp = 0;
+  size_t nfv = 0;
+
+  unsigned long long candidates = 0, kimPruned = 0, keoghPruned = 0, keogh2Pruned = 0, abandoned = 0, aligned = 0;
+  unsigned long long tracks = 0, results = 0;
+
+  std::vector<off_t> vectorOffsets(dbH->numFiles + 1, 0);
+  for(Uns32T i = 0; i < dbH->numFiles; i++)
+    vectorOffsets[i + 1] = vectorOffsets[i] + trackTable[i];
+  std::vector<size_t> order;
+  deadline_order(dbH->numFiles, order);
+
+  for(size_t o = 0; o < order.size(); o++) {
+    Uns32T trackID = order[o];
+    off_t vectorOffset = vectorOffsets[trackID];
+    Uns32T n = trackTable[trackID];
+    if(!include[trackID] || n < l)
+      continue;
+    searchableVectors += n;
+    if(deadline_passed())
+      continue;
+    searchedVectors += n;
+    tracks++;
+    read_track_data(trackID, vectorOffset, &fvp, &nfv);
+    if(normed)
+      warp_unit_norm(fvp, n, d);
+    if(use_warp_bounds)
+      warp_envelope(fvp, n, d, r, tupper, tlower);
+
+    // worst of the pointNN best distances in this track
+    std::priority_queue<double> best;
+
+    for(Uns32T s = 0; s + l <= n; s += ihop) {
+      const double *c = fvp + (size_t) s * d;
+      for(Uns32T k = 0; k < nq; k++) {
+        const double *q = query + (size_t) (qstart + k * qhop) * d;
+        double bsf = radiusCost;
+        if(!useRadius && best.size() >= pointNN)
+          bsf = best.top();
+        candidates++;
+
+        if(use_warp_bounds) {
+          // LB_Kim: the path always contains the first and last frame pairs
+          double lb = warp_frame_dist(q, c, d);
+          if(l > 1)
+            lb += warp_frame_dist(q + (size_t) (l - 1) * d, c + (size_t) (l - 1) * d, d);
+          if(lb > bsf) {
+            kimPruned++;
+            continue;
+          }
+          double lb1 = warp_lb_keogh(c, qupper + (size_t) k * l * d, qlower + (size_t) k * l * d, l, d, bsf, lbq);
+          if(lb1 > bsf) {
+            keoghPruned++;
+            continue;
+          }
+          double lb2 = warp_lb_keogh(q, tupper + (size_t) s * d, tlower + (size_t) s * d, l, d, bsf, lbt);
+          if(lb2 > bsf) {
+            keogh2Pruned++;
+            continue;
+          }
+          // cumulative bound from the tighter of the two
+          const double *lbp = lb1 > lb2 ? lbq : lbt;
+          cb[l] = 0;
+          for(Uns32T i = l; i > 0; i--)
+            cb[i - 1] = cb[i] + lbp[i - 1];
+        } else {
+          for(Uns32T i = 0; i <= l; i++)
+            cb[i] = 0;
+        }
+
+        double cost = warp_dtw(q, c, cb, l, d, r, use_warp_bounds ? bsf : WARP_INF, prev, cur);
+        if(cost == WARP_INF) {
+          abandoned++;
+          continue;
+        }
+        aligned++;
+        if(cost > bsf)
+          continue;
+        if(!useRadius) {
+          best.push(cost);
+          if(best.size() > pointNN)
+            best.pop();
+        }
+        reporter->add_point(trackID, qstart + k * qhop, s, cost / l);
+        results++;
+      }
+    }
+  }
+
+  gettimeofday(&tv2, NULL);
+  VERB_LOG(1, "WARP: l=%u r=%u candidates=%llu LB_Kim=%llu LB_Keogh(EQ)=%llu LB_Keogh(EC)=%llu abandoned=%llu aligned=%llu time=%f\n",
+           l, r, candidates, kimPruned, keoghPruned, keogh2Pruned, abandoned, aligned,
+           (tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec) / 1000000.0);
+  stats_count("tracks", tracks);
+  stats_count("candidates", candidates);
+  stats_count("lower_bound_pruned", kimPruned + keoghPruned + keogh2Pruned);
+  stats_count("distances", abandoned + aligned);
+  stats_count("results", results);
+
+  free(fvp);
+  delete[] cur;
+  delete[] prev;
+  delete[] cb;
+  delete[] lbt;
+  delete[] lbq;
+  delete[] tlower;
+  delete[] tupper;
+  delete[] include;
+  delete[] qlower;
+  delete[] qupper;
+  delete[] query;
+}
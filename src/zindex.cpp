@@ -0,0 +1,371 @@
+// Compressed LSH index
+//
+// lshlib stores each bucket's points as raw 32-bit identifiers, and on
+// large databases its index files outgrow the features they index.
+// --INDEX --lsh_compress writes an index of the frontend's own instead,
+// alongside the others as dbName.lsh.${radius}.${sequenceLength}.z,
+// which the batched LSH search (lshexact.cpp) reads in its place.  The
+// library does not know of it: queries the batched search does not
+// take (point and track queries, and sequence queries with power
+// thresholds, times, --cache or several databases) ignore it, and
+// search exhaustively unless there is an lshlib index too.
+//
+// The index has m(m-1)/2 tables, as lshlib's would, each of k p-stable
+// hash functions h(v) = floor((a.v / sqrt(R) + b) / w), with a drawn
+// from a Gaussian and b uniformly from [0, w); R is the (squared)
+// radius, so that neighbours are within unit distance.  A table's
+// bucket is keyed by a 32-bit hash of its k values; two buckets
+// sharing a key only add candidates, which are evaluated exactly.
+// The functions are stored in the file, so a query hashes exactly as
+// the index was built.
+//
+// Each table holds its bucket keys in order, with the end of each
+// bucket's points in a stream of bytes: the point identifiers of a
+// bucket, sorted, as the differences between them, each in a varint
+// (seven bits to the byte, the high bit set on all but the last byte).
+// Neighbouring shingles of a track fall in the same buckets, with
+// nearby identifiers, so most differences take a single byte.
+//
+// The file is mapped rather than read, so a query reads only the
+// parts of the tables it probes.  Tracks inserted into the database
+// after the index was built are added by decoding the tables,
+// inserting the new tracks' points, and writing them out again.
+
+#include "audioDB.h"
+
+#include <algorithm>
+
+typedef struct {
+  uint32_t magic;
+  uint32_t dim;
+  uint32_t k;
+  uint32_t ntables;
+  uint32_t numFiles;
+  uint32_t pad;
+  double w;
+  double radius;
+  uint64_t npoints;
+} zindex_header_t;
+
+typedef struct zindex_table {
+  uint64_t offset;
+  uint64_t length;
+  uint32_t nbuckets;
+  uint32_t pad;
+} zindex_table_t;
+
+static bool zindex_entry_less(const ZIndexEntry &a, const ZIndexEntry &b) {
+  if(a.key != b.key)
+    return a.key < b.key;
+  return a.pointID < b.pointID;
+}
+
+static uint64_t zindex_mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+// The bucket key of v in table t
+static uint32_t zindex_key(const ZIndex *z, const std::vector<float> &v, Uns32T t) {
+  double scale = 1 / sqrt(z->radius);
+  uint64_t key = t;
+  for(Uns32T j = 0; j < z->k; j++) {
+    size_t f = (size_t) t * z->k + j;
+    const double *a = &z->a[f * z->dim];
+    double p = 0;
+    for(Uns32T i = 0; i < z->dim; i++)
+      p += a[i] * v[i];
+    int64_t h = (int64_t) floor((p * scale + z->b[f]) / z->w);
+    key = zindex_mix(key + (uint64_t) h + 0x9e3779b97f4a7c15ULL);
+  }
+  return (uint32_t) (key >> 32);
+}
+
+// Uniform in (0, 1), from a splitmix64 state
+static double zindex_uniform(uint64_t *state) {
+  *state += 0x9e3779b97f4a7c15ULL;
+  return ((zindex_mix(*state) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+char *audioDB::zindex_get_name() {
+  char *name = index_get_name();
+  if(!name)
+    return 0;
+  char *zname = new char[strlen(name) + 4];
+  sprintf(zname, "%s.z", name);
+  delete[] name;
+  return zname;
+}
+
+bool audioDB::zindex_exists() {
+  if(!radius)
+    return false;
+  char *name = zindex_get_name();
+  if(!name)
+    return false;
+  bool exists = access(name, R_OK) == 0;
+  delete[] name;
+  return exists;
+}
+
+// Draw the hash functions of a new index
+static void zindex_init(ZIndex *z, Uns32T dim, Uns32T k, Uns32T ntables, double w, double radius) {
+  z->dim = dim;
+  z->k = k;
+  z->ntables = ntables;
+  z->numFiles = 0;
+  z->npoints = 0;
+  z->w = w;
+  z->radius = radius;
+  size_t nfunctions = (size_t) ntables * k;
+  z->a.resize(nfunctions * dim);
+  z->b.resize(nfunctions);
+  uint64_t state = 0x4144425a;
+  for(size_t i = 0; i < z->a.size(); i++)
+    z->a[i] = sqrt(-2 * log(zindex_uniform(&state))) * cos(2 * M_PI * zindex_uniform(&state));
+  for(size_t i = 0; i < nfunctions; i++)
+    z->b[i] = w * zindex_uniform(&state);
+  z->entries.resize(ntables);
+}
+
+// Map the index name, checking its header and the extent of its
+// tables; false if there is none
+bool audioDB::zindex_open(ZIndex *z, const char *name) {
+  z->base = 0;
+  z->length = 0;
+  int fd = open(name, O_RDONLY);
+  if(fd < 0)
+    return false;
+  struct stat st;
+  if(fstat(fd, &st))
+    error("failed to stat compressed index", name, "fstat");
+  if((size_t) st.st_size < sizeof(zindex_header_t))
+    error("compressed index is truncated", name);
+  void *base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(base == MAP_FAILED)
+    error("failed to map compressed index", name, "mmap");
+  z->base = (const char *) base;
+  z->length = st.st_size;
+
+  const zindex_header_t *h = (const zindex_header_t *) z->base;
+  if(h->magic != O2_ZINDEX_MAGIC)
+    error("not a compressed index", name);
+  size_t nfunctions = (size_t) h->ntables * h->k;
+  size_t tablesAt = sizeof(zindex_header_t) + nfunctions * (h->dim + 1) * sizeof(double);
+  if(!h->ntables || !h->k || !h->dim || tablesAt + h->ntables * sizeof(zindex_table_t) > z->length)
+    error("compressed index is truncated", name);
+  z->dim = h->dim;
+  z->k = h->k;
+  z->ntables = h->ntables;
+  z->numFiles = h->numFiles;
+  z->npoints = h->npoints;
+  z->w = h->w;
+  z->radius = h->radius;
+  const double *f = (const double *) (z->base + sizeof(zindex_header_t));
+  z->a.assign(f, f + nfunctions * h->dim);
+  z->b.assign(f + nfunctions * h->dim, f + nfunctions * (h->dim + 1));
+  z->tables = (const zindex_table_t *) (z->base + tablesAt);
+  for(Uns32T t = 0; t < z->ntables; t++) {
+    const zindex_table_t &e = z->tables[t];
+    if(e.offset % 8 || e.offset > z->length || e.length > z->length - e.offset ||
+       e.length < 2 * (uint64_t) e.nbuckets * sizeof(uint32_t))
+      error("compressed index is truncated", name);
+  }
+  madvise((void *) z->base, z->length, MADV_RANDOM);
+  return true;
+}
+
+void audioDB::zindex_close(ZIndex *z) {
+  if(z->base)
+    munmap((void *) z->base, z->length);
+  z->base = 0;
+}
+
+// The bytes of the first ntables tables
+uint64_t audioDB::zindex_table_bytes(const ZIndex *z, Uns32T ntables) {
+  uint64_t bytes = 0;
+  for(Uns32T t = 0; t < ntables && t < z->ntables; t++)
+    bytes += z->tables[t].length;
+  return bytes;
+}
+
+// Pass the points of bucket b of table t to f, as retrieve_point()
+// passes lshlib's
+void audioDB::zindex_bucket(const ZIndex *z, Uns32T t, uint32_t b, Uns32T qpos, ReporterCallbackPtr f, void *caller) {
+  const zindex_table_t &e = z->tables[t];
+  const uint32_t *ends = (const uint32_t *) (z->base + e.offset) + e.nbuckets;
+  const uint8_t *stream = (const uint8_t *) (ends + e.nbuckets);
+  uint64_t streamLength = e.length - 2 * (uint64_t) e.nbuckets * sizeof(uint32_t);
+  uint32_t start = b ? ends[b - 1] : 0;
+  if(ends[b] < start || ends[b] > streamLength)
+    error("compressed index is corrupt");
+  const uint8_t *p = stream + start, *end = stream + ends[b];
+  uint32_t pointID = 0;
+  while(p < end) {
+    uint32_t delta = 0;
+    for(unsigned shift = 0; ; shift += 7) {
+      if(p == end || shift > 28)
+        error("compressed index is corrupt");
+      delta |= (uint32_t) (*p & 0x7f) << shift;
+      if(!(*p++ & 0x80))
+        break;
+    }
+    pointID += delta;
+    f(caller, pointID, qpos, 0);
+  }
+}
+
+// Pass the points in v's buckets of the first ntables tables to f
+void audioDB::zindex_retrieve_point(const ZIndex *z, const std::vector<float> &v, Uns32T qpos, Uns32T ntables, ReporterCallbackPtr f, void *caller) {
+  for(Uns32T t = 0; t < ntables && t < z->ntables; t++) {
+    const zindex_table_t &e = z->tables[t];
+    const uint32_t *keys = (const uint32_t *) (z->base + e.offset);
+    uint32_t key = zindex_key(z, v, t);
+    const uint32_t *found = std::lower_bound(keys, keys + e.nbuckets, key);
+    if(found != keys + e.nbuckets && *found == key)
+      zindex_bucket(z, t, found - keys, qpos, f, caller);
+  }
+}
+
+static void zindex_collect(void *caller, Uns32T pointID, Uns32T qpos, float dist) {
+  std::vector<ZIndexEntry> *entries = (std::vector<ZIndexEntry> *) caller;
+  ZIndexEntry e = {qpos, pointID};
+  entries->push_back(e);
+}
+
+void audioDB::zindex_insert_point(ZIndex *z, const std::vector<float> &v, Uns32T pointID) {
+  for(Uns32T t = 0; t < z->ntables; t++) {
+    ZIndexEntry e = {zindex_key(z, v, t), pointID};
+    z->entries[t].push_back(e);
+  }
+  z->npoints++;
+}
+
+// Write the tables of z to name, through a temporary file
+void audioDB::zindex_write(ZIndex *z, const char *name) {
+  zindex_header_t h = {O2_ZINDEX_MAGIC, z->dim, z->k, z->ntables, z->numFiles, 0, z->w, z->radius, z->npoints};
+  size_t nfunctions = (size_t) z->ntables * z->k;
+  uint64_t offset = sizeof(h) + nfunctions * (z->dim + 1) * sizeof(double) + z->ntables * sizeof(zindex_table_t);
+  offset = (offset + 7) & ~(uint64_t) 7;
+
+  // each table's keys, bucket ends and stream
+  std::vector<zindex_table_t> tables(z->ntables);
+  std::vector<std::vector<uint32_t> > keys(z->ntables), ends(z->ntables);
+  std::vector<std::vector<uint8_t> > streams(z->ntables);
+  for(Uns32T t = 0; t < z->ntables; t++) {
+    std::vector<ZIndexEntry> &entries = z->entries[t];
+    std::sort(entries.begin(), entries.end(), zindex_entry_less);
+    std::vector<uint8_t> &s = streams[t];
+    uint32_t previous = 0;
+    for(size_t i = 0; i < entries.size(); i++) {
+      bool first = !i || entries[i].key != entries[i - 1].key;
+      if(first) {
+        if(i)
+          ends[t].push_back(s.size());
+        keys[t].push_back(entries[i].key);
+        previous = 0;
+      }
+      uint32_t delta = entries[i].pointID - previous;
+      previous = entries[i].pointID;
+      while(delta >= 0x80) {
+        s.push_back((delta & 0x7f) | 0x80);
+        delta >>= 7;
+      }
+      s.push_back(delta);
+      if(s.size() > 0xFFFFFFFFU)
+        error("compressed index table too large", name);
+    }
+    if(!entries.empty())
+      ends[t].push_back(s.size());
+    std::vector<ZIndexEntry>().swap(entries);
+    tables[t].offset = offset;
+    tables[t].nbuckets = keys[t].size();
+    tables[t].length = 2 * (uint64_t) tables[t].nbuckets * sizeof(uint32_t) + s.size();
+    tables[t].pad = 0;
+    offset = (offset + tables[t].length + 7) & ~(uint64_t) 7;
+  }
+
+  char *tmpName = new char[strlen(name) + 16];
+  sprintf(tmpName, "%s.%d", name, (int) getpid());
+  FILE *f = fopen(tmpName, "wb");
+  if(!f)
+    error("failed to create compressed index", tmpName, "fopen");
+  static const char zeros[8] = {0};
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+    fwrite(&z->a[0], sizeof(double), z->a.size(), f) == z->a.size() &&
+    fwrite(&z->b[0], sizeof(double), z->b.size(), f) == z->b.size() &&
+    fwrite(&tables[0], sizeof(zindex_table_t), z->ntables, f) == z->ntables;
+  for(Uns32T t = 0; ok && t < z->ntables; t++) {
+    long at = ftell(f);
+    size_t pad = at >= 0 ? tables[t].offset - at : 0;
+    ok = at >= 0 && pad < sizeof(zeros) && fwrite(zeros, 1, pad, f) == pad &&
+      (keys[t].empty() || (fwrite(&keys[t][0], sizeof(uint32_t), keys[t].size(), f) == keys[t].size() &&
+                           fwrite(&ends[t][0], sizeof(uint32_t), ends[t].size(), f) == ends[t].size())) &&
+      (streams[t].empty() || fwrite(&streams[t][0], 1, streams[t].size(), f) == streams[t].size());
+  }
+  ok = (fclose(f) == 0) && ok;
+  if(!ok || rename(tmpName, name)) {
+    unlink(tmpName);
+    error("failed to write compressed index", name);
+  }
+  delete[] tmpName;
+}
+
+// Build the compressed index name, or add to it the tracks inserted
+// since it was built
+void audioDB::zindex_build(const char *name) {
+  ZIndex z;
+  stats_phase("index_load");
+  if(zindex_open(&z, name)) {
+    printf("INDEX: adding to compressed LSH index %s\n", name);
+    if(z.dim != sequenceLength * dbH->dim)
+      error("compressed index does not match the sequence length and dimension", name);
+    if(z.numFiles > dbH->numFiles)
+      error("compressed index has more tracks than the database", name);
+    // decode the tables, each bucket's points under its key
+    z.entries.resize(z.ntables);
+    for(Uns32T t = 0; t < z.ntables; t++) {
+      const uint32_t *keys = (const uint32_t *) (z.base + z.tables[t].offset);
+      std::vector<ZIndexEntry> &entries = z.entries[t];
+      for(uint32_t b = 0; b < z.tables[t].nbuckets; b++) {
+        size_t first = entries.size();
+        zindex_bucket(&z, t, b, 0, zindex_collect, &entries);
+        for(size_t i = first; i < entries.size(); i++)
+          entries[i].key = keys[b];
+      }
+    }
+    zindex_close(&z);
+  } else {
+    printf("INDEX: making compressed LSH index %s\n", name);
+    zindex_init(&z, sequenceLength * dbH->dim, lsh_param_k, lsh_param_m * (lsh_param_m - 1) / 2, lsh_param_w, radius);
+  }
+  fflush(stdout);
+
+  if(z.numFiles < dbH->numFiles) {
+    double *sNorm = 0, *snPtr = 0, *sPower = 0, *spPtr = 0;
+    Uns32T dbVectors = 0;
+    if(!(dbH->flags & O2_FLAG_LARGE_ADB))
+      index_initialize(&sNorm, &snPtr, &sPower, &spPtr, &dbVectors);
+    stats_phase("insert");
+    zindex = &z;
+    index_insert_tracks(z.numFiles, dbH->numFiles, sNorm, sPower);
+    zindex = 0;
+    z.numFiles = dbH->numFiles;
+    delete[] sNorm;
+    delete[] sPower;
+    stats_phase("serialize");
+    zindex_write(&z, name);
+  }
+  stats_phase(NULL);
+
+  printf("INDEX: done constructing compressed LSH index.\n");
+  printf("INDEX: %ju points in %u tables, %ju bytes as raw point identifiers\n",
+         (uintmax_t) z.npoints, z.ntables, (uintmax_t) (z.npoints * z.ntables * sizeof(Uns32T)));
+  index_report_size(name);
+  fflush(stdout);
+}
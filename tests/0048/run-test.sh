@@ -0,0 +1,55 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+
+${AUDIODB} -d testdb -N
+${AUDIODB} -d testdb -L
+
+# track: 128 x (0,1), (1,0), (0,1)
+intstring 2 > testfeature
+for i in `seq 128`; do floatstring 0 1 >> testfeature; done
+floatstring 1 0 >> testfeature
+floatstring 0 1 >> testfeature
+
+# track: 130 x (1,0)
+intstring 2 > testfeature2
+for i in `seq 130`; do floatstring 1 0 >> testfeature2; done
+
+${AUDIODB} -d testdb -I -f testfeature -k testfeature
+${AUDIODB} -d testdb -I -f testfeature2 -k testfeature2
+
+# query: 128 x (0,0.5), (0.5,0)
+intstring 2 > testquery
+for i in `seq 128`; do floatstring 0 0.5 >> testquery; done
+floatstring 0.5 0 >> testquery
+
+# -l 128 selects the FFT search
+${AUDIODB} -d testdb -Q sequence -l 128 -f testquery -p 0 -R 0.02 > testoutput
+echo testfeature 1 > test-expected-output
+cmp testoutput test-expected-output
+
+${AUDIODB} -d testdb -Q sequence -l 128 -f testquery -e -R 0.02 > testoutput
+echo testfeature 2 > test-expected-output
+cmp testoutput test-expected-output
+
+echo testfeature2 > test-restrict-list
+${AUDIODB} -d testdb -Q sequence -l 128 -f testquery -p 0 -R 0.02 -K test-restrict-list > testoutput
+cat /dev/null > test-expected-output
+cmp testoutput test-expected-output
+
+# sequences longer than 1000 only for sequence searches
+intstring 2 > testfeature3
+for i in `seq 1001`; do floatstring 0 1 >> testfeature3; done
+${AUDIODB} -d testdb -I -f testfeature3 -k testfeature3
+
+expect_clean_error_exit ${AUDIODB} -d testdb -Q point -l 1001 -f testfeature3
+expect_clean_error_exit ${AUDIODB} -d testdb -Q sequence -l 8001 -f testfeature3
+expect_clean_error_exit ${AUDIODB} -d testdb -X -l 1001 -R 0.02
+
+${AUDIODB} -d testdb -Q sequence -l 1001 -f testfeature3 -p 0 -R 0.02 > testoutput
+echo testfeature3 1 > test-expected-output
+cmp testoutput test-expected-output
+
+exit 104
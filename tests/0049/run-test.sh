@@ -0,0 +1,48 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+
+${AUDIODB} -d testdb -N
+
+# track: B A A A B, with A = (0,1) and B = (1,0)
+intstring 2 > testfeature
+floatstring 1 0 >> testfeature
+floatstring 0 1 >> testfeature
+floatstring 0 1 >> testfeature
+floatstring 0 1 >> testfeature
+floatstring 1 0 >> testfeature
+
+${AUDIODB} -d testdb -I -f testfeature
+
+# query: A A B B
+intstring 2 > testquery
+floatstring 0 1 >> testquery
+floatstring 0 1 >> testquery
+floatstring 1 0 >> testquery
+floatstring 1 0 >> testquery
+
+expect_clean_error_exit ${AUDIODB} -d testdb -Q warpsequence -l 4 -f testquery -x 0.5
+
+# no warping: A A A B is the best match, one frame out
+${AUDIODB} -d testdb -Q warpsequence -l 4 -f testquery -x 1.0 -n 1 > testoutput
+echo testfeature 0.5 > test-expected-output
+echo 0.5 0 1 >> test-expected-output
+cmp testoutput test-expected-output
+
+# warping by up to 1.5 aligns A A A B exactly
+${AUDIODB} -d testdb -Q warpsequence -l 4 -f testquery -x 1.5 -n 1 > testoutput
+echo testfeature 0 > test-expected-output
+echo 0 0 1 >> test-expected-output
+cmp testoutput test-expected-output
+
+${AUDIODB} -d testdb -Q warpsequence -l 4 -f testquery -x 1.5 -n 1 --warp_no_bounds > testoutput
+cmp testoutput test-expected-output
+
+${AUDIODB} -d testdb -Q warpsequence -l 4 -f testquery -x 1.5 -R 0.1 > testoutput
+echo testfeature 1 > test-expected-output
+echo 0 0 1 >> test-expected-output
+cmp testoutput test-expected-output
+
+exit 104
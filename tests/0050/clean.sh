@@ -0,0 +1,5 @@
+#! /bin/sh
+
+if [ -d testdb.cache ]; then
+    rm -rf testdb.cache
+fi
@@ -0,0 +1,57 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+rm -rf testdb.cache
+
+${AUDIODB} -d testdb -N
+
+intstring 2 > testfeature
+floatstring 0 1 >> testfeature
+floatstring 1 0 >> testfeature
+
+${AUDIODB} -d testdb -I -f testfeature
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+
+echo testfeature 0.5 0 0 > test-expected-output
+echo testfeature 0 0 1 >> test-expected-output
+
+# miss, then hit
+${AUDIODB} -d testdb -Q point -f testquery --cache > testoutput
+cmp testoutput test-expected-output
+${AUDIODB} -d testdb -Q point -f testquery --cache > testoutput
+cmp testoutput test-expected-output
+grep "hits 1 misses 1" testdb.cache/stats
+
+# a different query spec misses
+${AUDIODB} -d testdb -Q point -f testquery -n 1 --cache > testoutput
+echo testfeature 0.5 0 0 > test-expected-output1
+cmp testoutput test-expected-output1
+grep "hits 1 misses 2" testdb.cache/stats
+
+# insertion invalidates
+intstring 2 > testfeature2
+floatstring 0 -1 >> testfeature2
+${AUDIODB} -d testdb -I -f testfeature2
+
+${AUDIODB} -d testdb -Q point -f testquery --cache > testoutput
+echo testfeature2 -0.5 0 0 >> test-expected-output
+cmp testoutput test-expected-output
+grep "hits 1 misses 3" testdb.cache/stats
+
+# searches not made by the library are not cached: refused
+expect_clean_error_exit ${AUDIODB} -d testdb -Q sequence -l 1 -f testquery --rotate 1 --cache
+expect_clean_error_exit ${AUDIODB} -d testdb -Q warpsequence -l 1 -f testquery --cache
+grep "hits 1 misses 3" testdb.cache/stats
+
+# a cache that cannot be used misses, and the query still succeeds
+rm -rf testdb.cache
+touch testdb.cache
+${AUDIODB} -d testdb -Q point -f testquery --cache > testoutput
+cmp testoutput test-expected-output
+rm -f testdb.cache
+
+exit 104
@@ -0,0 +1,71 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+
+${AUDIODB} -d testdb -N
+
+intstring 2 > testfeature01
+floatstring 0 1 >> testfeature01
+intstring 2 > testfeature10
+floatstring 1 0 >> testfeature10
+
+cat > testfeaturefiles <<EOF2
+testfeature01
+testfeature10
+testfeature01
+EOF2
+
+${AUDIODB} -d testdb -B -F testfeaturefiles
+${AUDIODB} -d testdb -S | grep "num files:2"
+
+# a second batch of existing keys is skipped
+${AUDIODB} -d testdb -B -F testfeaturefiles
+${AUDIODB} -d testdb -S | grep "num files:2"
+
+# sequence queries require L2NORM
+${AUDIODB} -d testdb -L
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+
+# text keyList, with a key not in the database
+echo testfeature10 > testkl.txt
+echo testfeature11 >> testkl.txt
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -K testkl.txt > testoutput
+echo testfeature10 2 0 0 > test-expected-output
+cmp testoutput test-expected-output
+
+# binary keyList: "ADBK", a count of 1, and track index 1 (little-endian)
+printf 'KBDA\001\000\000\000\001\000\000\000' > testkl.bin
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -K testkl.bin > testoutput
+cmp testoutput test-expected-output
+
+printf 'KBDA\002\000\000\000\000\000\000\000\001\000\000\000' > testkl.bin
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -K testkl.bin > testoutput
+echo testfeature01 0 0 0 > test-expected-output
+echo testfeature10 2 0 0 >> test-expected-output
+cmp testoutput test-expected-output
+
+printf 'KBDA\001\000\000\000\002\000\000\000' > testkl.bin
+expect_clean_error_exit ${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -K testkl.bin
+
+# insertion keeps the key hash up to date; queries never write it
+ls testdb.keys
+rm -f testdb.keys
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -K testkl.txt > testoutput
+echo testfeature10 2 0 0 > test-expected-output
+cmp testoutput test-expected-output
+if [ -f testdb.keys ]; then exit 1; fi
+
+intstring 2 > testfeature11
+floatstring 0 1 >> testfeature11
+${AUDIODB} -d testdb -I -f testfeature11
+ls testdb.keys
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -K testkl.txt > testoutput
+echo testfeature11 0 0 0 > test-expected-output
+echo testfeature10 2 0 0 >> test-expected-output
+cmp testoutput test-expected-output
+
+exit 104
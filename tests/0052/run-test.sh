@@ -0,0 +1,93 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+for db in testdb1 testdb2 testdb3; do
+  if [ -f ${db} ]; then rm -f ${db}; fi
+  ${AUDIODB} -d ${db} -N
+done
+
+intstring 2 > testfeature01
+floatstring 0 1 >> testfeature01
+intstring 2 > testfeature10
+floatstring 1 0 >> testfeature10
+
+${AUDIODB} -d testdb1 -I -f testfeature01
+${AUDIODB} -d testdb2 -I -f testfeature10
+${AUDIODB} -d testdb3 -I -f testfeature10 -k testfeature01
+
+# sequence queries require L2NORM
+for db in testdb1 testdb2 testdb3; do
+  ${AUDIODB} -d ${db} -L
+done
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+
+echo testfeature01 0 0 0 > test-expected-output
+echo testfeature10 2 0 0 >> test-expected-output
+
+${AUDIODB} -d testdb1 -d testdb2 -Q sequence -l 1 -f testquery > testoutput
+cmp testoutput test-expected-output
+
+cat > testshards <<EOF2
+# shard manifest
+testdb1
+
+testdb2
+EOF2
+${AUDIODB} -d @testshards -Q sequence -l 1 -f testquery > testoutput
+cmp testoutput test-expected-output
+
+echo testfeature10 > testkl.txt
+${AUDIODB} -d testdb1 -d testdb2 -Q sequence -l 1 -f testquery -K testkl.txt > testoutput
+echo testfeature10 2 0 0 > test-expected-output
+cmp testoutput test-expected-output
+
+${AUDIODB} -d testdb1 -d testdb2 -Q sequence -l 1 -k testfeature10 > testoutput
+echo testfeature01 2 0 0 > test-expected-output
+cmp testoutput test-expected-output
+
+# the key is left out only in the database it was taken from
+${AUDIODB} -d testdb1 -d testdb3 -Q sequence -l 1 -k testfeature01 > testoutput
+echo testdb3:testfeature01 2 0 0 > test-expected-output
+cmp testoutput test-expected-output
+
+# a comma in a database name is escaped
+if [ -f test,db ]; then rm -f test,db; fi
+${AUDIODB} -d 'test\,db' -N
+ls test,db
+${AUDIODB} -d 'test\,db' -I -f testfeature01
+${AUDIODB} -d 'test\,db' -L
+${AUDIODB} -d 'test\,db' -Q sequence -l 1 -f testquery > testoutput
+echo testfeature01 0 0 0 > test-expected-output
+cmp testoutput test-expected-output
+${AUDIODB} --database='test\,db' -Q sequence -l 1 -f testquery > testoutput
+cmp testoutput test-expected-output
+rm -f test,db
+
+# only queries read manifests
+if [ -f @testdb ]; then rm -f @testdb; fi
+${AUDIODB} -d @testdb -N
+${AUDIODB} -d @testdb -I -f testfeature01
+${AUDIODB} -d @testdb -S | grep "num files:1"
+${AUDIODB} -d ./@testdb -L
+${AUDIODB} -d ./@testdb -Q sequence -l 1 -f testquery > testoutput
+cmp testoutput test-expected-output
+rm -f @testdb
+
+# the databases are shared between --threads threads
+${AUDIODB} -d testdb1 -d testdb2 -Q sequence -l 1 -f testquery --threads 1 > testoutput
+echo testfeature01 0 0 0 > test-expected-output
+echo testfeature10 2 0 0 >> test-expected-output
+cmp testoutput test-expected-output
+
+# keys present in more than one database are qualified
+${AUDIODB} -d testdb1 -d testdb3 -Q sequence -l 1 -f testquery > testoutput
+echo testdb1:testfeature01 0 0 0 > test-expected-output
+echo testdb3:testfeature01 2 0 0 >> test-expected-output
+cmp testoutput test-expected-output
+
+expect_clean_error_exit ${AUDIODB} -d testdb1 -d testdb2 -S
+
+exit 104
@@ -0,0 +1,42 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+
+${AUDIODB} -d testdb -N
+
+intstring 2 > testfeature01
+floatstring 0 1 >> testfeature01
+intstring 2 > testfeature10
+floatstring 1 0 >> testfeature10
+
+cat > testfeaturefiles <<EOF2
+testfeature01
+testfeature10
+testfeature01
+EOF2
+
+${AUDIODB} -d testdb -B -F testfeaturefiles --stats 2> teststats
+grep '"command": "--BATCHINSERT"' teststats
+grep '"insert": {"wall": ' teststats
+grep '"tracks": 2' teststats
+grep '"duplicates": 1' teststats
+grep '"peak_rss_kb": ' teststats
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+
+echo testfeature01 0.5 0 0 > test-expected-output
+echo testfeature10 0 0 0 >> test-expected-output
+
+# the statistics go to stderr, leaving the results unchanged
+${AUDIODB} -d testdb -Q point -f testquery --stats > testoutput 2> teststats
+cmp testoutput test-expected-output
+grep '"command": "--QUERY"' teststats
+for phase in open datum search reporter report; do
+  grep "\"${phase}\": {\"wall\": " teststats
+done
+grep '"results": 2' teststats
+
+exit 104
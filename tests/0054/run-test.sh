@@ -0,0 +1,71 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+
+${AUDIODB} -d testdb -N
+
+intstring 2 > testfeature
+floatstring 0 1 >> testfeature
+floatstring 1 0 >> testfeature
+
+${AUDIODB} -d testdb -I -f testfeature
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+
+${AUDIODB} -d testdb -Q point -f testquery > testoutput
+echo testfeature 0.5 0 0 > test-expected-output
+echo testfeature 0 0 1 >> test-expected-output
+cmp testoutput test-expected-output
+
+# rotated queries are copied rather than used in place: every
+# rotation of this query is the query itself, and its file is unchanged
+intstring 2 > testquery
+floatstring 0.5 0.5 >> testquery
+cp testquery testquery.orig
+${AUDIODB} -d testdb -Q point -f testquery --rotate 1 > testoutput
+cut -d' ' -f1-4 testoutput | sort -u > testoutput.sorted
+echo testfeature 0.5 0 0 > test-expected-output
+echo testfeature 0.5 0 1 >> test-expected-output
+cmp testoutput.sorted test-expected-output
+cmp testquery testquery.orig
+
+# a query with a partial vector
+intstring 2 > testquery
+floatstring 0 0.5 0 >> testquery
+expect_clean_error_exit ${AUDIODB} -d testdb -Q point -f testquery
+
+# a query with no dimension
+printf '\000\000\000\000' > testquery
+expect_clean_error_exit ${AUDIODB} -d testdb -Q point -f testquery
+
+# power files must hold exactly one power per vector
+if [ -f testdb2 ]; then rm -f testdb2; fi
+${AUDIODB} -d testdb2 -N
+${AUDIODB} -d testdb2 -P
+
+intstring 1 > testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+intstring 1 > testpowerlong
+floatstring -0.5 -0.5 -0.5 >> testpowerlong
+intstring 1 > testpowershort
+floatstring -0.5 >> testpowershort
+
+expect_clean_error_exit ${AUDIODB} -d testdb2 -I -f testfeature -w testpowerlong
+expect_clean_error_exit ${AUDIODB} -d testdb2 -I -f testfeature -w testpowershort
+${AUDIODB} -d testdb2 -I -f testfeature -w testpower
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+intstring 1 > testquerypower
+floatstring -0.5 >> testquerypower
+${AUDIODB} -d testdb2 -Q point -f testquery -w testquerypower --absolute-threshold=-1 > testoutput
+echo testfeature 0.5 0 0 > test-expected-output
+echo testfeature 0 0 1 >> test-expected-output
+cmp testoutput test-expected-output
+expect_clean_error_exit ${AUDIODB} -d testdb2 -Q point -f testquery -w testpower --absolute-threshold=-1
+
+exit 104
@@ -0,0 +1,59 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+if [ -f testdb-batch ]; then rm -f testdb-batch; fi
+
+${AUDIODB} -d testdb -N
+${AUDIODB} -d testdb-batch -N
+
+intstring 2 > testfeature01
+floatstring 0 1 >> testfeature01
+floatstring 1 0 >> testfeature01
+intstring 2 > testfeature10
+floatstring 1 0 >> testfeature10
+
+echo 0 1 2 > testtimes01
+echo 0 1 > testtimes10
+
+cat > testfeaturefiles <<EOF2
+testfeature01
+testfeature10
+EOF2
+cat > testtimesfiles <<EOF2
+testtimes01
+testtimes10
+EOF2
+cat > testkeys <<EOF2
+track01
+track10
+EOF2
+
+${AUDIODB} --BULKPACK testcontainer -F testfeaturefiles -T testtimesfiles -K testkeys
+${AUDIODB} -d testdb --BULKLOAD testcontainer
+${AUDIODB} -d testdb-batch -B -F testfeaturefiles -T testtimesfiles -K testkeys
+
+${AUDIODB} -d testdb -S | grep "num files:2"
+${AUDIODB} -d testdb -Z > testoutput
+${AUDIODB} -d testdb-batch -Z > test-expected-output
+cmp testoutput test-expected-output
+
+# loading the container again skips the keys already present
+${AUDIODB} -d testdb --BULKLOAD testcontainer
+${AUDIODB} -d testdb -S | grep "num files:2"
+
+${AUDIODB} -d testdb -L
+${AUDIODB} -d testdb-batch -L
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery > testoutput
+${AUDIODB} -d testdb-batch -Q sequence -l 1 -f testquery > test-expected-output
+cmp testoutput test-expected-output
+
+# a feature file is not a container
+expect_clean_error_exit ${AUDIODB} -d testdb --BULKLOAD testfeature01
+
+exit 104
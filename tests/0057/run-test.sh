@@ -0,0 +1,43 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+
+${AUDIODB} -d testdb -N
+
+intstring 2 > testfeature
+floatstring 0 0.5 >> testfeature
+floatstring 0.5 0 >> testfeature
+
+# binary times: "ADBT", a count of 3, and 0.0, 1.0, 2.0 (little-endian)
+printf 'TBDA\003\000\000\000' > testtimes
+printf '\000\000\000\000\000\000\000\000' >> testtimes
+printf '\000\000\000\000\000\000\360\077' >> testtimes
+printf '\000\000\000\000\000\000\000\100' >> testtimes
+
+# a count that does not match the data is malformed
+printf 'TBDA\004\000\000\000' > testtimes-short
+tail -c 24 testtimes >> testtimes-short
+expect_clean_error_exit ${AUDIODB} -d testdb -I -f testfeature -t testtimes-short
+
+echo 0 1 > testtimes-few
+expect_clean_error_exit ${AUDIODB} -d testdb -I -f testfeature -t testtimes-few
+echo 0 1 2 3 > testtimes-many
+expect_clean_error_exit ${AUDIODB} -d testdb -I -f testfeature -t testtimes-many
+${AUDIODB} -d testdb -S | grep "num files:0"
+
+${AUDIODB} -d testdb -I -f testfeature -t testtimes
+${AUDIODB} -d testdb -S | grep "num files:1"
+
+# sequence queries require L2NORM
+${AUDIODB} -d testdb -L
+
+intstring 2 > testquery
+floatstring 0.5 0 >> testquery
+
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -n 1 > testoutput
+echo testfeature 0 0 1 > test-expected-output
+cmp testoutput test-expected-output
+
+exit 104
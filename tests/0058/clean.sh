@@ -0,0 +1,11 @@
+#! /bin/sh
+
+if [ -d testdump ]; then
+    rm -rf testdump
+fi
+
+if [ -d testdump2 ]; then
+    rm -rf testdump2
+fi
+
+rm -f testdb.times
@@ -0,0 +1,64 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+rm -f testdb.times
+rm -rf testdump testdump2
+
+${AUDIODB} -d testdb -N
+
+intstring 2 > testfeature
+floatstring 0 0.5 >> testfeature
+floatstring 0.5 0 >> testfeature
+floatstring 0 1 >> testfeature
+
+# one track on a regular grid, one off it
+echo 0 0.5 1 1.5 > testtimes
+echo 0 1 2 4 > testtimes2
+
+${AUDIODB} -d testdb -I -f testfeature -t testtimes -k regular
+${AUDIODB} -d testdb -I -f testfeature -t testtimes2 -k irregular
+
+# and one long enough that its times fill whole blocks
+floatstring 0 0.5 > testvector
+for i in $(seq 12); do cat testvector testvector > testvector2; mv testvector2 testvector; done
+intstring 2 > testlong
+cat testvector >> testlong
+seq 0 4096 > testlongtimes
+${AUDIODB} -d testdb -I -f testlong -t testlongtimes -k long
+
+# sequence queries require L2NORM
+${AUDIODB} -d testdb -L
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+floatstring 0.5 0 >> testquery
+echo 0 1 2 > testquerytimes
+
+${AUDIODB} -d testdb -Q sequence -l 2 -f testquery -t testquerytimes > test-expected-output
+${AUDIODB} -d testdb -D --output=testdump
+
+blocks=$(stat -c %b testdb)
+${AUDIODB} -d testdb --COMPACT
+test -f testdb.times
+compacted=$(stat -c %b testdb)
+test ${compacted} -lt ${blocks}
+
+# queries refine by duration from the encoding, and leave the
+# released space alone
+${AUDIODB} -d testdb -Q sequence -l 2 -f testquery -t testquerytimes > testoutput 2> testerror
+cmp testoutput test-expected-output
+if grep -q "run --COMPACT again" testerror; then exit 1; fi
+test $(stat -c %b testdb) -eq ${compacted}
+
+# a dump expands the times again, until the next --COMPACT
+${AUDIODB} -d testdb -D --output=testdump2
+test $(stat -c %b testdb) -gt ${compacted}
+${AUDIODB} -d testdb --COMPACT
+test $(stat -c %b testdb) -eq ${compacted}
+diff -r testdump testdump2
+
+${AUDIODB} -d testdb --COMPACT
+
+exit 104
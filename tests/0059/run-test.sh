@@ -0,0 +1,50 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f resizedb ]; then rm -f resizedb; fi
+
+${AUDIODB} -d resizedb -N --ntracks 2
+
+intstring 2 > testfeature01
+floatstring 0 1 >> testfeature01
+floatstring 1 0 >> testfeature01
+intstring 2 > testfeature10
+floatstring 1 0 >> testfeature10
+intstring 2 > testfeature11
+floatstring 0.5 0.5 >> testfeature11
+
+${AUDIODB} -d resizedb -I -f testfeature01
+${AUDIODB} -d resizedb -I -f testfeature10
+expect_clean_error_exit ${AUDIODB} -d resizedb -I -f testfeature11
+
+# sequence queries require L2NORM
+${AUDIODB} -d resizedb -L
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+
+${AUDIODB} -d resizedb -Q sequence -l 1 -f testquery > test-expected-output
+
+expect_clean_error_exit ${AUDIODB} -d resizedb --RESIZE --ntracks 1
+
+${AUDIODB} -d resizedb --RESIZE --ntracks 3
+${AUDIODB} -d resizedb -S | grep "num files:2"
+${AUDIODB} -d resizedb -Q sequence -l 1 -f testquery > testoutput
+cmp testoutput test-expected-output
+
+${AUDIODB} -d resizedb -I -f testfeature11
+expect_clean_error_exit ${AUDIODB} -d resizedb -I -f testfeature01 -k another
+
+${AUDIODB} -d resizedb -Q sequence -l 1 -f testquery > test-expected-output
+
+# now in place, moving every table after the file table
+${AUDIODB} -d resizedb --RESIZE --resize_in_place --ntracks 5000 --datasize 1356
+${AUDIODB} -d resizedb -S | grep "num files:3"
+${AUDIODB} -d resizedb -Q sequence -l 1 -f testquery > testoutput
+cmp testoutput test-expected-output
+
+${AUDIODB} -d resizedb -I -f testfeature01 -k another
+${AUDIODB} -d resizedb -S | grep "num files:4"
+
+exit 104
@@ -0,0 +1,5 @@
+#! /bin/sh
+
+if [ -d testsnapshot ]; then
+    rm -rf testsnapshot
+fi
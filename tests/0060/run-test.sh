@@ -0,0 +1,38 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+rm -f testdb-restored testdb-corrupt
+rm -rf testsnapshot
+
+${AUDIODB} -d testdb -N
+
+intstring 2 > testfeature01
+floatstring 0 1 >> testfeature01
+floatstring 1 0 >> testfeature01
+intstring 2 > testfeature10
+floatstring 1 0 >> testfeature10
+echo 0 1 2 > testtimes01
+echo 0 1 > testtimes10
+
+${AUDIODB} -d testdb -I -f testfeature01 -t testtimes01
+${AUDIODB} -d testdb -I -f testfeature10 -t testtimes10
+${AUDIODB} -d testdb -L
+
+${AUDIODB} -d testdb -D --snapshot --chunks 3 --output=testsnapshot
+test -f testsnapshot/snapshot
+test -f testsnapshot/snapshot.002
+
+${AUDIODB} -d testdb-restored --RESTORE testsnapshot
+cmp testdb testdb-restored
+
+# an existing database is not overwritten
+expect_clean_error_exit ${AUDIODB} -d testdb-restored --RESTORE testsnapshot
+
+# nor is a damaged snapshot restored
+printf 'X' | dd of=testsnapshot/snapshot.001 bs=1 seek=0 conv=notrunc 2>/dev/null
+expect_clean_error_exit ${AUDIODB} -d testdb-corrupt --RESTORE testsnapshot
+test ! -f testdb-corrupt
+
+exit 104
@@ -0,0 +1,59 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+
+${AUDIODB} -d testdb -N
+${AUDIODB} -d testdb -P
+
+intstring 2 > testfeature
+floatstring 0 1 >> testfeature
+floatstring 1 0 >> testfeature
+
+intstring 1 > testpower
+floatstring -0.5 >> testpower
+floatstring -1 >> testpower
+
+${AUDIODB} -d testdb -I -f testfeature -w testpower
+
+# sequence queries require L2NORM
+${AUDIODB} -d testdb -L
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+
+intstring 1 > testquerypower
+floatstring -0.5 >> testquerypower
+
+# advice to the kernel changes nothing but the paging
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -w testquerypower --absolute-threshold=-0.6 > test-expected-output
+echo testfeature 0 0 0 > testoutput
+cmp testoutput test-expected-output
+
+for access in normal random sequential; do
+  ${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -w testquerypower --absolute-threshold=-0.6 --access=${access} > testoutput
+  cmp testoutput test-expected-output
+  ${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -w testquerypower --absolute-threshold=-0.6 --access=${access} --preload --hugepages > testoutput
+  cmp testoutput test-expected-output
+done
+
+# huge pages apply only to tables audioDB maps itself
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -w testquerypower --absolute-threshold=-0.6 --hugepages 2> testerr > /dev/null
+grep -q "no effect" testerr
+
+# the warped sequence search maps the tables itself
+${AUDIODB} -d testdb -Q warpsequence -l 1 -f testquery > test-expected-output
+for access in normal random sequential; do
+  ${AUDIODB} -d testdb -Q warpsequence -l 1 -f testquery --access=${access} > testoutput
+  cmp testoutput test-expected-output
+  ${AUDIODB} -d testdb -Q warpsequence -l 1 -f testquery --access=${access} --preload --hugepages 2> testerr > testoutput
+  cmp testoutput test-expected-output
+  if grep -q "no effect" testerr; then exit 1; fi
+done
+
+${AUDIODB} -d testdb -S --preload | grep "num files:1"
+
+expect_clean_error_exit ${AUDIODB} -d testdb -S --access=backwards
+
+exit 104
@@ -0,0 +1,53 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+
+# LARGE_ADB, with more tracks than are read ahead
+${AUDIODB} -d testdb -N --ntracks 50000
+${AUDIODB} -d testdb -P
+${AUDIODB} -d testdb -L
+
+rm -f testList.txt pwrList.txt keyList.txt
+for i in 1 2 3 4 5 6 7 8; do
+  intstring 2 > testfeature${i}
+  floatstring 0 1 >> testfeature${i}
+  floatstring 1 0 >> testfeature${i}
+  floatstring 1 0 >> testfeature${i}
+  floatstring 0 1 >> testfeature${i}
+
+  intstring 1 > testpower${i}
+  floatstring -0.5 >> testpower${i}
+  floatstring -1 >> testpower${i}
+  floatstring -1 >> testpower${i}
+  floatstring -0.5 >> testpower${i}
+
+  echo testfeature${i} >> testList.txt
+  echo testpower${i} >> pwrList.txt
+  echo key${i} >> keyList.txt
+done
+
+${AUDIODB} -d testdb -B -F testList.txt -W pwrList.txt -K keyList.txt
+rm testList.txt pwrList.txt keyList.txt
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+floatstring 0 0.5 >> testquery
+floatstring 0.5 0 >> testquery
+
+${AUDIODB} -d testdb -X -R 1 -l 1 --stats 2> teststats
+grep '"track files opened": 16' teststats
+
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -w testpower1 -R 1 --absolute-threshold -4.5 | sort > testoutput
+rm -f test-expected-output
+for i in 1 2 3 4 5 6 7 8; do
+  echo key${i} 1 >> test-expected-output
+done
+cmp testoutput test-expected-output
+
+# a power file must have exactly one value per vector
+floatstring -1 >> testpower8
+expect_clean_error_exit ${AUDIODB} -d testdb -X -R 1 -l 2
+
+exit 104
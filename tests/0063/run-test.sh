@@ -0,0 +1,81 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+rm -f testdb.pack
+
+# Make LARGE_ADB
+${AUDIODB} -d testdb -N --ntracks 50000
+${AUDIODB} -d testdb -P
+${AUDIODB} -d testdb -L
+
+rm -f testList.txt pwrList.txt keyList.txt
+for i in 1 2; do
+  intstring 2 > testfeature${i}
+  floatstring 0 1 >> testfeature${i}
+  floatstring 1 0 >> testfeature${i}
+  floatstring 1 0 >> testfeature${i}
+  floatstring 0 1 >> testfeature${i}
+
+  intstring 1 > testpower${i}
+  floatstring -0.5 >> testpower${i}
+  floatstring -1 >> testpower${i}
+  floatstring -1 >> testpower${i}
+  floatstring -0.5 >> testpower${i}
+
+  echo testfeature${i} >> testList.txt
+  echo testpower${i} >> pwrList.txt
+  echo key${i} >> keyList.txt
+done
+
+${AUDIODB} -d testdb -B -F testList.txt -W pwrList.txt -K keyList.txt
+rm testList.txt pwrList.txt keyList.txt
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+floatstring 0 0.5 >> testquery
+floatstring 0.5 0 >> testquery
+
+${AUDIODB} -d testdb -Q warpsequence -l 2 -f testquery > test-expected-warp
+
+${AUDIODB} -d testdb --PACK
+test -f testdb.pack
+
+# a file rewritten since, even at the same length, is read from the file
+cp testfeature1 testfeature1.orig
+intstring 2 > testfeature1
+floatstring 1 0 >> testfeature1
+floatstring 0 1 >> testfeature1
+floatstring 0 1 >> testfeature1
+floatstring 1 0 >> testfeature1
+touch -d @$(( $(date +%s) + 60 )) testfeature1
+${AUDIODB} -d testdb -Q warpsequence -l 2 -f testquery --stats > testoutput 2> teststats
+grep '"stale packed tracks": 1' teststats
+cp testfeature1.orig testfeature1
+
+# the pack stands in for the files it was made from
+rm testfeature1 testfeature2 testpower1 testpower2
+
+${AUDIODB} -d testdb -Q warpsequence -l 2 -f testquery > testoutput
+cmp testoutput test-expected-warp
+
+# LARGE_ADB requires an INDEX
+${AUDIODB} -d testdb -X -R 1 -l 1
+
+intstring 1 > testquerypower
+floatstring -0.5 >> testquerypower
+floatstring -1 >> testquerypower
+floatstring -1 >> testquerypower
+
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -w testquerypower -R 1 --absolute-threshold -4.5 > testoutput
+echo key1 1 > test-expected-output
+echo key2 1 >> test-expected-output
+cmp testoutput test-expected-output
+
+# only LARGE_ADB databases are packed
+if [ -f testdb2 ]; then rm -f testdb2; fi
+${AUDIODB} -d testdb2 -N
+expect_clean_error_exit ${AUDIODB} -d testdb2 --PACK
+
+exit 104
@@ -0,0 +1,61 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+
+${AUDIODB} -d testdb -N
+${AUDIODB} -d testdb -L
+
+# track: 128 x (0,1), (1,0), (0,1)
+intstring 2 > testfeature
+for i in `seq 128`; do floatstring 0 1 >> testfeature; done
+floatstring 1 0 >> testfeature
+floatstring 0 1 >> testfeature
+
+# track: 130 x (1,0)
+intstring 2 > testfeature2
+for i in `seq 130`; do floatstring 1 0 >> testfeature2; done
+
+${AUDIODB} -d testdb -I -f testfeature -k testfeature
+${AUDIODB} -d testdb -I -f testfeature2 -k testfeature2
+
+# query: 128 x (0,0.5), (0.5,0)
+intstring 2 > testquery
+for i in `seq 128`; do floatstring 0 0.5 >> testquery; done
+floatstring 0.5 0 >> testquery
+
+# query: 129 x (0.5,0)
+intstring 2 > testquery2
+for i in `seq 129`; do floatstring 0.5 0 >> testquery2; done
+
+echo testquery > testquerylist
+echo testquery2 >> testquerylist
+
+# the queries of a list report as they would one at a time
+for l in 128 2; do
+  echo testquery > test-expected-output
+  ${AUDIODB} -d testdb -Q sequence -l ${l} -f testquery -e -R 0.02 >> test-expected-output
+  echo testquery2 >> test-expected-output
+  ${AUDIODB} -d testdb -Q sequence -l ${l} -f testquery2 -e -R 0.02 >> test-expected-output
+
+  ${AUDIODB} -d testdb -Q sequence -l ${l} -F testquerylist -e -R 0.02 > testoutput
+  cmp testoutput test-expected-output
+done
+
+echo testquery > test-expected-output
+${AUDIODB} -d testdb -Q nsequence -l 128 -f testquery -e >> test-expected-output
+echo testquery2 >> test-expected-output
+${AUDIODB} -d testdb -Q nsequence -l 128 -f testquery2 -e >> test-expected-output
+${AUDIODB} -d testdb -Q nsequence -l 128 -F testquerylist -e > testoutput
+cmp testoutput test-expected-output
+
+# in one pass over the database
+${AUDIODB} -d testdb -Q sequence -l 128 -F testquerylist -e -R 0.02 --stats 2> teststats > /dev/null
+grep '"scans": 1' teststats
+grep '"queries": 2' teststats
+
+expect_clean_error_exit ${AUDIODB} -d testdb -Q point -F testquerylist
+expect_clean_error_exit ${AUDIODB} -d testdb -Q sequence -l 128 -F testquerylist -f testquery
+
+exit 104
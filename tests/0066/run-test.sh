@@ -0,0 +1,57 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+
+${AUDIODB} -d testdb -N
+${AUDIODB} -d testdb -L
+
+# a long track, split between threads: (0,1) but for (1,0) at 500,
+# 1500 and 2500
+intstring 2 > testfeature
+for i in `seq 0 2999`; do
+  case ${i} in
+    500|1500|2500) floatstring 1 0 >> testfeature;;
+    *) floatstring 0 1 >> testfeature;;
+  esac
+done
+
+# track: 128 x (0,1), (1,0), (0,1)
+intstring 2 > testfeature2
+for i in `seq 128`; do floatstring 0 1 >> testfeature2; done
+floatstring 1 0 >> testfeature2
+floatstring 0 1 >> testfeature2
+
+${AUDIODB} -d testdb -I -f testfeature -k testfeature
+${AUDIODB} -d testdb -I -f testfeature2 -k testfeature2
+
+# query: 127 x (0,0.5), (0.5,0)
+intstring 2 > testquery
+for i in `seq 127`; do floatstring 0 0.5 >> testquery; done
+floatstring 0.5 0 >> testquery
+
+${AUDIODB} -d testdb -Q sequence -l 128 -f testquery -e -R 0.02 > testoutput
+echo testfeature 3 > test-expected-output
+echo testfeature2 1 >> test-expected-output
+cmp testoutput test-expected-output
+
+# several threads report as one does
+for args in "-Q sequence -e -R 0.02" "-Q sequence -p 0" "-Q nsequence -e -n 5" "-Q nsequence -e -R 0.02"; do
+  ${AUDIODB} -d testdb -l 128 -f testquery ${args} > test-expected-output
+  for t in 2 4 0; do
+    ${AUDIODB} -d testdb -l 128 -f testquery ${args} --threads ${t} > testoutput
+    cmp testoutput test-expected-output
+  done
+done
+
+# the long track is split into tasks
+${AUDIODB} -d testdb -Q sequence -l 128 -f testquery -e -R 0.02 --threads 4 --stats 2> teststats > /dev/null
+grep '"tasks": 5' teststats
+grep '"tracks": 2' teststats
+grep '"steals"' teststats
+grep '"thread_busy_us"' teststats
+
+expect_clean_error_exit ${AUDIODB} -d testdb -Q sequence -l 128 -f testquery -e --threads -1
+
+exit 104
@@ -0,0 +1,47 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+
+${AUDIODB} -d testdb -N
+
+# more tracks than there are rounds
+rm -f testfeaturefiles
+for i in `seq 20`; do
+  intstring 2 > testfeature${i}
+  if [ $((i % 2)) -eq 0 ]; then
+    floatstring 0 1 >> testfeature${i}
+    floatstring 1 0 >> testfeature${i}
+  else
+    floatstring 1 0 >> testfeature${i}
+    floatstring 0 1 >> testfeature${i}
+  fi
+  echo testfeature${i} >> testfeaturefiles
+done
+
+${AUDIODB} -d testdb -B -F testfeaturefiles
+${AUDIODB} -d testdb -L
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+floatstring 0.5 0 >> testquery
+
+# a deadline that does not pass finds the same results, although the
+# tracks are visited in another order, so that equal distances may be
+# listed in another order
+for args in "-Q track -l 1" "-Q nsequence -l 1 -n 2" "-Q sequence -l 1 -R 0.5" "-Q sequence -l 2 -e" "-Q warpsequence -l 2"; do
+  ${AUDIODB} -d testdb -f testquery ${args} -r 20 | sort > test-expected-output
+  ${AUDIODB} -d testdb -f testquery ${args} -r 20 --timeout-ms 600000 2> testerror | sort > testoutput
+  cmp testoutput test-expected-output
+  cmp testerror /dev/null
+done
+
+# one that passes at once leaves results, if any, marked as partial
+${AUDIODB} -d testdb -f testquery -Q track -l 1 --timeout-ms 1 > testoutput 2> testerror
+if [ -s testerror ]; then grep '^partial results: ' testerror; fi
+
+expect_clean_error_exit ${AUDIODB} -d testdb -f testquery -Q track -l 1 --timeout-ms 0
+expect_clean_error_exit ${AUDIODB} -d testdb -f testquery -Q track -l 1 --timeout-ms 1000 --cache
+
+exit 104
@@ -0,0 +1,36 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+
+${AUDIODB} -d testdb -N
+${AUDIODB} -d testdb -L
+
+# every vector of two tracks matches every vector of the query: more
+# points than a megabyte holds
+intstring 2 > testfeature
+for i in `seq 200`; do floatstring 0 1 >> testfeature; done
+intstring 2 > testfeature2
+for i in `seq 200`; do floatstring 0 1 >> testfeature2; done
+floatstring 1 0 >> testfeature2
+
+${AUDIODB} -d testdb -I -f testfeature -k testfeature
+${AUDIODB} -d testdb -I -f testfeature2 -k testfeature2
+
+intstring 2 > testquery
+for i in `seq 200`; do floatstring 0 0.5 >> testquery; done
+
+# spilled results are reported as those held in memory
+for n in 1 3 10; do
+  ${AUDIODB} -d testdb -Q nsequence -l 1 -e -R 0.5 -n ${n} -f testquery > test-expected-output
+  ${AUDIODB} -d testdb -Q nsequence -l 1 -e -R 0.5 -n ${n} -f testquery --reporter_memory 1 > testoutput
+  cmp testoutput test-expected-output
+done
+
+${AUDIODB} -d testdb -Q nsequence -l 1 -e -R 0.5 -n 3 -f testquery --reporter_memory 1 --stats 2> teststats > /dev/null
+grep '"spilled"' teststats
+
+expect_clean_error_exit ${AUDIODB} -d testdb -Q nsequence -l 1 -e -R 0.5 -f testquery --reporter_memory -1
+
+exit 104
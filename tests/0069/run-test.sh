@@ -0,0 +1,60 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+
+${AUDIODB} -d testdb -N
+${AUDIODB} -d testdb -P
+
+intstring 2 > testfeature1
+floatstring 0 1 >> testfeature1
+floatstring 1 0 >> testfeature1
+floatstring 1 0 >> testfeature1
+floatstring 0 1 >> testfeature1
+
+intstring 2 > testfeature2
+floatstring 1 0 >> testfeature2
+floatstring 1 0 >> testfeature2
+floatstring 1 0 >> testfeature2
+floatstring 1 0 >> testfeature2
+
+intstring 1 > testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+
+${AUDIODB} -d testdb -I -f testfeature1 -w testpower
+${AUDIODB} -d testdb -I -f testfeature2 -w testpower
+${AUDIODB} -d testdb -L
+
+${AUDIODB} -d testdb -X -l 1 -R 1
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+floatstring 0 0.5 >> testquery
+floatstring 0.5 0 >> testquery
+
+# every table's candidates, evaluated track by track
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --lsh_exact > testoutput
+echo testfeature1 3 > test-expected-output
+echo testfeature2 1 >> test-expected-output
+cmp testoutput test-expected-output
+
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -p 0 -R 1 --lsh_exact > testoutput
+echo testfeature1 1 > test-expected-output
+cmp testoutput test-expected-output
+
+echo testfeature2 > testkl.txt
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --lsh_exact -K testkl.txt > testoutput
+echo testfeature2 1 > test-expected-output
+cmp testoutput test-expected-output
+
+# a deadline is checked between tracks
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --lsh_exact --timeout-ms 100000 > testoutput
+echo testfeature1 3 > test-expected-output
+echo testfeature2 1 >> test-expected-output
+cmp testoutput test-expected-output
+
+exit 104
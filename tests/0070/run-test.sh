@@ -0,0 +1,63 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+rm -f testdb.lsh.*
+
+${AUDIODB} -d testdb -N
+${AUDIODB} -d testdb -P
+
+intstring 2 > testfeature1
+floatstring 0 1 >> testfeature1
+floatstring 1 0 >> testfeature1
+floatstring 1 0 >> testfeature1
+floatstring 0 1 >> testfeature1
+
+intstring 2 > testfeature2
+floatstring 1 0 >> testfeature2
+floatstring 1 0 >> testfeature2
+floatstring 1 0 >> testfeature2
+floatstring 1 0 >> testfeature2
+
+intstring 1 > testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+
+${AUDIODB} -d testdb -I -f testfeature1 -w testpower
+${AUDIODB} -d testdb -I -f testfeature2 -w testpower
+${AUDIODB} -d testdb -L
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+floatstring 0 0.5 >> testquery
+floatstring 0.5 0 >> testquery
+
+# the first tables of a compressed index, and only of one
+${AUDIODB} -d testdb -X -l 1 -R 1
+expect_clean_error_exit ${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --lsh_tables 1
+expect_clean_error_exit ${AUDIODB} -d testdb -X -l 1 -R 1 --lsh_tables 1
+
+${AUDIODB} -d testdb -X -l 1 -R 1 --lsh_compress
+
+# identical shingles share a bucket in every table, so one finds them
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --lsh_tables 1 --stats > testoutput 2> teststats
+echo testfeature1 3 > test-expected-output
+echo testfeature2 1 >> test-expected-output
+cmp testoutput test-expected-output
+grep '"index_tables": 1,' teststats
+grep '"index_table_bytes": ' teststats
+
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --lsh_tables 10 > testoutput
+cmp testoutput test-expected-output
+
+# no more tables than the index has, and only for sequence radius searches
+expect_clean_error_exit ${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --lsh_tables 11
+expect_clean_error_exit ${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --lsh_tables 0
+expect_clean_error_exit ${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e --lsh_tables 1
+expect_clean_error_exit ${AUDIODB} -d testdb -Q track -l 1 -f testquery -e -R 1 --lsh_tables 1
+expect_clean_error_exit ${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --lsh_tables 1 --cache
+
+exit 104
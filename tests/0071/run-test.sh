@@ -0,0 +1,55 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+rm -f testdb.lsh.*
+
+${AUDIODB} -d testdb -N --datadim 3
+${AUDIODB} -d testdb -P
+
+intstring 3 > testfeature1
+floatstring 1 0 0 >> testfeature1
+floatstring 0 1 0 >> testfeature1
+floatstring 0 0 1 >> testfeature1
+floatstring 1 0 0 >> testfeature1
+
+intstring 3 > testfeature2
+floatstring 1 1 0 >> testfeature2
+floatstring 0 1 0 >> testfeature2
+floatstring 1 1 0 >> testfeature2
+floatstring 1 1 0 >> testfeature2
+
+intstring 1 > testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+
+${AUDIODB} -d testdb -I -f testfeature1 -w testpower
+${AUDIODB} -d testdb -I -f testfeature2 -w testpower
+${AUDIODB} -d testdb -L
+
+intstring 3 > testquery
+floatstring 0 0 1 >> testquery
+floatstring 1 1 0 >> testquery
+
+# every rotation of each query vector, searched by the library
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 0.5 --rotate > testoutput
+echo testfeature2 2 > test-expected-output
+echo testfeature1 1 >> test-expected-output
+cmp testoutput test-expected-output
+
+# and from a single lookup in the rotation-invariant index
+${AUDIODB} -d testdb -X -l 1 -R 0.5 --rotation-invariant
+ls testdb.lsh.*.rot > /dev/null
+
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 0.5 --rotate > testoutput
+cmp testoutput test-expected-output
+
+# unrotated queries do not use it
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -p 1 -R 0.5 > testoutput
+echo testfeature2 1 > test-expected-output
+cmp testoutput test-expected-output
+
+exit 104
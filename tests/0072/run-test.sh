@@ -0,0 +1,60 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+
+${AUDIODB} -d testdb -N
+${AUDIODB} -d testdb -P
+
+intstring 2 > testfeature1
+floatstring 0 1 >> testfeature1
+floatstring 1 0 >> testfeature1
+floatstring 1 0 >> testfeature1
+floatstring 0 1 >> testfeature1
+
+intstring 2 > testfeature2
+floatstring 1 0 >> testfeature2
+floatstring 1 0 >> testfeature2
+floatstring 1 0 >> testfeature2
+floatstring 1 0 >> testfeature2
+
+intstring 1 > testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+
+${AUDIODB} -d testdb -I -f testfeature1 -w testpower
+${AUDIODB} -d testdb -I -f testfeature2 -w testpower
+${AUDIODB} -d testdb -L
+
+# shingles built on several threads
+${AUDIODB} -d testdb -X -l 1 -R 1 --threads 3
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+floatstring 0 0.5 >> testquery
+floatstring 0.5 0 >> testquery
+
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --lsh_exact > testoutput
+echo testfeature1 3 > test-expected-output
+echo testfeature2 1 >> test-expected-output
+cmp testoutput test-expected-output
+
+# tracks inserted later are added to the index with their own norms
+intstring 2 > testfeature3
+floatstring 0 1 >> testfeature3
+floatstring 0 1 >> testfeature3
+floatstring 0 1 >> testfeature3
+floatstring 0 1 >> testfeature3
+
+${AUDIODB} -d testdb -I -f testfeature3 -w testpower
+${AUDIODB} -d testdb -X -l 1 -R 1 --threads 3
+
+echo testfeature3 > testkl.txt
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --lsh_exact -K testkl.txt > testoutput
+echo testfeature3 2 > test-expected-output
+cmp testoutput test-expected-output
+
+exit 104
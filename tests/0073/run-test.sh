@@ -0,0 +1,96 @@
+#! /bin/bash
+
+. ../test-utils.sh
+
+if [ -f testdb ]; then rm -f testdb; fi
+rm -f testdb.lsh.*
+
+${AUDIODB} -d testdb -N
+${AUDIODB} -d testdb -P
+
+intstring 2 > testfeature1
+floatstring 0 1 >> testfeature1
+floatstring 1 0 >> testfeature1
+floatstring 1 0 >> testfeature1
+floatstring 0 1 >> testfeature1
+
+intstring 2 > testfeature2
+floatstring 1 0 >> testfeature2
+floatstring 1 0 >> testfeature2
+floatstring 1 0 >> testfeature2
+floatstring 1 0 >> testfeature2
+
+intstring 1 > testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+floatstring -0.5 >> testpower
+
+${AUDIODB} -d testdb -I -f testfeature1 -w testpower
+${AUDIODB} -d testdb -I -f testfeature2 -w testpower
+${AUDIODB} -d testdb -L
+
+intstring 2 > testquery
+floatstring 0 0.5 >> testquery
+floatstring 0 0.5 >> testquery
+floatstring 0.5 0 >> testquery
+
+intstring 1 > testquerypower
+floatstring -0.5 >> testquerypower
+floatstring -0.5 >> testquerypower
+floatstring -0.5 >> testquerypower
+
+# queries the batched LSH search does not take, before any index
+${AUDIODB} -d testdb -Q point -f testquery -p 1 > test-expected-point
+${AUDIODB} -d testdb -Q track -l 1 -f testquery -R 1 > test-expected-track
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --absolute-threshold=-1 -w testquerypower > test-expected-threshold
+test -s test-expected-point && test -s test-expected-track && test -s test-expected-threshold
+
+${AUDIODB} -d testdb -X -l 1 -R 1 --lsh_compress > testindex
+grep "bytes as raw point identifiers" testindex
+ls testdb.lsh.*.z
+test $(ls testdb.lsh.* | wc -l) -eq 1
+
+# ignore the compressed index, searching exhaustively as before
+${AUDIODB} -d testdb -Q point -f testquery -p 1 > testoutput
+cmp testoutput test-expected-point
+${AUDIODB} -d testdb -Q track -l 1 -f testquery -R 1 > testoutput
+cmp testoutput test-expected-track
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --absolute-threshold=-1 -w testquerypower > testoutput
+cmp testoutput test-expected-threshold
+
+# the compressed index is read, with or without --lsh_exact
+echo testfeature1 3 > test-expected-output
+echo testfeature2 1 >> test-expected-output
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --lsh_exact --stats > testoutput 2> teststats
+cmp testoutput test-expected-output
+grep '"index_load": {"wall": ' teststats
+grep '"index_bytes": ' teststats
+grep '"index_tables": 10' teststats
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 > testoutput
+cmp testoutput test-expected-output
+
+# a track inserted later is added by decoding the tables and
+# writing them again, keeping the points already indexed
+intstring 2 > testfeature3
+floatstring 0 1 >> testfeature3
+floatstring 0 1 >> testfeature3
+floatstring 0 1 >> testfeature3
+floatstring 0 1 >> testfeature3
+
+${AUDIODB} -d testdb -I -f testfeature3 -w testpower
+${AUDIODB} -d testdb -X -l 1 -R 1 --lsh_compress
+
+echo testfeature3 > testkl.txt
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --lsh_exact -K testkl.txt > testoutput
+echo testfeature3 2 > test-expected-output
+cmp testoutput test-expected-output
+
+echo testfeature1 > testkl.txt
+echo testfeature2 >> testkl.txt
+${AUDIODB} -d testdb -Q sequence -l 1 -f testquery -e -R 1 --lsh_exact -K testkl.txt > testoutput
+echo testfeature1 3 > test-expected-output
+echo testfeature2 1 >> test-expected-output
+cmp testoutput test-expected-output
+
+exit 104